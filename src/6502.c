@@ -9,612 +9,713 @@
  *
  */
 
+#include <pthread.h>
+
 #include "6502.h"
+#include "jit.h"
+#include "profile.h"
+#include "validate.h"
 
-CPUMAP      CPU;
-Instruction inst;
-int         jumping;
-void       *read_addr;
-void       *write_addr;
+/* Decimal mode ADC and SBC results by model, carry, A and operand: A in the low byte, N, V, Z and C in the high byte */
+uint16_t bcd_adc[2][2][0x100][0x100];
+uint16_t bcd_sbc[2][2][0x100][0x100];
 
-/* Sets the symbol in the processor status register */
-static inline void N_flag(int8_t val)
-{
-    CPU.SR.bits.sign = val < 0;
-}
+/* Basic blocks predecoded from memory, found by their start address */
+struct BlockCache {
+        uint32_t index[0x10000];  // Position of the block starting at each address in ops plus one, 0 if none
+        BlockOp  ops[BLOCK_POOL]; // Instructions of the cached blocks
+        uint32_t used;            // Entries of ops in use
+        uint8_t  rebuilds[0x100]; // Invalidations of each page, up to BLOCK_REBUILDS
+        bool     stale;           // Set when blocks were dropped, so the running one may be gone
+};
 
-/* Set the processor status register to zero */
-static inline void Z_flag(uint8_t val)
+/* Instruction table used while the decimal flag is set */
+static Instruction    decimal_instructions[0x100];
+static pthread_once_t decimal_once = PTHREAD_ONCE_INIT;
+
+/* Sign and zero flags of every result byte */
+#define NZ_ENTRY(val) ((val) == 0 ? SR_ZERO : (val) & SR_SIGN)
+#define NZ_4(val)     NZ_ENTRY(val), NZ_ENTRY(val + 1), NZ_ENTRY(val + 2), NZ_ENTRY(val + 3)
+#define NZ_16(val)    NZ_4(val), NZ_4(val + 4), NZ_4(val + 8), NZ_4(val + 12)
+#define NZ_64(val)    NZ_16(val), NZ_16(val + 16), NZ_16(val + 32), NZ_16(val + 48)
+static const uint8_t nz_flags[0x100] = {NZ_64(0), NZ_64(64), NZ_64(128), NZ_64(192)};
+
+/* Set the sign and zero flags of the processor status register from a result */
+static inline void NZ_flag(CPUMAP *cpu, uint8_t val)
 {
-    CPU.SR.bits.zero = val == 0;
+    cpu->SR.byte = (cpu->SR.byte & ~(SR_SIGN | SR_ZERO)) | nz_flags[val];
 }
 
 /* Data stack */
-static inline void stack_push(uint8_t val)
+static inline void stack_push(CPUMAP *cpu, uint8_t val)
 {
-    CPU.memory[0x100 + (CPU.SP--)] = val;
+    cpu->dirty_pages[1] = 1;
+    if (cpu->code_pages[1]) invalidate_code(cpu, 1);
+    cpu->memory[0x100 + (cpu->SP--)] = val;
 }
 
 /* Data pop */
-static inline uint8_t stack_pull(void)
+static inline uint8_t stack_pull(CPUMAP *cpu)
+{
+    return cpu->memory[0x100 + (++cpu->SP)];
+}
+
+/* Get the memory address of the current instruction's operand */
+static inline uint16_t operand_addr(CPUMAP *cpu)
 {
-    return CPU.memory[0x100 + (++CPU.SP)];
+    return get_ptr[cpu->inst->mode](cpu) - cpu->memory;
 }
 
-/* Get the read pointer of the current instruction */
-static inline uint8_t *read_ptr(void)
+/* Read the operand of the current instruction */
+static inline uint8_t read_operand(CPUMAP *cpu)
 {
-    return (uint8_t *)(read_addr = get_ptr[inst.mode]());
+    if (cpu->inst->mode == ACC) return cpu->A;
+    return read_byte(cpu, operand_addr(cpu));
 }
 
-/* Get the write pointer of the current instruction */
-static inline uint8_t *write_ptr(void)
+/* Write the result of the current instruction */
+static inline void write_operand(CPUMAP *cpu, uint8_t val)
 {
-    return (uint8_t *)(write_addr = get_ptr[inst.mode]());
+    if (cpu->inst->mode == ACC)
+        cpu->A = val;
+    else
+        write_byte(cpu, operand_addr(cpu), val);
 }
 
 /* Handling conditional branch jumps */
-static inline void take_branch(void)
+static inline void take_branch(CPUMAP *cpu)
 {
     uint16_t oldPC;
-    oldPC  = CPU.PC + 2;
-    CPU.PC = read_ptr() - CPU.memory;
-    if ((CPU.PC ^ oldPC) & 0xff00) CPU.extra_cycles += 1;
-    CPU.extra_cycles += 1;
+    oldPC   = cpu->PC + 2;
+    cpu->PC = operand_addr(cpu);
+    if ((cpu->PC ^ oldPC) & 0xff00) cpu->extra_cycles += 1;
+    cpu->extra_cycles += 1;
 }
 
 /* ↓Instruction set implementation↓ */
 
-static void inst_ADC(void)
+static void inst_ADC(CPUMAP *cpu)
 {
-    uint8_t      operand = *read_ptr();
-    unsigned int tmp     = CPU.A + operand + (CPU.SR.bits.carry & 1);
-    if (CPU.SR.bits.decimal) {
-        tmp = (CPU.A & 0x0f) + (operand & 0x0f) + (CPU.SR.bits.carry & 1);
-        if (tmp >= 10) tmp = (tmp - 10) | 0x10;
-        tmp += (CPU.A & 0xf0) + (operand & 0xf0);
-        if (tmp > 0x9f) tmp += 0x60;
-    }
-    CPU.SR.bits.carry    = tmp > 0xFF;
-    CPU.SR.bits.overflow = ((CPU.A ^ tmp) & (operand ^ tmp) & 0x80) != 0;
-    CPU.A                = tmp & 0xFF;
-    N_flag(CPU.A);
-    Z_flag(CPU.A);
+    uint8_t      operand  = read_operand(cpu);
+    unsigned int tmp      = cpu->A + operand + (cpu->SR.bits.carry & 1);
+    cpu->SR.bits.carry    = tmp > 0xFF;
+    cpu->SR.bits.overflow = ((cpu->A ^ tmp) & (operand ^ tmp) & 0x80) != 0;
+    cpu->A                = tmp & 0xFF;
+    NZ_flag(cpu, cpu->A);
+}
+
+static void inst_ADC_BCD(CPUMAP *cpu)
+{
+    uint16_t result = bcd_adc[cpu->decimal][cpu->SR.bits.carry][cpu->A][read_operand(cpu)];
+    cpu->A          = result & 0xFF;
+    cpu->SR.byte    = (cpu->SR.byte & ~(SR_SIGN | SR_OVERFLOW | SR_ZERO | SR_CARRY)) | result >> 8;
+    cpu->extra_cycles += cpu->decimal == DECIMAL_CMOS;
 }
 
-static void inst_AND(void)
+static void inst_AND(CPUMAP *cpu)
 {
-    CPU.A &= *read_ptr();
-    N_flag(CPU.A);
-    Z_flag(CPU.A);
+    cpu->A &= read_operand(cpu);
+    NZ_flag(cpu, cpu->A);
 }
 
-static void inst_ASL(void)
+static void inst_ASL(CPUMAP *cpu)
 {
-    uint8_t tmp       = *read_ptr();
-    CPU.SR.bits.carry = (tmp & 0x80) != 0;
+    uint8_t tmp        = read_operand(cpu);
+    cpu->SR.bits.carry = (tmp & 0x80) != 0;
     tmp <<= 1;
-    N_flag(tmp);
-    Z_flag(tmp);
-    *write_ptr() = tmp;
+    NZ_flag(cpu, tmp);
+    write_operand(cpu, tmp);
 }
 
-static void inst_BCC(void)
+static void inst_BCC(CPUMAP *cpu)
 {
-    if (!CPU.SR.bits.carry) { take_branch(); }
+    if (!cpu->SR.bits.carry) { take_branch(cpu); }
 }
 
-static void inst_BCS(void)
+static void inst_BCS(CPUMAP *cpu)
 {
-    if (CPU.SR.bits.carry) { take_branch(); }
+    if (cpu->SR.bits.carry) { take_branch(cpu); }
 }
 
-static void inst_BEQ(void)
+static void inst_BEQ(CPUMAP *cpu)
 {
-    if (CPU.SR.bits.zero) { take_branch(); }
+    if (cpu->SR.bits.zero) { take_branch(cpu); }
 }
 
-static void inst_BIT(void)
+static void inst_BIT(CPUMAP *cpu)
 {
-    uint8_t tmp = *read_ptr();
-    N_flag(tmp);
-    Z_flag(tmp & CPU.A);
-    CPU.SR.bits.overflow = (tmp & 0x40) != 0;
+    uint8_t tmp  = read_operand(cpu);
+    cpu->SR.byte = (cpu->SR.byte & ~(SR_SIGN | SR_ZERO | SR_OVERFLOW)) | (tmp & (SR_SIGN | SR_OVERFLOW)) | (nz_flags[tmp & cpu->A] & SR_ZERO);
 }
 
-static void inst_BMI(void)
+static void inst_BMI(CPUMAP *cpu)
 {
-    if (CPU.SR.bits.sign) { take_branch(); }
+    if (cpu->SR.bits.sign) { take_branch(cpu); }
 }
 
-static void inst_BNE(void)
+static void inst_BNE(CPUMAP *cpu)
 {
-    if (!CPU.SR.bits.zero) { take_branch(); }
+    if (!cpu->SR.bits.zero) { take_branch(cpu); }
 }
 
-static void inst_BPL(void)
+static void inst_BPL(CPUMAP *cpu)
 {
-    if (!CPU.SR.bits.sign) { take_branch(); }
+    if (!cpu->SR.bits.sign) { take_branch(cpu); }
 }
 
-static void inst_BRK(void)
+static void inst_BRK(CPUMAP *cpu)
 {
     uint16_t newPC;
-    memcpy(&newPC, &CPU.memory[IRQ_VEC], sizeof(newPC));
-    CPU.PC += 2;
-    stack_push(CPU.PC >> 8);
-    stack_push(CPU.PC & 0xFF);
-    CPU.SR.bits.brk = 1;
-    stack_push(CPU.SR.byte);
-    CPU.SR.bits.interrupt = 1;
-    CPU.PC                = newPC;
-    jumping               = 1;
+    memcpy(&newPC, &cpu->memory[IRQ_VEC], sizeof(newPC));
+    cpu->PC += 2;
+    stack_push(cpu, cpu->PC >> 8);
+    stack_push(cpu, cpu->PC & 0xFF);
+    cpu->SR.bits.brk = 1;
+    stack_push(cpu, cpu->SR.byte);
+    cpu->SR.bits.interrupt = 1;
+    cpu->PC                = newPC;
+    cpu->jumping           = 1;
 }
 
-static void inst_BVC(void)
+static void inst_BVC(CPUMAP *cpu)
 {
-    if (!CPU.SR.bits.overflow) { take_branch(); }
+    if (!cpu->SR.bits.overflow) { take_branch(cpu); }
 }
 
-static void inst_BVS(void)
+static void inst_BVS(CPUMAP *cpu)
 {
-    if (CPU.SR.bits.overflow) { take_branch(); }
+    if (cpu->SR.bits.overflow) { take_branch(cpu); }
 }
 
-static void inst_CLC(void)
+static void inst_CLC(CPUMAP *cpu)
 {
-    CPU.SR.bits.carry = 0;
+    cpu->SR.bits.carry = 0;
 }
 
-static void inst_CLD(void)
+static void inst_CLD(CPUMAP *cpu)
 {
-    CPU.SR.bits.decimal = 0;
+    cpu->SR.bits.decimal = 0;
+    cpu->table           = instructions;
 }
 
-static void inst_CLI(void)
+static void inst_CLI(CPUMAP *cpu)
 {
-    CPU.SR.bits.interrupt = 0;
+    cpu->SR.bits.interrupt = 0;
 }
 
-static void inst_CLV(void)
+static void inst_CLV(CPUMAP *cpu)
 {
-    CPU.SR.bits.overflow = 0;
+    cpu->SR.bits.overflow = 0;
 }
 
-static void inst_CMP(void)
+static void inst_CMP(CPUMAP *cpu)
 {
-    uint8_t operand = *read_ptr();
-    uint8_t tmpDiff = CPU.A - operand;
-    N_flag(tmpDiff);
-    Z_flag(tmpDiff);
-    CPU.SR.bits.carry = CPU.A >= operand;
+    uint8_t operand = read_operand(cpu);
+    uint8_t tmpDiff = cpu->A - operand;
+    NZ_flag(cpu, tmpDiff);
+    cpu->SR.bits.carry = cpu->A >= operand;
 }
 
-static void inst_CPX(void)
+static void inst_CPX(CPUMAP *cpu)
 {
-    uint8_t operand = *read_ptr();
-    uint8_t tmpDiff = CPU.X - operand;
-    N_flag(tmpDiff);
-    Z_flag(tmpDiff);
-    CPU.SR.bits.carry = CPU.X >= operand;
+    uint8_t operand = read_operand(cpu);
+    uint8_t tmpDiff = cpu->X - operand;
+    NZ_flag(cpu, tmpDiff);
+    cpu->SR.bits.carry = cpu->X >= operand;
 }
 
-static void inst_CPY(void)
+static void inst_CPY(CPUMAP *cpu)
 {
-    uint8_t operand = *read_ptr();
-    uint8_t tmpDiff = CPU.Y - operand;
-    N_flag(tmpDiff);
-    Z_flag(tmpDiff);
-    CPU.SR.bits.carry = CPU.Y >= operand;
+    uint8_t operand = read_operand(cpu);
+    uint8_t tmpDiff = cpu->Y - operand;
+    NZ_flag(cpu, tmpDiff);
+    cpu->SR.bits.carry = cpu->Y >= operand;
 }
 
-static void inst_DEC(void)
+static void inst_DEC(CPUMAP *cpu)
 {
-    uint8_t tmp = *read_ptr();
+    uint8_t tmp = read_operand(cpu);
     tmp--;
-    N_flag(tmp);
-    Z_flag(tmp);
-    *write_ptr() = tmp;
+    NZ_flag(cpu, tmp);
+    write_operand(cpu, tmp);
 }
 
-static void inst_DEX(void)
+static void inst_DEX(CPUMAP *cpu)
 {
-    CPU.X--;
-    N_flag(CPU.X);
-    Z_flag(CPU.X);
+    cpu->X--;
+    NZ_flag(cpu, cpu->X);
 }
 
-static void inst_DEY(void)
+static void inst_DEY(CPUMAP *cpu)
 {
-    CPU.Y--;
-    N_flag(CPU.Y);
-    Z_flag(CPU.Y);
+    cpu->Y--;
+    NZ_flag(cpu, cpu->Y);
 }
 
-static void inst_EOR(void)
+static void inst_EOR(CPUMAP *cpu)
 {
-    CPU.A ^= *read_ptr();
-    N_flag(CPU.A);
-    Z_flag(CPU.A);
+    cpu->A ^= read_operand(cpu);
+    NZ_flag(cpu, cpu->A);
 }
 
-static void inst_INC(void)
+static void inst_INC(CPUMAP *cpu)
 {
-    uint8_t tmp = *read_ptr();
+    uint8_t tmp = read_operand(cpu);
     tmp++;
-    N_flag(tmp);
-    Z_flag(tmp);
-    *write_ptr() = tmp;
+    NZ_flag(cpu, tmp);
+    write_operand(cpu, tmp);
 }
 
-static void inst_INX(void)
+static void inst_INX(CPUMAP *cpu)
 {
-    CPU.X++;
-    N_flag(CPU.X);
-    Z_flag(CPU.X);
+    cpu->X++;
+    NZ_flag(cpu, cpu->X);
 }
 
-static void inst_INY(void)
+static void inst_INY(CPUMAP *cpu)
 {
-    CPU.Y++;
-    N_flag(CPU.Y);
-    Z_flag(CPU.Y);
+    cpu->Y++;
+    NZ_flag(cpu, cpu->Y);
 }
 
-static void inst_JMP(void)
+static void inst_JMP(CPUMAP *cpu)
 {
-    CPU.PC  = read_ptr() - CPU.memory;
-    jumping = 1;
+    cpu->PC      = operand_addr(cpu);
+    cpu->jumping = 1;
 }
 
-static void inst_JSR(void)
+static void inst_JSR(CPUMAP *cpu)
 {
-    uint16_t newPC = read_ptr() - CPU.memory;
-    CPU.PC += 2;
-    stack_push(CPU.PC >> 8);
-    stack_push(CPU.PC & 0xFF);
-    CPU.PC  = newPC;
-    jumping = 1;
+    uint16_t newPC = operand_addr(cpu);
+    cpu->PC += 2;
+    stack_push(cpu, cpu->PC >> 8);
+    stack_push(cpu, cpu->PC & 0xFF);
+    cpu->PC      = newPC;
+    cpu->jumping = 1;
 }
 
-static void inst_LDA(void)
+static void inst_LDA(CPUMAP *cpu)
 {
-    CPU.A = *read_ptr();
-    N_flag(CPU.A);
-    Z_flag(CPU.A);
+    cpu->A = read_operand(cpu);
+    NZ_flag(cpu, cpu->A);
 }
 
-static void inst_LDX(void)
+static void inst_LDX(CPUMAP *cpu)
 {
-    CPU.X = *read_ptr();
-    N_flag(CPU.X);
-    Z_flag(CPU.X);
+    cpu->X = read_operand(cpu);
+    NZ_flag(cpu, cpu->X);
 }
 
-static void inst_LDY(void)
+static void inst_LDY(CPUMAP *cpu)
 {
-    CPU.Y = *read_ptr();
-    N_flag(CPU.Y);
-    Z_flag(CPU.Y);
+    cpu->Y = read_operand(cpu);
+    NZ_flag(cpu, cpu->Y);
 }
 
-static void inst_LSR(void)
+static void inst_LSR(CPUMAP *cpu)
 {
-    uint8_t tmp       = *read_ptr();
-    CPU.SR.bits.carry = tmp & 1;
+    uint8_t tmp        = read_operand(cpu);
+    cpu->SR.bits.carry = tmp & 1;
     tmp >>= 1;
-    N_flag(tmp);
-    Z_flag(tmp);
-    *write_ptr() = tmp;
+    NZ_flag(cpu, tmp);
+    write_operand(cpu, tmp);
 }
 
-static void inst_NOP(void)
+static void inst_NOP(CPUMAP *cpu)
 {
-    read_ptr();
+    read_operand(cpu);
 }
 
-static void inst_ORA(void)
+static void inst_ORA(CPUMAP *cpu)
 {
-    CPU.A |= *read_ptr();
-    N_flag(CPU.A);
-    Z_flag(CPU.A);
+    cpu->A |= read_operand(cpu);
+    NZ_flag(cpu, cpu->A);
 }
 
-static void inst_PHA(void)
+static void inst_PHA(CPUMAP *cpu)
 {
-    stack_push(CPU.A);
+    stack_push(cpu, cpu->A);
 }
 
-static void inst_PHP(void)
+static void inst_PHP(CPUMAP *cpu)
 {
     union StatusReg pushed_sr;
-    pushed_sr.byte     = CPU.SR.byte;
+    pushed_sr.byte     = cpu->SR.byte;
     pushed_sr.bits.brk = 1;
-    stack_push(pushed_sr.byte);
+    stack_push(cpu, pushed_sr.byte);
 }
 
-static void inst_PLA(void)
+static void inst_PLA(CPUMAP *cpu)
 {
-    CPU.A = stack_pull();
-    N_flag(CPU.A);
-    Z_flag(CPU.A);
+    cpu->A = stack_pull(cpu);
+    NZ_flag(cpu, cpu->A);
 }
 
-static void inst_PLP(void)
+static void inst_PLP(CPUMAP *cpu)
 {
-    CPU.SR.byte        = stack_pull();
-    CPU.SR.bits.unused = 1;
-    CPU.SR.bits.brk    = 0;
+    set_status(cpu, (stack_pull(cpu) | SR_UNUSED) & ~SR_BRK);
 }
 
-static void inst_ROL(void)
+static void inst_ROL(CPUMAP *cpu)
 {
-    int tmp = (*read_ptr()) << 1;
-    tmp |= CPU.SR.bits.carry & 1;
-    CPU.SR.bits.carry = tmp > 0xFF;
+    int tmp = read_operand(cpu) << 1;
+    tmp |= cpu->SR.bits.carry & 1;
+    cpu->SR.bits.carry = tmp > 0xFF;
     tmp &= 0xFF;
-    N_flag(tmp);
-    Z_flag(tmp);
-    *write_ptr() = tmp;
+    NZ_flag(cpu, tmp);
+    write_operand(cpu, tmp);
 }
 
-static void inst_ROR(void)
+static void inst_ROR(CPUMAP *cpu)
 {
-    int tmp = *read_ptr();
-    tmp |= CPU.SR.bits.carry << 8;
-    CPU.SR.bits.carry = tmp & 1;
+    int tmp = read_operand(cpu);
+    tmp |= cpu->SR.bits.carry << 8;
+    cpu->SR.bits.carry = tmp & 1;
     tmp >>= 1;
-    N_flag(tmp);
-    Z_flag(tmp);
-    *write_ptr() = tmp;
+    NZ_flag(cpu, tmp);
+    write_operand(cpu, tmp);
 }
 
-static void inst_RTI(void)
+static void inst_RTI(CPUMAP *cpu)
 {
-    CPU.SR.byte        = stack_pull();
-    CPU.SR.bits.unused = 1;
-    CPU.PC             = stack_pull();
-    CPU.PC |= stack_pull() << 8;
-    jumping = 1;
+    set_status(cpu, stack_pull(cpu) | SR_UNUSED);
+    cpu->PC = stack_pull(cpu);
+    cpu->PC |= stack_pull(cpu) << 8;
+    cpu->jumping = 1;
 }
 
-static void inst_RTS(void)
+static void inst_RTS(CPUMAP *cpu)
 {
-    CPU.PC = stack_pull();
-    CPU.PC |= stack_pull() << 8;
-    CPU.PC += 1;
-    jumping = 1;
+    cpu->PC = stack_pull(cpu);
+    cpu->PC |= stack_pull(cpu) << 8;
+    cpu->PC += 1;
+    cpu->jumping = 1;
 }
 
-static void inst_SBC(void)
+static void inst_SBC(CPUMAP *cpu)
 {
-    uint8_t      operand = *read_ptr();
-    unsigned int tmp, lo, hi;
-    tmp                  = CPU.A - operand - 1 + (CPU.SR.bits.carry & 1);
-    CPU.SR.bits.overflow = ((CPU.A ^ tmp) & (CPU.A ^ operand) & 0x80) != 0;
-    if (CPU.SR.bits.decimal) {
-        lo = (CPU.A & 0x0f) - (operand & 0x0f) - 1 + CPU.SR.bits.carry;
-        hi = (CPU.A >> 4) - (operand >> 4);
-        if (lo & 0x10) lo -= 6, hi--;
-        if (hi & 0x10) hi -= 6;
-        CPU.A = (hi << 4) | (lo & 0x0f);
-    } else {
-        CPU.A = tmp & 0xFF;
-    }
-    CPU.SR.bits.carry = tmp < 0x100;
-    N_flag(CPU.A);
-    Z_flag(CPU.A);
+    uint8_t      operand  = read_operand(cpu);
+    unsigned int tmp      = cpu->A - operand - 1 + (cpu->SR.bits.carry & 1);
+    cpu->SR.bits.overflow = ((cpu->A ^ tmp) & (cpu->A ^ operand) & 0x80) != 0;
+    cpu->SR.bits.carry    = tmp < 0x100;
+    cpu->A                = tmp & 0xFF;
+    NZ_flag(cpu, cpu->A);
+}
+
+static void inst_SBC_BCD(CPUMAP *cpu)
+{
+    uint16_t result = bcd_sbc[cpu->decimal][cpu->SR.bits.carry][cpu->A][read_operand(cpu)];
+    cpu->A          = result & 0xFF;
+    cpu->SR.byte    = (cpu->SR.byte & ~(SR_SIGN | SR_OVERFLOW | SR_ZERO | SR_CARRY)) | result >> 8;
+    cpu->extra_cycles += cpu->decimal == DECIMAL_CMOS;
 }
 
-static void inst_SEC(void)
+static void inst_SEC(CPUMAP *cpu)
 {
-    CPU.SR.bits.carry = 1;
+    cpu->SR.bits.carry = 1;
 }
 
-static void inst_SED(void)
+static void inst_SED(CPUMAP *cpu)
 {
-    CPU.SR.bits.decimal = 1;
+    cpu->SR.bits.decimal = 1;
+    cpu->table           = decimal_instructions;
 }
 
-static void inst_SEI(void)
+static void inst_SEI(CPUMAP *cpu)
 {
-    CPU.SR.bits.interrupt = 1;
+    cpu->SR.bits.interrupt = 1;
 }
 
-static void inst_STA(void)
+static void inst_STA(CPUMAP *cpu)
 {
-    *write_ptr()     = CPU.A;
-    CPU.extra_cycles = 0;
+    write_operand(cpu, cpu->A);
+    cpu->extra_cycles = 0;
 }
 
-static void inst_STX(void)
+static void inst_STX(CPUMAP *cpu)
 {
-    *write_ptr() = CPU.X;
+    write_operand(cpu, cpu->X);
 }
 
-static void inst_STY(void)
+static void inst_STY(CPUMAP *cpu)
 {
-    *write_ptr() = CPU.Y;
+    write_operand(cpu, cpu->Y);
 }
 
-static void inst_TAX(void)
+static void inst_TAX(CPUMAP *cpu)
 {
-    CPU.X = CPU.A;
-    N_flag(CPU.X);
-    Z_flag(CPU.X);
+    cpu->X = cpu->A;
+    NZ_flag(cpu, cpu->X);
 }
 
-static void inst_TAY(void)
+static void inst_TAY(CPUMAP *cpu)
 {
-    CPU.Y = CPU.A;
-    N_flag(CPU.Y);
-    Z_flag(CPU.Y);
+    cpu->Y = cpu->A;
+    NZ_flag(cpu, cpu->Y);
 }
 
-static void inst_TSX(void)
+static void inst_TSX(CPUMAP *cpu)
 {
-    CPU.X = CPU.SP;
-    N_flag(CPU.X);
-    Z_flag(CPU.X);
+    cpu->X = cpu->SP;
+    NZ_flag(cpu, cpu->X);
 }
 
-static void inst_TXA(void)
+static void inst_TXA(CPUMAP *cpu)
 {
-    CPU.A = CPU.X;
-    N_flag(CPU.A);
-    Z_flag(CPU.A);
+    cpu->A = cpu->X;
+    NZ_flag(cpu, cpu->A);
 }
 
-static void inst_TXS(void)
+static void inst_TXS(CPUMAP *cpu)
 {
-    CPU.SP = CPU.X;
+    cpu->SP = cpu->X;
 }
 
-static void inst_TYA(void)
+static void inst_TYA(CPUMAP *cpu)
 {
-    CPU.A = CPU.Y;
-    N_flag(CPU.A);
-    Z_flag(CPU.A);
+    cpu->A = cpu->Y;
+    NZ_flag(cpu, cpu->A);
 }
 
 /* ↓地址模式↓ */
 
-static uint8_t *get_IMPL(void)
+static uint8_t *get_IMPL(CPUMAP *cpu)
 {
-    return &CPU.memory[0];
+    return &cpu->memory[0];
 }
 
-static uint8_t *get_IMM(void)
+static uint8_t *get_IMM(CPUMAP *cpu)
 {
-    return &CPU.memory[(uint16_t)(CPU.PC + 1)];
+    return &cpu->memory[(uint16_t)(cpu->PC + 1)];
 }
 
-static uint16_t get_uint16(void)
+static uint16_t get_uint16(CPUMAP *cpu)
 {
-    uint16_t index;
-    memcpy(&index, get_IMM(), sizeof(index));
-    return index;
+    return cpu->operand;
 }
 
-static uint8_t *get_ZP(void)
+static uint8_t get_uint8(CPUMAP *cpu)
 {
-    return &CPU.memory[*get_IMM()];
+    return cpu->operand & 0xFF;
 }
 
-static uint8_t *get_ZPX(void)
+static uint8_t *get_ZP(CPUMAP *cpu)
 {
-    return &CPU.memory[((*get_IMM()) + CPU.X) & 0xFF];
+    return &cpu->memory[get_uint8(cpu)];
 }
 
-static uint8_t *get_ZPY(void)
+static uint8_t *get_ZPX(CPUMAP *cpu)
 {
-    return &CPU.memory[((*get_IMM()) + CPU.Y) & 0xFF];
+    return &cpu->memory[(get_uint8(cpu) + cpu->X) & 0xFF];
 }
 
-static uint8_t *get_ACC(void)
+static uint8_t *get_ZPY(CPUMAP *cpu)
 {
-    return &CPU.A;
+    return &cpu->memory[(get_uint8(cpu) + cpu->Y) & 0xFF];
 }
 
-static uint8_t *get_ABS(void)
+static uint8_t *get_ACC(CPUMAP *cpu)
 {
-    return &CPU.memory[get_uint16()];
+    return &cpu->A;
 }
 
-static uint8_t *get_ABSX(void)
+static uint8_t *get_ABS(CPUMAP *cpu)
+{
+    return &cpu->memory[get_uint16(cpu)];
+}
+
+static uint8_t *get_ABSX(CPUMAP *cpu)
 {
     uint16_t ptr;
-    ptr = (uint16_t)(get_uint16() + CPU.X);
-    if ((uint8_t)ptr < CPU.X) CPU.extra_cycles++;
-    return &CPU.memory[ptr];
+    ptr = (uint16_t)(get_uint16(cpu) + cpu->X);
+    if ((uint8_t)ptr < cpu->X) cpu->extra_cycles++;
+    return &cpu->memory[ptr];
 }
 
-static uint8_t *get_ABSY(void)
+static uint8_t *get_ABSY(CPUMAP *cpu)
 {
     uint16_t ptr;
-    ptr = (uint16_t)(get_uint16() + CPU.Y);
-    if ((uint8_t)ptr < CPU.Y) CPU.extra_cycles++;
-    return &CPU.memory[ptr];
+    ptr = (uint16_t)(get_uint16(cpu) + cpu->Y);
+    if ((uint8_t)ptr < cpu->Y) cpu->extra_cycles++;
+    return &cpu->memory[ptr];
 }
 
-static uint8_t *get_IND(void)
+static uint8_t *get_IND(CPUMAP *cpu)
 {
     uint16_t ptr;
-    memcpy(&ptr, get_ABS(), sizeof(ptr));
-    return &CPU.memory[ptr];
+    memcpy(&ptr, get_ABS(cpu), sizeof(ptr));
+    return &cpu->memory[ptr];
 }
 
-static uint8_t *get_XIND(void)
+static uint8_t *get_XIND(CPUMAP *cpu)
 {
     uint16_t ptr;
-    ptr = ((*get_IMM()) + CPU.X) & 0xFF;
+    ptr = (get_uint8(cpu) + cpu->X) & 0xFF;
     if (ptr == 0xff) {
-        ptr = CPU.memory[ptr] + (CPU.memory[ptr & 0xff00] << 8);
+        ptr = cpu->memory[ptr] + (cpu->memory[ptr & 0xff00] << 8);
     } else {
-        memcpy(&ptr, &CPU.memory[ptr], sizeof(ptr));
+        memcpy(&ptr, &cpu->memory[ptr], sizeof(ptr));
     }
-    return &CPU.memory[ptr];
+    return &cpu->memory[ptr];
 }
 
-static uint8_t *get_INDY(void)
+static uint8_t *get_INDY(CPUMAP *cpu)
 {
     uint16_t ptr;
-    ptr = *get_IMM();
+    ptr = get_uint8(cpu);
     if (ptr == 0xff) {
-        ptr = CPU.memory[ptr] + (CPU.memory[ptr & 0xff00] << 8);
+        ptr = cpu->memory[ptr] + (cpu->memory[ptr & 0xff00] << 8);
     } else {
-        memcpy(&ptr, &CPU.memory[ptr], sizeof(ptr));
+        memcpy(&ptr, &cpu->memory[ptr], sizeof(ptr));
     }
-    ptr += CPU.Y;
-    if ((uint8_t)ptr < CPU.Y) CPU.extra_cycles++;
-    return &CPU.memory[ptr];
+    ptr += cpu->Y;
+    if ((uint8_t)ptr < cpu->Y) cpu->extra_cycles++;
+    return &cpu->memory[ptr];
 }
 
-static uint8_t *get_REL(void)
+static uint8_t *get_REL(CPUMAP *cpu)
 {
-    return &CPU.memory[(uint16_t)(CPU.PC + (int8_t)*get_IMM())];
+    return &cpu->memory[(uint16_t)(cpu->PC + (int8_t)get_uint8(cpu))];
 }
 
-static uint8_t *get_JMP_IND_BUG(void)
+static uint8_t *get_JMP_IND_BUG(CPUMAP *cpu)
 {
     uint8_t *addr;
     uint16_t ptr;
 
-    ptr = get_uint16();
+    ptr = get_uint16(cpu);
     if ((ptr & 0xff) == 0xff) {
-        ptr = CPU.memory[ptr] + (CPU.memory[ptr & 0xff00] << 8);
+        ptr = cpu->memory[ptr] + (cpu->memory[ptr & 0xff00] << 8);
     } else {
-        addr = &CPU.memory[ptr];
+        addr = &cpu->memory[ptr];
         memcpy(&ptr, addr, sizeof(ptr));
     }
-    return &CPU.memory[ptr];
+    return &cpu->memory[ptr];
+}
+
+/* Decimal ADC of one operand pair, packed as in bcd_adc */
+static uint16_t decimal_adc(DecimalModel model, int a, int b, int c)
+{
+    int     lo, sum, sign;
+    uint8_t flags = 0;
+
+    lo = (a & 0x0F) + (b & 0x0F) + c;
+    if (lo >= 0x0A) lo = ((lo + 0x06) & 0x0F) + 0x10;
+    sum  = (a & 0xF0) + (b & 0xF0) + lo;
+    sign = (int8_t)(a & 0xF0) + (int8_t)(b & 0xF0) + lo; // V, and N on NMOS, see the high digit before its adjustment
+    if (sign < -128 || sign > 127) flags |= SR_OVERFLOW;
+    if (sum >= 0xA0) sum += 0x60;
+    if (sum >= 0x100) flags |= SR_CARRY;
+    if (model == DECIMAL_NMOS) {
+        flags |= sign & SR_SIGN;
+        if (((a + b + c) & 0xFF) == 0) flags |= SR_ZERO;
+    } else {
+        flags |= sum & SR_SIGN;
+        if ((sum & 0xFF) == 0) flags |= SR_ZERO;
+    }
+    return (sum & 0xFF) | flags << 8;
+}
+
+/* Decimal SBC of one operand pair, packed as in bcd_sbc */
+static uint16_t decimal_sbc(DecimalModel model, int a, int b, int c)
+{
+    int     lo, diff, bin = a - b - 1 + c;
+    uint8_t flags = 0;
+
+    if (bin >= 0) flags |= SR_CARRY;
+    if ((a ^ bin) & (a ^ b) & 0x80) flags |= SR_OVERFLOW;
+    lo = (a & 0x0F) - (b & 0x0F) + c - 1;
+    if (model == DECIMAL_NMOS) {
+        if (lo < 0) lo = ((lo - 0x06) & 0x0F) - 0x10;
+        diff = (a & 0xF0) - (b & 0xF0) + lo;
+        if (diff < 0) diff -= 0x60;
+        flags |= nz_flags[bin & 0xFF];
+    } else {
+        diff = bin;
+        if (diff < 0) diff -= 0x60;
+        if (lo < 0) diff -= 0x06;
+        flags |= nz_flags[diff & 0xFF];
+    }
+    return (diff & 0xFF) | flags << 8;
+}
+
+/* Build the decimal mode tables and the instruction table used while D is set */
+static void init_decimal(void)
+{
+    int model, c, a, b, opcode;
+
+    for (model = DECIMAL_NMOS; model <= DECIMAL_CMOS; model++)
+        for (c = 0; c < 2; c++)
+            for (a = 0; a < 0x100; a++)
+                for (b = 0; b < 0x100; b++) {
+                    bcd_adc[model][c][a][b] = decimal_adc(model, a, b, c);
+                    bcd_sbc[model][c][a][b] = decimal_sbc(model, a, b, c);
+                }
+    memcpy(decimal_instructions, instructions, sizeof(decimal_instructions));
+    for (opcode = 0; opcode < 0x100; opcode++) {
+        if (instructions[opcode].function == inst_ADC) decimal_instructions[opcode].function = inst_ADC_BCD;
+        if (instructions[opcode].function == inst_SBC) decimal_instructions[opcode].function = inst_SBC_BCD;
+    }
+}
+
+/* Allocate a machine with empty memory and no devices */
+CPUMAP *create_cpu(void)
+{
+    CPUMAP *cpu;
+
+    pthread_once(&decimal_once, init_decimal);
+    cpu = calloc(1, sizeof(CPUMAP));
+    if (cpu) {
+        cpu->table      = instructions;
+        cpu->next_event = UINT64_MAX;
+    }
+    return cpu;
+}
+
+/* Release a machine, its trace buffer, its profile, its predecoded blocks and their translations */
+void free_cpu(CPUMAP *cpu)
+{
+    if (cpu == NULL) return;
+    close_trace(cpu);
+    free_profile(cpu->profile);
+    free(cpu->blocks);
+    free_jit(cpu->jit);
+    free(cpu);
 }
 
 /* Reset CPU state */
-void reset_cpu(int _a, int _x, int _y, int _sp, int _sr, int _pc)
+void reset_cpu(CPUMAP *cpu, int _a, int _x, int _y, int _sp, int _sr, int _pc)
 {
-    CPU.A  = _a;
-    CPU.X  = _x;
-    CPU.Y  = _y;
-    CPU.SP = _sp;
+    cpu->A  = _a;
+    cpu->X  = _x;
+    cpu->Y  = _y;
+    cpu->SP = _sp;
 
-    CPU.SR.byte           = _sr;
-    CPU.SR.bits.interrupt = 1;
-    CPU.SR.bits.unused    = 1;
+    set_status(cpu, _sr | SR_INTERRUPT | SR_UNUSED);
 
     if (_pc < 0)
-        memcpy(&CPU.PC, &CPU.memory[-_pc], sizeof(CPU.PC));
+        memcpy(&cpu->PC, &cpu->memory[-_pc], sizeof(cpu->PC));
     else
-        CPU.PC = _pc;
+        cpu->PC = _pc;
+
+    cpu->total_cycles = 0;
+    cpu->interrupts &= ~NMI_PENDING;
+}
 
-    CPU.total_cycles = 0;
+/* Set the processor status register, switching the decimal instruction table in or out */
+void set_status(CPUMAP *cpu, uint8_t sr)
+{
+    cpu->SR.byte = sr;
+    cpu->table   = (sr & SR_DECIMAL) ? decimal_instructions : instructions;
 }
 
-/* Load ROM file into memory */
-int load_rom(char *filename, int load_addr)
+/* Load ROM file into memory, returning the number of bytes loaded */
+int load_rom(CPUMAP *cpu, char *filename, int load_addr)
 {
     int loaded_size, max_size;
-    memset(CPU.memory, 0, sizeof(CPU.memory));
+    memset(cpu->memory, 0, sizeof(cpu->memory));
+    memset(cpu->dirty_pages, 1, sizeof(cpu->dirty_pages));
+    flush_blocks(cpu);
 
     FILE *fp = fopen(filename, "r");
     if (fp == NULL) {
@@ -622,41 +723,559 @@ int load_rom(char *filename, int load_addr)
         return -1;
     }
     max_size    = 0x10000 - load_addr;
-    loaded_size = (int)fread(&CPU.memory[load_addr], 1, (size_t)max_size, fp);
-    fprintf(stderr, "Loading $%04x bytes: $%04x - $%04x\n", loaded_size, load_addr, load_addr + loaded_size - 1);
+    loaded_size = (int)fread(&cpu->memory[load_addr], 1, (size_t)max_size, fp);
     fclose(fp);
+    return loaded_size;
+}
+
+/* Print a trace record in the nestest log layout */
+void print_trace(FILE *fp, const TraceRecord *rec, uint64_t total_cycles)
+{
+    Instruction ins = instructions[rec->opcode[0]];
+
+    fprintf(fp, "%04X  ", rec->PC);
+    if (lengths[ins.mode] == 3)
+        fprintf(fp, "%02X %02X %02X", rec->opcode[0], rec->opcode[1], rec->opcode[2]);
+    else if (lengths[ins.mode] == 2)
+        fprintf(fp, "%02X %02X   ", rec->opcode[0], rec->opcode[1]);
+    else
+        fprintf(fp, "%02X      ", rec->opcode[0]);
+    fprintf(fp, "  %-10s               A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%3d\n", ins.mnemonic, rec->A, rec->X, rec->Y, rec->SR, rec->SP,
+            (int)((total_cycles * 3) % 341));
+}
+
+/* Mnemonic and addressing mode of an opcode */
+const char *opcode_name(uint8_t opcode)
+{
+    return instructions[opcode].mnemonic;
+}
+
+/* Capture the CPU state before an instruction */
+static inline void capture_trace(CPUMAP *cpu, TraceRecord *rec)
+{
+    rec->PC        = cpu->PC;
+    rec->opcode[0] = cpu->memory[cpu->PC];
+    rec->opcode[1] = cpu->memory[(uint16_t)(cpu->PC + 1)];
+    rec->opcode[2] = cpu->memory[(uint16_t)(cpu->PC + 2)];
+    rec->A         = cpu->A;
+    rec->X         = cpu->X;
+    rec->Y         = cpu->Y;
+    rec->SR        = cpu->SR.byte;
+    rec->SP        = cpu->SP;
+}
+
+/* Write out the buffered trace records */
+static void flush_trace(CPUMAP *cpu)
+{
+    fwrite(cpu->trace_buf, sizeof(TraceRecord), cpu->trace_len, cpu->trace_fp);
+    cpu->trace_len = 0;
+}
+
+/* Execute an instruction from its opcode and operand bytes, returning the cycles it took */
+static inline int execute(CPUMAP *cpu, uint8_t opcode, uint16_t operand)
+{
+    int cycles;
+
+    cpu->inst         = &cpu->table[opcode];
+    cpu->operand      = operand;
+    cpu->jumping      = 0;
+    cpu->extra_cycles = 0;
+    cpu->inst->function(cpu);
+    if (cpu->jumping == 0) cpu->PC += lengths[cpu->inst->mode];
+    if (cpu->inst->cycles == 7) cpu->extra_cycles = 0;
+    cycles = cpu->inst->cycles + cpu->extra_cycles;
+    cpu->total_cycles += cycles;
+    cpu->total_instructions++;
+    return cycles;
+}
+
+/* Enter the handler of the pending interrupt, returning the cycles it took */
+int take_interrupt(CPUMAP *cpu)
+{
+    uint16_t vector = IRQ_VEC;
+
+    /* NMI wins over IRQ and is consumed by being taken, while an IRQ source holds its line until the device releases it */
+    if (cpu->interrupts & NMI_PENDING) {
+        cpu->interrupts &= ~NMI_PENDING;
+        vector = NMI_VEC;
+    } else if (!(cpu->interrupts & IRQ_LINES) || cpu->SR.bits.interrupt) {
+        return 0;
+    }
+    stack_push(cpu, cpu->PC >> 8);
+    stack_push(cpu, cpu->PC & 0xFF);
+    stack_push(cpu, (cpu->SR.byte | SR_UNUSED) & ~SR_BRK);
+    cpu->SR.bits.interrupt = 1;
+    cpu->PC                = cpu->memory[vector] | cpu->memory[vector + 1] << 8;
+    cpu->total_cycles += 7;
+    return 7;
+}
+
+/* Execute an instruction, or enter the handler of a pending interrupt */
+int step_cpu(CPUMAP *cpu, int verbose)
+{
+    TraceRecord  state;
+    TraceRecord *rec    = cpu->trace_fp ? &cpu->trace_buf[cpu->trace_len] : &state;
+    uint16_t     pc     = cpu->PC;
+    uint8_t      opcode = cpu->memory[pc];
+    int          cycles;
+
+    if (interrupt_pending(cpu) && (cycles = take_interrupt(cpu)) > 0) {
+        if (cpu->profile) profile_interrupt(cpu->profile, cpu, cycles);
+        return cycles;
+    }
+    if (verbose || cpu->trace_fp || cpu->reference) capture_trace(cpu, rec);
+    if (verbose) print_trace(stdout, rec, cpu->total_cycles);
+    cycles      = execute(cpu, opcode, cpu->memory[(uint16_t)(pc + 1)] | cpu->memory[(uint16_t)(pc + 2)] << 8);
+    rec->cycles = cycles;
+    if (cpu->reference) check_reference(cpu->reference, rec, cpu->total_cycles - cycles);
+    if (cpu->trace_fp && ++cpu->trace_len == TRACE_RECORDS) flush_trace(cpu);
+    if (cpu->profile) profile_step(cpu->profile, cpu, pc, opcode, cycles);
+    return cycles;
+}
+
+/* Drop every predecoded block, after memory was replaced behind the cores' back */
+void flush_blocks(CPUMAP *cpu)
+{
+    memset(cpu->code_pages, 0, sizeof(cpu->code_pages));
+    if (cpu->jit) jit_flush(cpu->jit);
+    if (cpu->blocks == NULL) return;
+    memset(cpu->blocks->index, 0, sizeof(cpu->blocks->index));
+    memset(cpu->blocks->rebuilds, 0, sizeof(cpu->blocks->rebuilds));
+    cpu->blocks->used  = 0;
+    cpu->blocks->stale = 1;
+}
+
+/* Drop the predecoded blocks that may hold code from a page about to be written */
+void invalidate_code(CPUMAP *cpu, uint8_t page)
+{
+    BlockCache *cache = cpu->blocks;
+
+    cpu->code_pages[page] = 0;
+    if (cpu->jit) jit_invalidate(cpu->jit, page);
+    if (cache == NULL) return;
+    /* A block never starts an instruction outside its first page, so only blocks of this page and the one before reach it */
+    memset(&cache->index[page << 8], 0, 0x100 * sizeof(uint32_t));
+    memset(&cache->index[(uint8_t)(page - 1) << 8], 0, 0x100 * sizeof(uint32_t));
+    if (cache->rebuilds[page] < BLOCK_REBUILDS) cache->rebuilds[page]++;
+    cache->stale = 1;
+}
+
+/* Whether an instruction reaches a page written too often to be cached */
+static inline bool uncached(BlockCache *cache, uint16_t pc)
+{
+    return cache->rebuilds[pc >> 8] == BLOCK_REBUILDS || cache->rebuilds[(uint16_t)(pc + 2) >> 8] == BLOCK_REBUILDS;
+}
+
+/* Whether an instruction always leaves the straight line of its block; taken branches leave it by moving the PC */
+static inline bool ends_block(uint8_t opcode)
+{
+    switch (opcode) {
+        case 0x00 : // BRK
+        case 0x20 : // JSR
+        case 0x40 : // RTI
+        case 0x4C : // JMP abs
+        case 0x60 : // RTS
+        case 0x6C : // JMP ind
+            return 1;
+    }
     return 0;
 }
 
-/* Execute an instruction */
-int step_cpu(int verbose)
+/* Predecode the basic block starting at the PC, or return NULL if its page is not cached */
+static const BlockOp *build_block(CPUMAP *cpu)
 {
-    inst = instructions[CPU.memory[CPU.PC]];
-    if (verbose) {
-        printf("%04X  ", CPU.PC);
-        if (lengths[inst.mode] == 3)
-            printf("%02X %02X %02X", CPU.memory[CPU.PC], CPU.memory[CPU.PC + 1], CPU.memory[CPU.PC + 2]);
-        else if (lengths[inst.mode] == 2)
-            printf("%02X %02X   ", CPU.memory[CPU.PC], CPU.memory[CPU.PC + 1]);
-        else
-            printf("%02X      ", CPU.memory[CPU.PC]);
-        printf("  %-10s               A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%3d\n", inst.mnemonic, CPU.A, CPU.X, CPU.Y, CPU.SR.byte, CPU.SP,
-               (int)((CPU.total_cycles * 3) % 341));
+    BlockCache *cache = cpu->blocks;
+    uint16_t    pc    = cpu->PC;
+    BlockOp    *op;
+    int         num;
+
+    if (uncached(cache, pc)) return NULL;
+    if (cache->used + BLOCK_LENGTH + 1 > BLOCK_POOL) {
+        memset(cache->index, 0, sizeof(cache->index));
+        cache->used = 0;
+    }
+    op = &cache->ops[cache->used];
+    for (num = 0; num < BLOCK_LENGTH && (pc >> 8) == (cpu->PC >> 8) && (num == 0 || !uncached(cache, pc)); num++) {
+        op[num].opcode           = cpu->memory[pc];
+        op[num].operand          = cpu->memory[(uint16_t)(pc + 1)] | cpu->memory[(uint16_t)(pc + 2)] << 8;
+        op[num].length           = lengths[instructions[op[num].opcode].mode];
+        cpu->code_pages[pc >> 8] = 1;
+        pc += op[num].length;
+        cpu->code_pages[(uint16_t)(pc - 1) >> 8] = 1;
+        if (ends_block(op[num].opcode)) {
+            num++;
+            break;
+        }
+    }
+    op[num].length        = 0;
+    cache->index[cpu->PC] = cache->used + 1;
+    cache->used += num + 1;
+    return op;
+}
+
+/* Execute instructions until the budget is used up or the PC reaches break_pc, from predecoded blocks on the table core; stops early
+   when an event is scheduled before the end */
+static StopReason run_core(CPUMAP *cpu, uint64_t budget, int break_pc, int threaded)
+{
+    uint64_t       end = cpu->total_cycles + budget;
+    BlockCache    *cache;
+    const BlockOp *op;
+    uint32_t       index;
+    uint16_t       next;
+
+    if (threaded && !cpu->jit && !cpu->trace_fp && !cpu->profile && !cpu->reference) {
+        /* The threaded core does not watch writes to code, so drop the blocks of an earlier table core run */
+        if (cpu->blocks) {
+            flush_blocks(cpu);
+            free(cpu->blocks);
+            cpu->blocks = NULL;
+        }
+        return run_threaded(cpu, budget, break_pc);
+    }
+    if (cpu->trace_fp || cpu->profile || cpu->reference || (cpu->blocks == NULL && (cpu->blocks = calloc(1, sizeof(BlockCache))) == NULL)) {
+        /* Tracing, profiling and validation look at every instruction through step_cpu */
+        do {
+            step_cpu(cpu, 0);
+            if (cpu->PC == break_pc) return STOP_BREAK;
+            if (cpu->reference && reference_done(cpu->reference)) return STOP_REFERENCE;
+        } while (cpu->total_cycles < end && !(cpu->interrupts & EVENT_DUE));
+        return STOP_BUDGET;
+    }
+    cache = cpu->blocks;
+    for (;;) {
+        if (interrupt_pending(cpu)) {
+            take_interrupt(cpu);
+            if (cpu->PC == break_pc) return STOP_BREAK;
+            if (cpu->total_cycles >= end || (cpu->interrupts & EVENT_DUE)) return STOP_BUDGET;
+        }
+        if ((index = cache->index[cpu->PC]) != 0)
+            op = &cache->ops[index - 1];
+        else if ((op = build_block(cpu)) == NULL) {
+            /* Code in pages that keep being written is decoded afresh every time */
+            step_cpu(cpu, 0);
+            if (cpu->PC == break_pc) return STOP_BREAK;
+            if (cpu->total_cycles >= end) return STOP_BUDGET;
+            continue;
+        }
+        if (cpu->jit && jit_run(cpu, op, end, break_pc)) {
+            if (cpu->PC == break_pc) return STOP_BREAK;
+            if (cpu->total_cycles >= end) return STOP_BUDGET;
+            continue;
+        }
+        /* Leave the block when an instruction moves the PC elsewhere, a write drops predecoded code or an interrupt is due */
+        for (cache->stale = 0; op->length; op++) {
+            next = cpu->PC + op->length;
+            execute(cpu, op->opcode, op->operand);
+            if (cpu->PC == break_pc) return STOP_BREAK;
+            if (cpu->total_cycles >= end) return STOP_BUDGET;
+            if (cpu->PC != next || cache->stale || interrupt_pending(cpu)) break;
+        }
+    }
+}
+
+/* Execute instructions until the budget is used up or the PC reaches break_pc, firing device events on their cycles */
+StopReason run_cycles(CPUMAP *cpu, uint64_t budget, int break_pc, int threaded)
+{
+    uint64_t   end = cpu->total_cycles + budget;
+    StopReason reason;
+
+    /* The core runs uninterrupted up to the earliest event, or until a device schedules an earlier one */
+    do {
+        run_events(cpu);
+        cpu->run_end = cpu->next_event < end ? cpu->next_event : end;
+        reason       = run_core(cpu, cpu->run_end - cpu->total_cycles, break_pc, threaded);
+        cpu->run_end = 0;
+        cpu->interrupts &= ~EVENT_DUE;
+    } while (reason == STOP_BUDGET && cpu->total_cycles < end);
+    run_events(cpu);
+    return reason;
+}
+
+/* Fast-forward whole passes of a loop the program spins in without changing memory or touching a device other than to poll the UART
+   status, up to the budget, and return STOP_IDLE; runs at most IDLE_STEPS instructions if it is not in one */
+StopReason run_idle(CPUMAP *cpu, uint64_t budget, int break_pc)
+{
+    uint64_t   cycles = cpu->total_cycles, count = cpu->total_instructions, io = cpu->io_accesses;
+    uint64_t   period, passes;
+    StopReason reason = STOP_BUDGET;
+    uint16_t   pc     = cpu->PC;
+    uint8_t    a = cpu->A, x = cpu->X, y = cpu->Y, sp = cpu->SP, sr = cpu->SR.byte;
+    uint8_t   *image;
+    int        step;
+
+    /* Tracing, profiling and validation want every instruction */
+    if (cpu->trace_fp || cpu->profile || cpu->reference || (image = malloc(sizeof(cpu->memory))) == NULL) return STOP_BUDGET;
+    memcpy(image, cpu->memory, sizeof(cpu->memory));
+    run_events(cpu);
+    /* The next device event ends the pass and the skip like the end of the budget */
+    if (cpu->next_event - cycles < budget) budget = cpu->next_event - cycles;
+
+    /* One pass: the registers come back to where they were, nothing in memory changed on the way, and no device was touched but to find
+       the UART receiver empty; the VIA timers, say, move on between passes even though its registers read the same */
+    for (step = 0; step < IDLE_STEPS && cpu->total_cycles - cycles < budget; step++) {
+        step_cpu(cpu, 0);
+        run_events(cpu);
+        if (cpu->PC == break_pc) {
+            free(image);
+            return STOP_BREAK;
+        }
+        if (cpu->PC == pc && cpu->A == a && cpu->X == x && cpu->Y == y && cpu->SP == sp && cpu->SR.byte == sr) break;
+    }
+    period = cpu->total_cycles - cycles;
+    if (step < IDLE_STEPS && period < budget && cpu->io_accesses == io && memcmp(image, cpu->memory, sizeof(cpu->memory)) == 0) {
+        /* Every further pass would do the same, so only the clock moves */
+        passes = (budget - period) / period;
+        cpu->total_cycles += passes * period;
+        cpu->total_instructions += passes * (cpu->total_instructions - count);
+        reason = STOP_IDLE;
+    }
+    free(image);
+    run_events(cpu);
+    return reason;
+}
+
+/* Stop writing the binary trace */
+void close_trace(CPUMAP *cpu)
+{
+    if (cpu->trace_fp == NULL) return;
+    flush_trace(cpu);
+    fclose(cpu->trace_fp);
+    free(cpu->trace_buf);
+    cpu->trace_fp = NULL;
+}
+
+/* Start writing a binary trace of every executed instruction */
+int open_trace(CPUMAP *cpu, const char *filename)
+{
+    TraceHeader header;
+
+    cpu->trace_fp = fopen(filename, "w");
+    if (cpu->trace_fp == NULL) {
+        printf("Error: Unable to create trace file.\n");
+        return -1;
+    }
+    cpu->trace_buf = malloc(TRACE_RECORDS * sizeof(TraceRecord));
+    if (cpu->trace_buf == NULL) {
+        printf("Error: Unable to allocate trace buffer.\n");
+        fclose(cpu->trace_fp);
+        cpu->trace_fp = NULL;
+        return -1;
+    }
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.start_cycles = cpu->total_cycles;
+    fwrite(&header, sizeof(header), 1, cpu->trace_fp);
+    return 0;
+}
+
+/* Print a binary trace file in the -v text format */
+int decode_trace(const char *filename)
+{
+    TraceHeader header;
+    TraceRecord rec;
+    uint64_t    total_cycles;
+
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+        printf("Error: Unable to open file.\n");
+        return -1;
+    }
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        printf("Error: Not a trace file.\n");
+        fclose(fp);
+        return -1;
+    }
+    for (total_cycles = header.start_cycles; fread(&rec, sizeof(rec), 1, fp) == 1; total_cycles += rec.cycles)
+        print_trace(stdout, &rec, total_cycles);
+    fclose(fp);
+    return 0;
+}
+
+/* Install device handlers for a memory page */
+void map_io(CPUMAP *cpu, uint8_t page, IoRead read, IoWrite write, void *device)
+{
+    cpu->io_read[page]   = read;
+    cpu->io_write[page]  = write;
+    cpu->io_device[page] = device;
+}
+
+/* Remove a device from every page it is mapped on */
+void unmap_device(CPUMAP *cpu, void *device)
+{
+    int page;
+
+    for (page = 0; page < 0x100; page++)
+        if (cpu->io_device[page] == device) map_io(cpu, page, NULL, NULL, NULL);
+}
+
+/* Hand every page of a device over to another one with the same handlers */
+void move_device(CPUMAP *cpu, void *from, void *to)
+{
+    int page;
+
+    for (page = 0; page < 0x100; page++)
+        if (cpu->io_device[page] == from) cpu->io_device[page] = to;
+}
+
+/* Move a heap entry up towards the root until its parent is due no later */
+static void sift_up(CPUMAP *cpu, int index)
+{
+    Event event = cpu->events[index];
+    int   parent;
+
+    for (; index > 0 && cpu->events[parent = (index - 1) / 2].when > event.when; index = parent) cpu->events[index] = cpu->events[parent];
+    cpu->events[index] = event;
+}
+
+/* Move a heap entry down towards the leaves until its children are due no earlier */
+static void sift_down(CPUMAP *cpu, int index)
+{
+    Event event = cpu->events[index];
+    int   child;
+
+    while ((child = 2 * index + 1) < cpu->event_count) {
+        if (child + 1 < cpu->event_count && cpu->events[child + 1].when < cpu->events[child].when) child++;
+        if (cpu->events[child].when >= event.when) break;
+        cpu->events[index] = cpu->events[child];
+        index              = child;
+    }
+    cpu->events[index] = event;
+}
+
+/* Take an entry out of the event heap */
+static void remove_event(CPUMAP *cpu, int index)
+{
+    if (index != --cpu->event_count) {
+        cpu->events[index] = cpu->events[cpu->event_count];
+        sift_down(cpu, index);
+        sift_up(cpu, index);
+    }
+    cpu->next_event = cpu->event_count ? cpu->events[0].when : UINT64_MAX;
+}
+
+/* Run the device's handler once the cycle count reaches when, replacing an earlier schedule of the same handler and device */
+void schedule_event(CPUMAP *cpu, uint64_t when, EventHandler handler, void *device)
+{
+    cancel_event(cpu, handler, device);
+    if (cpu->event_count == MAX_EVENTS) {
+        fprintf(stderr, "Error: Too many device events scheduled.\n");
+        return;
+    }
+    cpu->events[cpu->event_count] = (Event){when, handler, device};
+    sift_up(cpu, cpu->event_count++);
+    cpu->next_event = cpu->events[0].when;
+
+    /* A core running past it has to come back in time */
+    if (when < cpu->run_end) cpu->interrupts |= EVENT_DUE;
+}
+
+/* Drop the scheduled event of the handler and device, if there is one */
+void cancel_event(CPUMAP *cpu, EventHandler handler, void *device)
+{
+    int i;
+
+    for (i = 0; i < cpu->event_count; i++) {
+        if (cpu->events[i].handler == handler && cpu->events[i].device == device) {
+            remove_event(cpu, i);
+            return;
+        }
+    }
+}
+
+/* Drop every event of a device */
+void cancel_events(CPUMAP *cpu, void *device)
+{
+    int i = 0;
+
+    /* Removing reorders the heap, so look again from the start */
+    while (i < cpu->event_count) {
+        if (cpu->events[i].device == device) {
+            remove_event(cpu, i);
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+}
+
+/* Fire the events that are due */
+void fire_events(CPUMAP *cpu)
+{
+    Event event;
+
+    /* Handlers may schedule again, even for the current cycle */
+    while (cpu->event_count > 0 && cpu->events[0].when <= cpu->total_cycles) {
+        event = cpu->events[0];
+        remove_event(cpu, 0);
+        event.handler(event.device, event.when);
     }
-    jumping          = 0;
-    CPU.extra_cycles = 0;
-    inst.function();
-    if (jumping == 0) CPU.PC += lengths[inst.mode];
-    if (inst.cycles == 7) CPU.extra_cycles = 0;
-    CPU.total_cycles += inst.cycles + CPU.extra_cycles;
-    return inst.cycles + CPU.extra_cycles;
 }
 
 /* Memory dump */
-void save_memory(const char *filename)
+void save_memory(CPUMAP *cpu, const char *filename)
 {
     if (filename == NULL) filename = "memdump";
     FILE *fp = fopen(filename, "w");
-    fwrite(&CPU.memory, sizeof(CPU.memory), 1, fp);
+    fwrite(cpu->memory, sizeof(cpu->memory), 1, fp);
     fclose(fp);
 }
+
+/* Start a delta dump with its signature */
+void start_memory_delta(FILE *fp)
+{
+    fwrite(DELTA_MAGIC, 1, sizeof(DELTA_MAGIC) - 1, fp);
+}
+
+/* Append the pages written since the last call to a delta dump */
+void save_memory_delta(CPUMAP *cpu, FILE *fp, uint64_t index)
+{
+    DeltaRecord record;
+    int         page;
+    uint8_t     number;
+
+    record.index = index;
+    record.pages = 0;
+    for (page = 0; page < 0x100; page++) record.pages += cpu->dirty_pages[page];
+    if (record.pages == 0) return;
+    fwrite(&record.index, sizeof(record.index), 1, fp);
+    fwrite(&record.pages, sizeof(record.pages), 1, fp);
+    for (page = 0; page < 0x100; page++) {
+        if (!cpu->dirty_pages[page]) continue;
+        number = page;
+        fwrite(&number, 1, 1, fp);
+        fwrite(&cpu->memory[page << 8], 0x100, 1, fp);
+        cpu->dirty_pages[page] = 0;
+    }
+}
+
+/* Rebuild the memory image at an instruction index from a delta dump */
+int load_memory_delta(CPUMAP *cpu, const char *filename, uint64_t index)
+{
+    char        magic[sizeof(DELTA_MAGIC) - 1];
+    DeltaRecord record;
+    uint8_t     number;
+
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+        printf("Error: Unable to open file.\n");
+        return -1;
+    }
+    if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, DELTA_MAGIC, sizeof(magic)) != 0) {
+        printf("Error: Not a memory delta file.\n");
+        fclose(fp);
+        return -1;
+    }
+    memset(cpu->memory, 0, sizeof(cpu->memory));
+    flush_blocks(cpu);
+    while (fread(&record.index, sizeof(record.index), 1, fp) == 1 && fread(&record.pages, sizeof(record.pages), 1, fp) == 1 &&
+           record.index <= index) {
+        while (record.pages--) {
+            if (fread(&number, 1, 1, fp) != 1 || fread(&cpu->memory[number << 8], 0x100, 1, fp) != 1) {
+                printf("Error: Truncated memory delta file.\n");
+                fclose(fp);
+                return -1;
+            }
+        }
+    }
+    fclose(fp);
+    return 0;
+}
@@ -17,14 +17,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-#define CPU_FREQ      4e6    // Processor frequency
-#define STEP_DURATION 10e6   // Duration of each clock cycle
-#define ONE_SECOND    1e9    // Number of nanoseconds in a second
-#define NUM_MODES     14     // Number of instruction modes
-#define NMI_VEC       0xFFFA // Non-maskable interrupt vector address
-#define RST_VEC       0xFFFC // Reset interrupt vector address
-#define IRQ_VEC       0xFFFE // Maskable interrupt vector address
+#define CPU_FREQ       4e6    // Default processor frequency
+#define STEP_DURATION  10e6   // Default duration of each pacing slice
+#define CATCHUP_WINDOW 100e6  // Lag behind real time that is still caught up
+#define ONE_SECOND     1e9    // Number of nanoseconds in a second
+#define NUM_MODES      14     // Number of instruction modes
+#define NMI_VEC        0xFFFA // Non-maskable interrupt vector address
+#define RST_VEC        0xFFFC // Reset interrupt vector address
+#define IRQ_VEC        0xFFFE // Maskable interrupt vector address
+
+#define NMI_PENDING 0x80000000 // Latched NMI edge in CPUMAP.interrupts, whose other bits are IRQ sources
+#define EVENT_DUE   0x40000000 // Set in CPUMAP.interrupts when an event is scheduled before the end of the running budget
+#define IRQ_LINES   0x3FFFFFFF // IRQ source bits of CPUMAP.interrupts
+
+#define MAX_EVENTS 32 // Device events scheduled at once
+
+#define DELTA_MAGIC   "S65DLT2" // Memory delta dump file signature
+#define TRACE_MAGIC   "S65TRC1" // Binary trace file signature
+#define TRACE_RECORDS (1 << 20) // Trace records buffered before writing
+
+#define BLOCK_LENGTH   32      // Most instructions in a predecoded basic block
+#define BLOCK_POOL     0x20000 // Predecoded instructions cached before the whole cache is dropped
+#define BLOCK_REBUILDS 8       // Invalidations after which a page is no longer cached
+
+#define IDLE_STEPS 64 // Most instructions in one pass of a loop that can be fast-forwarded
 
 /* Processor Status Bits */
 struct StatusBits {
@@ -44,395 +62,630 @@ union StatusReg {
         uint8_t           byte;
 };
 
+/* Processor status register bit masks */
+#define SR_CARRY     0x01
+#define SR_ZERO      0x02
+#define SR_INTERRUPT 0x04
+#define SR_DECIMAL   0x08
+#define SR_BRK       0x10
+#define SR_UNUSED    0x20
+#define SR_OVERFLOW  0x40
+#define SR_SIGN      0x80
+
+/* Decimal mode behaviour of ADC and SBC */
+typedef enum {
+    DECIMAL_NMOS, // 6502: N, V and Z come from the intermediate and binary results
+    DECIMAL_CMOS, // 65C02: N and Z come from the decimal result, one extra cycle
+} DecimalModel;
+
 /* Instruction addressing modes */
 typedef enum { ACC, ABS, ABSX, ABSY, IMM, IMPL, IND, XIND, INDY, REL, ZP, ZPX, ZPY, JMP_IND_BUG } Mode;
 
+/* Machine context, one per emulated 6502 */
+typedef struct CPUMAP CPUMAP;
+
+/* Cycle profiler state, see profile.h */
+typedef struct Profile Profile;
+
+/* Reference trace a run is validated against, see validate.h */
+typedef struct Reference Reference;
+
+/* Basic blocks predecoded by the table core */
+typedef struct BlockCache BlockCache;
+
+/* Native translations of hot blocks, see jit.h */
+typedef struct Jit Jit;
+
 /* Instruction structure */
 typedef struct {
         const char *mnemonic;
-        void (*function)();
+        void (*function)(CPUMAP *cpu);
         Mode    mode;
         uint8_t cycles;
 } Instruction;
 
-/* CPU structure */
+/* Predecoded instruction */
+typedef struct {
+        uint16_t operand; // Operand bytes, low byte first
+        uint8_t  opcode;
+        uint8_t  length;  // Instruction bytes, 0 after the last instruction of a block
+} BlockOp;
+
+/* Device register access handlers, given the device mapped on the page */
+typedef uint8_t (*IoRead)(void *device, uint16_t addr);
+typedef void (*IoWrite)(void *device, uint16_t addr, uint8_t val);
+
+/* Device event handler, run once the cycle count reaches the cycle it was scheduled for */
+typedef void (*EventHandler)(void *device, uint64_t when);
+
+/* Scheduled device event */
+typedef struct {
+        uint64_t     when;
+        EventHandler handler;
+        void        *device;
+} Event;
+
+/* Reasons for the CPU core to return to the host; STOP_IDLE is a budget spent skipping over an idle loop */
+typedef enum { STOP_BUDGET, STOP_BREAK, STOP_REFERENCE, STOP_IDLE } StopReason;
+
+/* Memory delta dump record, written field by field without padding and followed by (page number, page contents) pairs */
+typedef struct {
+        uint64_t index;
+        uint16_t pages;
+} DeltaRecord;
+
+/* Binary trace record: CPU state before an instruction and the cycles it took */
+typedef struct {
+        uint16_t PC;
+        uint8_t  opcode[3];
+        uint8_t  A;
+        uint8_t  X;
+        uint8_t  Y;
+        uint8_t  SR;
+        uint8_t  SP;
+        uint8_t  cycles;
+} TraceRecord;
+
+/* Binary trace file header */
 typedef struct {
-        uint8_t         memory[1 << 16];
-        uint8_t         A;
-        uint8_t         X;
-        uint8_t         Y;
-        uint16_t        PC;
-        uint8_t         SP;
-        uint8_t         extra_cycles;
-        uint64_t        total_cycles;
-        union StatusReg SR;
-} CPUMAP;
+        char     magic[8];
+        uint64_t start_cycles;
+} TraceHeader;
+
+/* CPU structure: registers, memory, I/O map and tracing state of one machine */
+struct CPUMAP {
+        uint8_t            memory[1 << 16];
+        uint8_t            A;
+        uint8_t            X;
+        uint8_t            Y;
+        uint16_t           PC;
+        uint8_t            SP;
+        uint8_t            extra_cycles;
+        uint64_t           total_cycles;
+        uint64_t           total_instructions;
+        union StatusReg    SR;
+        const Instruction *inst;               // Instruction being executed by the table core
+        uint16_t           operand;            // Its operand bytes, low byte first
+        const Instruction *table;              // Instruction table of the table core, chosen by the decimal flag
+        DecimalModel       decimal;            // Decimal mode semantics of ADC and SBC
+        int                jumping;            // Set when the instruction loaded the PC itself
+        uint32_t           interrupts;         // IRQ sources holding the line, plus NMI_PENDING and EVENT_DUE
+        Event              events[MAX_EVENTS]; // Min-heap of scheduled device events by cycle
+        int                event_count;        // Number of scheduled events
+        uint64_t           next_event;         // Cycle of the earliest event, UINT64_MAX without any
+        uint64_t           run_end;            // Cycle the running core stops at, 0 outside run_cycles
+        uint64_t           io_accesses;        // Device register accesses, except status reads finding nothing to receive
+        IoRead             io_read[0x100];     // Device read handler per page
+        IoWrite            io_write[0x100];    // Device write handler per page
+        void              *io_device[0x100];   // Device state passed to the handlers
+        bool               dirty_pages[0x100]; // Pages written since the last delta record
+        bool               code_pages[0x100];  // Pages holding predecoded code, whose writes drop it
+        BlockCache        *blocks;             // Predecoded basic blocks of the table core, or NULL
+        Jit               *jit;                // Native translations of hot blocks, or NULL
+        FILE              *trace_fp;           // Binary trace output
+        TraceRecord       *trace_buf;          // Trace records not yet written out
+        size_t             trace_len;          // Number of buffered trace records
+        Profile           *profile;            // Profiler fed by the table core, or NULL
+        Reference         *reference;          // Reference trace the table core is checked against, or NULL
+};
 
 /* Addressing mode length */
 static const int lengths[NUM_MODES] = {[ACC] = 1,  [ABS] = 3,  [ABSX] = 3, [ABSY] = 3, [IMM] = 2, [IMPL] = 1, [IND] = 3,
                                        [XIND] = 2, [INDY] = 2, [REL] = 2,  [ZP] = 2,   [ZPX] = 2, [ZPY] = 2,  [JMP_IND_BUG] = 3};
 
+/* Instruction list: opcode, mnemonic, operation, addressing mode, cycles */
+#define INSTRUCTION_LIST(X)                   \
+    X(0x00, "BRK impl",  BRK, IMPL,        7) \
+    X(0x01, "ORA X,ind", ORA, XIND,        6) \
+    X(0x02, "???",       NOP, IMPL,        2) \
+    X(0x03, "???",       NOP, IMPL,        8) \
+    X(0x04, "???",       NOP, ZP,          3) \
+    X(0x05, "ORA zpg",   ORA, ZP,          3) \
+    X(0x06, "ASL zpg",   ASL, ZP,          5) \
+    X(0x07, "???",       NOP, IMPL,        5) \
+    X(0x08, "PHP impl",  PHP, IMPL,        3) \
+    X(0x09, "ORA #",     ORA, IMM,         2) \
+    X(0x0A, "ASL A",     ASL, ACC,         2) \
+    X(0x0B, "???",       NOP, IMPL,        2) \
+    X(0x0C, "???",       NOP, ABS,         4) \
+    X(0x0D, "ORA abs",   ORA, ABS,         4) \
+    X(0x0E, "ASL abs",   ASL, ABS,         6) \
+    X(0x0F, "???",       NOP, IMPL,        6) \
+    X(0x10, "BPL rel",   BPL, REL,         2) \
+    X(0x11, "ORA ind,Y", ORA, INDY,        5) \
+    X(0x12, "???",       NOP, IMPL,        2) \
+    X(0x13, "???",       NOP, IMPL,        8) \
+    X(0x14, "???",       NOP, ZP,          4) \
+    X(0x15, "ORA zpg,X", ORA, ZPX,         4) \
+    X(0x16, "ASL zpg,X", ASL, ZPX,         6) \
+    X(0x17, "???",       NOP, IMPL,        6) \
+    X(0x18, "CLC impl",  CLC, IMPL,        2) \
+    X(0x19, "ORA abs,Y", ORA, ABSY,        4) \
+    X(0x1A, "???",       NOP, IMPL,        2) \
+    X(0x1B, "???",       NOP, IMPL,        7) \
+    X(0x1C, "???",       NOP, ABSX,        4) \
+    X(0x1D, "ORA abs,X", ORA, ABSX,        4) \
+    X(0x1E, "ASL abs,X", ASL, ABSX,        7) \
+    X(0x1F, "???",       NOP, IMPL,        7) \
+    X(0x20, "JSR abs",   JSR, ABS,         6) \
+    X(0x21, "AND X,ind", AND, XIND,        6) \
+    X(0x22, "???",       NOP, IMPL,        2) \
+    X(0x23, "???",       NOP, IMPL,        8) \
+    X(0x24, "BIT zpg",   BIT, ZP,          3) \
+    X(0x25, "AND zpg",   AND, ZP,          3) \
+    X(0x26, "ROL zpg",   ROL, ZP,          5) \
+    X(0x27, "???",       NOP, IMPL,        5) \
+    X(0x28, "PLP impl",  PLP, IMPL,        4) \
+    X(0x29, "AND #",     AND, IMM,         2) \
+    X(0x2A, "ROL A",     ROL, ACC,         2) \
+    X(0x2B, "???",       NOP, IMPL,        2) \
+    X(0x2C, "BIT abs",   BIT, ABS,         4) \
+    X(0x2D, "AND abs",   AND, ABS,         4) \
+    X(0x2E, "ROL abs",   ROL, ABS,         6) \
+    X(0x2F, "???",       NOP, IMPL,        6) \
+    X(0x30, "BMI rel",   BMI, REL,         2) \
+    X(0x31, "AND ind,Y", AND, INDY,        5) \
+    X(0x32, "???",       NOP, IMPL,        2) \
+    X(0x33, "???",       NOP, IMPL,        8) \
+    X(0x34, "???",       NOP, ZP,          4) \
+    X(0x35, "AND zpg,X", AND, ZPX,         4) \
+    X(0x36, "ROL zpg,X", ROL, ZPX,         6) \
+    X(0x37, "???",       NOP, IMPL,        6) \
+    X(0x38, "SEC impl",  SEC, IMPL,        2) \
+    X(0x39, "AND abs,Y", AND, ABSY,        4) \
+    X(0x3A, "???",       NOP, IMPL,        2) \
+    X(0x3B, "???",       NOP, IMPL,        7) \
+    X(0x3C, "???",       NOP, ABSX,        4) \
+    X(0x3D, "AND abs,X", AND, ABSX,        4) \
+    X(0x3E, "ROL abs,X", ROL, ABSX,        7) \
+    X(0x3F, "???",       NOP, IMPL,        7) \
+    X(0x40, "RTI impl",  RTI, IMPL,        6) \
+    X(0x41, "EOR X,ind", EOR, XIND,        6) \
+    X(0x42, "???",       NOP, IMPL,        2) \
+    X(0x43, "???",       NOP, IMPL,        8) \
+    X(0x44, "???",       NOP, ZP,          3) \
+    X(0x45, "EOR zpg",   EOR, ZP,          3) \
+    X(0x46, "LSR zpg",   LSR, ZP,          5) \
+    X(0x47, "???",       NOP, IMPL,        5) \
+    X(0x48, "PHA impl",  PHA, IMPL,        3) \
+    X(0x49, "EOR #",     EOR, IMM,         2) \
+    X(0x4A, "LSR A",     LSR, ACC,         2) \
+    X(0x4B, "???",       NOP, IMPL,        2) \
+    X(0x4C, "JMP abs",   JMP, ABS,         3) \
+    X(0x4D, "EOR abs",   EOR, ABS,         4) \
+    X(0x4E, "LSR abs",   LSR, ABS,         6) \
+    X(0x4F, "???",       NOP, IMPL,        6) \
+    X(0x50, "BVC rel",   BVC, REL,         2) \
+    X(0x51, "EOR ind,Y", EOR, INDY,        5) \
+    X(0x52, "???",       NOP, IMPL,        2) \
+    X(0x53, "???",       NOP, IMPL,        8) \
+    X(0x54, "???",       NOP, ZP,          4) \
+    X(0x55, "EOR zpg,X", EOR, ZPX,         4) \
+    X(0x56, "LSR zpg,X", LSR, ZPX,         6) \
+    X(0x57, "???",       NOP, IMPL,        6) \
+    X(0x58, "CLI impl",  CLI, IMPL,        2) \
+    X(0x59, "EOR abs,Y", EOR, ABSY,        4) \
+    X(0x5A, "???",       NOP, IMPL,        2) \
+    X(0x5B, "???",       NOP, IMPL,        7) \
+    X(0x5C, "???",       NOP, ABSX,        4) \
+    X(0x5D, "EOR abs,X", EOR, ABSX,        4) \
+    X(0x5E, "LSR abs,X", LSR, ABSX,        7) \
+    X(0x5F, "???",       NOP, IMPL,        7) \
+    X(0x60, "RTS impl",  RTS, IMPL,        6) \
+    X(0x61, "ADC X,ind", ADC, XIND,        6) \
+    X(0x62, "???",       NOP, IMPL,        2) \
+    X(0x63, "???",       NOP, IMPL,        8) \
+    X(0x64, "???",       NOP, ZP,          3) \
+    X(0x65, "ADC zpg",   ADC, ZP,          3) \
+    X(0x66, "ROR zpg",   ROR, ZP,          5) \
+    X(0x67, "???",       NOP, IMPL,        5) \
+    X(0x68, "PLA impl",  PLA, IMPL,        4) \
+    X(0x69, "ADC #",     ADC, IMM,         2) \
+    X(0x6A, "ROR A",     ROR, ACC,         2) \
+    X(0x6B, "???",       NOP, IMPL,        2) \
+    X(0x6C, "JMP ind",   JMP, JMP_IND_BUG, 5) \
+    X(0x6D, "ADC abs",   ADC, ABS,         4) \
+    X(0x6E, "ROR abs",   ROR, ABS,         6) \
+    X(0x6F, "???",       NOP, IMPL,        6) \
+    X(0x70, "BVS rel",   BVS, REL,         2) \
+    X(0x71, "ADC ind,Y", ADC, INDY,        5) \
+    X(0x72, "???",       NOP, IMPL,        2) \
+    X(0x73, "???",       NOP, IMPL,        8) \
+    X(0x74, "???",       NOP, ZP,          4) \
+    X(0x75, "ADC zpg,X", ADC, ZPX,         4) \
+    X(0x76, "ROR zpg,X", ROR, ZPX,         6) \
+    X(0x77, "???",       NOP, IMPL,        6) \
+    X(0x78, "SEI impl",  SEI, IMPL,        2) \
+    X(0x79, "ADC abs,Y", ADC, ABSY,        4) \
+    X(0x7A, "???",       NOP, IMPL,        2) \
+    X(0x7B, "???",       NOP, IMPL,        7) \
+    X(0x7C, "???",       NOP, ABSX,        4) \
+    X(0x7D, "ADC abs,X", ADC, ABSX,        4) \
+    X(0x7E, "ROR abs,X", ROR, ABSX,        7) \
+    X(0x7F, "???",       NOP, IMPL,        7) \
+    X(0x80, "???",       NOP, IMM,         2) \
+    X(0x81, "STA X,ind", STA, XIND,        6) \
+    X(0x82, "???",       NOP, IMPL,        2) \
+    X(0x83, "???",       NOP, IMPL,        6) \
+    X(0x84, "STY zpg",   STY, ZP,          3) \
+    X(0x85, "STA zpg",   STA, ZP,          3) \
+    X(0x86, "STX zpg",   STX, ZP,          3) \
+    X(0x87, "???",       NOP, IMPL,        3) \
+    X(0x88, "DEY impl",  DEY, IMPL,        2) \
+    X(0x89, "???",       NOP, IMPL,        2) \
+    X(0x8A, "TXA impl",  TXA, IMPL,        2) \
+    X(0x8B, "???",       NOP, IMPL,        2) \
+    X(0x8C, "STY abs",   STY, ABS,         4) \
+    X(0x8D, "STA abs",   STA, ABS,         4) \
+    X(0x8E, "STX abs",   STX, ABS,         4) \
+    X(0x8F, "???",       NOP, IMPL,        4) \
+    X(0x90, "BCC rel",   BCC, REL,         2) \
+    X(0x91, "STA ind,Y", STA, INDY,        6) \
+    X(0x92, "???",       NOP, IMPL,        2) \
+    X(0x93, "???",       NOP, IMPL,        6) \
+    X(0x94, "STY zpg,X", STY, ZPX,         4) \
+    X(0x95, "STA zpg,X", STA, ZPX,         4) \
+    X(0x96, "STX zpg,Y", STX, ZPY,         4) \
+    X(0x97, "???",       NOP, IMPL,        4) \
+    X(0x98, "TYA impl",  TYA, IMPL,        2) \
+    X(0x99, "STA abs,Y", STA, ABSY,        5) \
+    X(0x9A, "TXS impl",  TXS, IMPL,        2) \
+    X(0x9B, "???",       NOP, IMPL,        5) \
+    X(0x9C, "???",       NOP, IMPL,        5) \
+    X(0x9D, "STA abs,X", STA, ABSX,        5) \
+    X(0x9E, "???",       NOP, IMPL,        5) \
+    X(0x9F, "???",       NOP, IMPL,        5) \
+    X(0xA0, "LDY #",     LDY, IMM,         2) \
+    X(0xA1, "LDA X,ind", LDA, XIND,        6) \
+    X(0xA2, "LDX #",     LDX, IMM,         2) \
+    X(0xA3, "???",       NOP, IMPL,        6) \
+    X(0xA4, "LDY zpg",   LDY, ZP,          3) \
+    X(0xA5, "LDA zpg",   LDA, ZP,          3) \
+    X(0xA6, "LDX zpg",   LDX, ZP,          3) \
+    X(0xA7, "???",       NOP, IMPL,        3) \
+    X(0xA8, "TAY impl",  TAY, IMPL,        2) \
+    X(0xA9, "LDA #",     LDA, IMM,         2) \
+    X(0xAA, "TAX impl",  TAX, IMPL,        2) \
+    X(0xAB, "???",       NOP, IMPL,        2) \
+    X(0xAC, "LDY abs",   LDY, ABS,         4) \
+    X(0xAD, "LDA abs",   LDA, ABS,         4) \
+    X(0xAE, "LDX abs",   LDX, ABS,         4) \
+    X(0xAF, "???",       NOP, IMPL,        4) \
+    X(0xB0, "BCS rel",   BCS, REL,         2) \
+    X(0xB1, "LDA ind,Y", LDA, INDY,        5) \
+    X(0xB2, "???",       NOP, IMPL,        2) \
+    X(0xB3, "???",       NOP, IMPL,        5) \
+    X(0xB4, "LDY zpg,X", LDY, ZPX,         4) \
+    X(0xB5, "LDA zpg,X", LDA, ZPX,         4) \
+    X(0xB6, "LDX zpg,Y", LDX, ZPY,         4) \
+    X(0xB7, "???",       NOP, IMPL,        4) \
+    X(0xB8, "CLV impl",  CLV, IMPL,        2) \
+    X(0xB9, "LDA abs,Y", LDA, ABSY,        4) \
+    X(0xBA, "TSX impl",  TSX, IMPL,        2) \
+    X(0xBB, "???",       NOP, IMPL,        4) \
+    X(0xBC, "LDY abs,X", LDY, ABSX,        4) \
+    X(0xBD, "LDA abs,X", LDA, ABSX,        4) \
+    X(0xBE, "LDX abs,Y", LDX, ABSY,        4) \
+    X(0xBF, "???",       NOP, IMPL,        4) \
+    X(0xC0, "CPY #",     CPY, IMM,         2) \
+    X(0xC1, "CMP X,ind", CMP, XIND,        6) \
+    X(0xC2, "???",       NOP, IMPL,        2) \
+    X(0xC3, "???",       NOP, IMPL,        8) \
+    X(0xC4, "CPY zpg",   CPY, ZP,          3) \
+    X(0xC5, "CMP zpg",   CMP, ZP,          3) \
+    X(0xC6, "DEC zpg",   DEC, ZP,          5) \
+    X(0xC7, "???",       NOP, IMPL,        5) \
+    X(0xC8, "INY impl",  INY, IMPL,        2) \
+    X(0xC9, "CMP #",     CMP, IMM,         2) \
+    X(0xCA, "DEX impl",  DEX, IMPL,        2) \
+    X(0xCB, "???",       NOP, IMPL,        2) \
+    X(0xCC, "CPY abs",   CPY, ABS,         4) \
+    X(0xCD, "CMP abs",   CMP, ABS,         4) \
+    X(0xCE, "DEC abs",   DEC, ABS,         6) \
+    X(0xCF, "???",       NOP, IMPL,        6) \
+    X(0xD0, "BNE rel",   BNE, REL,         2) \
+    X(0xD1, "CMP ind,Y", CMP, INDY,        5) \
+    X(0xD2, "???",       NOP, IMPL,        2) \
+    X(0xD3, "???",       NOP, IMPL,        8) \
+    X(0xD4, "???",       NOP, ZP,          4) \
+    X(0xD5, "CMP zpg,X", CMP, ZPX,         4) \
+    X(0xD6, "DEC zpg,X", DEC, ZPX,         6) \
+    X(0xD7, "???",       NOP, IMPL,        6) \
+    X(0xD8, "CLD impl",  CLD, IMPL,        2) \
+    X(0xD9, "CMP abs,Y", CMP, ABSY,        4) \
+    X(0xDA, "???",       NOP, IMPL,        2) \
+    X(0xDB, "???",       NOP, IMPL,        7) \
+    X(0xDC, "???",       NOP, ABSX,        4) \
+    X(0xDD, "CMP abs,X", CMP, ABSX,        4) \
+    X(0xDE, "DEC abs,X", DEC, ABSX,        7) \
+    X(0xDF, "???",       NOP, IMPL,        7) \
+    X(0xE0, "CPX #",     CPX, IMM,         2) \
+    X(0xE1, "SBC X,ind", SBC, XIND,        6) \
+    X(0xE2, "???",       NOP, IMPL,        2) \
+    X(0xE3, "???",       NOP, IMPL,        8) \
+    X(0xE4, "CPX zpg",   CPX, ZP,          3) \
+    X(0xE5, "SBC zpg",   SBC, ZP,          3) \
+    X(0xE6, "INC zpg",   INC, ZP,          5) \
+    X(0xE7, "???",       NOP, IMPL,        5) \
+    X(0xE8, "INX impl",  INX, IMPL,        2) \
+    X(0xE9, "SBC #",     SBC, IMM,         2) \
+    X(0xEA, "NOP impl",  NOP, IMPL,        2) \
+    X(0xEB, "???",       NOP, IMPL,        2) \
+    X(0xEC, "CPX abs",   CPX, ABS,         4) \
+    X(0xED, "SBC abs",   SBC, ABS,         4) \
+    X(0xEE, "INC abs",   INC, ABS,         6) \
+    X(0xEF, "???",       NOP, IMPL,        6) \
+    X(0xF0, "BEQ rel",   BEQ, REL,         2) \
+    X(0xF1, "SBC ind,Y", SBC, INDY,        5) \
+    X(0xF2, "???",       NOP, IMPL,        2) \
+    X(0xF3, "???",       NOP, IMPL,        8) \
+    X(0xF4, "???",       NOP, ZP,          4) \
+    X(0xF5, "SBC zpg,X", SBC, ZPX,         4) \
+    X(0xF6, "INC zpg,X", INC, ZPX,         6) \
+    X(0xF7, "???",       NOP, IMPL,        6) \
+    X(0xF8, "SED impl",  SED, IMPL,        2) \
+    X(0xF9, "SBC abs,Y", SBC, ABSY,        4) \
+    X(0xFA, "???",       NOP, IMPL,        2) \
+    X(0xFB, "???",       NOP, IMPL,        7) \
+    X(0xFC, "???",       NOP, ABSX,        4) \
+    X(0xFD, "SBC abs,X", SBC, ABSX,        4) \
+    X(0xFE, "INC abs,X", INC, ABSX,        7) \
+    X(0xFF, "???",       NOP, IMPL,        7)
+
 #ifndef INCLUDE
 
 /* Access memory according to different addressing modes */
-static uint8_t *get_ACC(void);
-static uint8_t *get_ABS(void);
-static uint8_t *get_ABSX(void);
-static uint8_t *get_ABSY(void);
-static uint8_t *get_IMM(void);
-static uint8_t *get_IMPL(void);
-static uint8_t *get_IND(void);
-static uint8_t *get_XIND(void);
-static uint8_t *get_INDY(void);
-static uint8_t *get_REL(void);
-static uint8_t *get_ZP(void);
-static uint8_t *get_ZPX(void);
-static uint8_t *get_ZPY(void);
-static uint8_t *get_JMP_IND_BUG(void);
+static uint8_t *get_ACC(CPUMAP *cpu);
+static uint8_t *get_ABS(CPUMAP *cpu);
+static uint8_t *get_ABSX(CPUMAP *cpu);
+static uint8_t *get_ABSY(CPUMAP *cpu);
+static uint8_t *get_IMM(CPUMAP *cpu);
+static uint8_t *get_IMPL(CPUMAP *cpu);
+static uint8_t *get_IND(CPUMAP *cpu);
+static uint8_t *get_XIND(CPUMAP *cpu);
+static uint8_t *get_INDY(CPUMAP *cpu);
+static uint8_t *get_REL(CPUMAP *cpu);
+static uint8_t *get_ZP(CPUMAP *cpu);
+static uint8_t *get_ZPX(CPUMAP *cpu);
+static uint8_t *get_ZPY(CPUMAP *cpu);
+static uint8_t *get_JMP_IND_BUG(CPUMAP *cpu);
 
 /* 6502 instruction set */
-static void inst_ADC(void);
-static void inst_AND(void);
-static void inst_ASL(void);
-static void inst_BCC(void);
-static void inst_BCS(void);
-static void inst_BEQ(void);
-static void inst_BIT(void);
-static void inst_BMI(void);
-static void inst_BNE(void);
-static void inst_BPL(void);
-static void inst_BRK(void);
-static void inst_BVC(void);
-static void inst_BVS(void);
-static void inst_CLC(void);
-static void inst_CLD(void);
-static void inst_CLI(void);
-static void inst_CLV(void);
-static void inst_CMP(void);
-static void inst_CPX(void);
-static void inst_CPY(void);
-static void inst_DEC(void);
-static void inst_DEX(void);
-static void inst_DEY(void);
-static void inst_EOR(void);
-static void inst_INC(void);
-static void inst_INX(void);
-static void inst_INY(void);
-static void inst_JMP(void);
-static void inst_JSR(void);
-static void inst_LDA(void);
-static void inst_LDX(void);
-static void inst_LDY(void);
-static void inst_LSR(void);
-static void inst_NOP(void);
-static void inst_ORA(void);
-static void inst_PHA(void);
-static void inst_PHP(void);
-static void inst_PLA(void);
-static void inst_PLP(void);
-static void inst_ROL(void);
-static void inst_ROR(void);
-static void inst_RTI(void);
-static void inst_RTS(void);
-static void inst_SBC(void);
-static void inst_SEC(void);
-static void inst_SED(void);
-static void inst_SEI(void);
-static void inst_STA(void);
-static void inst_STX(void);
-static void inst_STY(void);
-static void inst_TAX(void);
-static void inst_TAY(void);
-static void inst_TSX(void);
-static void inst_TXA(void);
-static void inst_TXS(void);
-static void inst_TYA(void);
+static void inst_ADC(CPUMAP *cpu);
+static void inst_AND(CPUMAP *cpu);
+static void inst_ASL(CPUMAP *cpu);
+static void inst_BCC(CPUMAP *cpu);
+static void inst_BCS(CPUMAP *cpu);
+static void inst_BEQ(CPUMAP *cpu);
+static void inst_BIT(CPUMAP *cpu);
+static void inst_BMI(CPUMAP *cpu);
+static void inst_BNE(CPUMAP *cpu);
+static void inst_BPL(CPUMAP *cpu);
+static void inst_BRK(CPUMAP *cpu);
+static void inst_BVC(CPUMAP *cpu);
+static void inst_BVS(CPUMAP *cpu);
+static void inst_CLC(CPUMAP *cpu);
+static void inst_CLD(CPUMAP *cpu);
+static void inst_CLI(CPUMAP *cpu);
+static void inst_CLV(CPUMAP *cpu);
+static void inst_CMP(CPUMAP *cpu);
+static void inst_CPX(CPUMAP *cpu);
+static void inst_CPY(CPUMAP *cpu);
+static void inst_DEC(CPUMAP *cpu);
+static void inst_DEX(CPUMAP *cpu);
+static void inst_DEY(CPUMAP *cpu);
+static void inst_EOR(CPUMAP *cpu);
+static void inst_INC(CPUMAP *cpu);
+static void inst_INX(CPUMAP *cpu);
+static void inst_INY(CPUMAP *cpu);
+static void inst_JMP(CPUMAP *cpu);
+static void inst_JSR(CPUMAP *cpu);
+static void inst_LDA(CPUMAP *cpu);
+static void inst_LDX(CPUMAP *cpu);
+static void inst_LDY(CPUMAP *cpu);
+static void inst_LSR(CPUMAP *cpu);
+static void inst_NOP(CPUMAP *cpu);
+static void inst_ORA(CPUMAP *cpu);
+static void inst_PHA(CPUMAP *cpu);
+static void inst_PHP(CPUMAP *cpu);
+static void inst_PLA(CPUMAP *cpu);
+static void inst_PLP(CPUMAP *cpu);
+static void inst_ROL(CPUMAP *cpu);
+static void inst_ROR(CPUMAP *cpu);
+static void inst_RTI(CPUMAP *cpu);
+static void inst_RTS(CPUMAP *cpu);
+static void inst_SBC(CPUMAP *cpu);
+static void inst_SEC(CPUMAP *cpu);
+static void inst_SED(CPUMAP *cpu);
+static void inst_SEI(CPUMAP *cpu);
+static void inst_STA(CPUMAP *cpu);
+static void inst_STX(CPUMAP *cpu);
+static void inst_STY(CPUMAP *cpu);
+static void inst_TAX(CPUMAP *cpu);
+static void inst_TAY(CPUMAP *cpu);
+static void inst_TSX(CPUMAP *cpu);
+static void inst_TXA(CPUMAP *cpu);
+static void inst_TXS(CPUMAP *cpu);
+static void inst_TYA(CPUMAP *cpu);
 
 /* Functions for getting memory addresses in different addressing modes */
-static uint8_t *(*const get_ptr[NUM_MODES])() = {[ACC] = get_ACC,   [ABS] = get_ABS,
-                                                 [ABSX] = get_ABSX, [ABSY] = get_ABSY,
-                                                 [IMM] = get_IMM,   [IMPL] = get_IMPL,
-                                                 [IND] = get_IND,   [XIND] = get_XIND,
-                                                 [INDY] = get_INDY, [REL] = get_REL,
-                                                 [ZP] = get_ZP,     [ZPX] = get_ZPX,
-                                                 [ZPY] = get_ZPY,   [JMP_IND_BUG] = get_JMP_IND_BUG};
+static uint8_t *(*const get_ptr[NUM_MODES])(CPUMAP *cpu) = {[ACC] = get_ACC,   [ABS] = get_ABS,
+                                                            [ABSX] = get_ABSX, [ABSY] = get_ABSY,
+                                                            [IMM] = get_IMM,   [IMPL] = get_IMPL,
+                                                            [IND] = get_IND,   [XIND] = get_XIND,
+                                                            [INDY] = get_INDY, [REL] = get_REL,
+                                                            [ZP] = get_ZP,     [ZPX] = get_ZPX,
+                                                            [ZPY] = get_ZPY,   [JMP_IND_BUG] = get_JMP_IND_BUG};
 
 /* Instruction List */
-static const Instruction instructions[0x100] = {
-    [0x00] = {"BRK impl",  inst_BRK, IMPL,        7},
-    [0x01] = {"ORA X,ind", inst_ORA, XIND,        6},
-    [0x02] = {"???",       inst_NOP, IMPL,        2},
-    [0x03] = {"???",       inst_NOP, IMPL,        8},
-    [0x04] = {"???",       inst_NOP, ZP,          3},
-    [0x05] = {"ORA zpg",   inst_ORA, ZP,          3},
-    [0x06] = {"ASL zpg",   inst_ASL, ZP,          5},
-    [0x07] = {"???",       inst_NOP, IMPL,        5},
-    [0x08] = {"PHP impl",  inst_PHP, IMPL,        3},
-    [0x09] = {"ORA #",     inst_ORA, IMM,         2},
-    [0x0A] = {"ASL A",     inst_ASL, ACC,         2},
-    [0x0B] = {"???",       inst_NOP, IMPL,        2},
-    [0x0C] = {"???",       inst_NOP, ABS,         4},
-    [0x0D] = {"ORA abs",   inst_ORA, ABS,         4},
-    [0x0E] = {"ASL abs",   inst_ASL, ABS,         6},
-    [0x0F] = {"???",       inst_NOP, IMPL,        6},
-    [0x10] = {"BPL rel",   inst_BPL, REL,         2},
-    [0x11] = {"ORA ind,Y", inst_ORA, INDY,        5},
-    [0x12] = {"???",       inst_NOP, IMPL,        2},
-    [0x13] = {"???",       inst_NOP, IMPL,        8},
-    [0x14] = {"???",       inst_NOP, ZP,          4},
-    [0x15] = {"ORA zpg,X", inst_ORA, ZPX,         4},
-    [0x16] = {"ASL zpg,X", inst_ASL, ZPX,         6},
-    [0x17] = {"???",       inst_NOP, IMPL,        6},
-    [0x18] = {"CLC impl",  inst_CLC, IMPL,        2},
-    [0x19] = {"ORA abs,Y", inst_ORA, ABSY,        4},
-    [0x1A] = {"???",       inst_NOP, IMPL,        2},
-    [0x1B] = {"???",       inst_NOP, IMPL,        7},
-    [0x1C] = {"???",       inst_NOP, ABSX,        4},
-    [0x1D] = {"ORA abs,X", inst_ORA, ABSX,        4},
-    [0x1E] = {"ASL abs,X", inst_ASL, ABSX,        7},
-    [0x1F] = {"???",       inst_NOP, IMPL,        7},
-    [0x20] = {"JSR abs",   inst_JSR, ABS,         6},
-    [0x21] = {"AND X,ind", inst_AND, XIND,        6},
-    [0x22] = {"???",       inst_NOP, IMPL,        2},
-    [0x23] = {"???",       inst_NOP, IMPL,        8},
-    [0x24] = {"BIT zpg",   inst_BIT, ZP,          3},
-    [0x25] = {"AND zpg",   inst_AND, ZP,          3},
-    [0x26] = {"ROL zpg",   inst_ROL, ZP,          5},
-    [0x27] = {"???",       inst_NOP, IMPL,        5},
-    [0x28] = {"PLP impl",  inst_PLP, IMPL,        4},
-    [0x29] = {"AND #",     inst_AND, IMM,         2},
-    [0x2A] = {"ROL A",     inst_ROL, ACC,         2},
-    [0x2B] = {"???",       inst_NOP, IMPL,        2},
-    [0x2C] = {"BIT abs",   inst_BIT, ABS,         4},
-    [0x2D] = {"AND abs",   inst_AND, ABS,         4},
-    [0x2E] = {"ROL abs",   inst_ROL, ABS,         6},
-    [0x2F] = {"???",       inst_NOP, IMPL,        6},
-    [0x30] = {"BMI rel",   inst_BMI, REL,         2},
-    [0x31] = {"AND ind,Y", inst_AND, INDY,        5},
-    [0x32] = {"???",       inst_NOP, IMPL,        2},
-    [0x33] = {"???",       inst_NOP, IMPL,        8},
-    [0x34] = {"???",       inst_NOP, ZP,          4},
-    [0x35] = {"AND zpg,X", inst_AND, ZPX,         4},
-    [0x36] = {"ROL zpg,X", inst_ROL, ZPX,         6},
-    [0x37] = {"???",       inst_NOP, IMPL,        6},
-    [0x38] = {"SEC impl",  inst_SEC, IMPL,        2},
-    [0x39] = {"AND abs,Y", inst_AND, ABSY,        4},
-    [0x3A] = {"???",       inst_NOP, IMPL,        2},
-    [0x3B] = {"???",       inst_NOP, IMPL,        7},
-    [0x3C] = {"???",       inst_NOP, ABSX,        4},
-    [0x3D] = {"AND abs,X", inst_AND, ABSX,        4},
-    [0x3E] = {"ROL abs,X", inst_ROL, ABSX,        7},
-    [0x3F] = {"???",       inst_NOP, IMPL,        7},
-    [0x40] = {"RTI impl",  inst_RTI, IMPL,        6},
-    [0x41] = {"EOR X,ind", inst_EOR, XIND,        6},
-    [0x42] = {"???",       inst_NOP, IMPL,        2},
-    [0x43] = {"???",       inst_NOP, IMPL,        8},
-    [0x44] = {"???",       inst_NOP, ZP,          3},
-    [0x45] = {"EOR zpg",   inst_EOR, ZP,          3},
-    [0x46] = {"LSR zpg",   inst_LSR, ZP,          5},
-    [0x47] = {"???",       inst_NOP, IMPL,        5},
-    [0x48] = {"PHA impl",  inst_PHA, IMPL,        3},
-    [0x49] = {"EOR #",     inst_EOR, IMM,         2},
-    [0x4A] = {"LSR A",     inst_LSR, ACC,         2},
-    [0x4B] = {"???",       inst_NOP, IMPL,        2},
-    [0x4C] = {"JMP abs",   inst_JMP, ABS,         3},
-    [0x4D] = {"EOR abs",   inst_EOR, ABS,         4},
-    [0x4E] = {"LSR abs",   inst_LSR, ABS,         6},
-    [0x4F] = {"???",       inst_NOP, IMPL,        6},
-    [0x50] = {"BVC rel",   inst_BVC, REL,         2},
-    [0x51] = {"EOR ind,Y", inst_EOR, INDY,        5},
-    [0x52] = {"???",       inst_NOP, IMPL,        2},
-    [0x53] = {"???",       inst_NOP, IMPL,        8},
-    [0x54] = {"???",       inst_NOP, ZP,          4},
-    [0x55] = {"EOR zpg,X", inst_EOR, ZPX,         4},
-    [0x56] = {"LSR zpg,X", inst_LSR, ZPX,         6},
-    [0x57] = {"???",       inst_NOP, IMPL,        6},
-    [0x58] = {"CLI impl",  inst_CLI, IMPL,        2},
-    [0x59] = {"EOR abs,Y", inst_EOR, ABSY,        4},
-    [0x5A] = {"???",       inst_NOP, IMPL,        2},
-    [0x5B] = {"???",       inst_NOP, IMPL,        7},
-    [0x5C] = {"???",       inst_NOP, ABSX,        4},
-    [0x5D] = {"EOR abs,X", inst_EOR, ABSX,        4},
-    [0x5E] = {"LSR abs,X", inst_LSR, ABSX,        7},
-    [0x5F] = {"???",       inst_NOP, IMPL,        7},
-    [0x60] = {"RTS impl",  inst_RTS, IMPL,        6},
-    [0x61] = {"ADC X,ind", inst_ADC, XIND,        6},
-    [0x62] = {"???",       inst_NOP, IMPL,        2},
-    [0x63] = {"???",       inst_NOP, IMPL,        8},
-    [0x64] = {"???",       inst_NOP, ZP,          3},
-    [0x65] = {"ADC zpg",   inst_ADC, ZP,          3},
-    [0x66] = {"ROR zpg",   inst_ROR, ZP,          5},
-    [0x67] = {"???",       inst_NOP, IMPL,        5},
-    [0x68] = {"PLA impl",  inst_PLA, IMPL,        4},
-    [0x69] = {"ADC #",     inst_ADC, IMM,         2},
-    [0x6A] = {"ROR A",     inst_ROR, ACC,         2},
-    [0x6B] = {"???",       inst_NOP, IMPL,        2},
-    [0x6C] = {"JMP ind",   inst_JMP, JMP_IND_BUG, 5},
-    [0x6D] = {"ADC abs",   inst_ADC, ABS,         4},
-    [0x6E] = {"ROR abs",   inst_ROR, ABS,         6},
-    [0x6F] = {"???",       inst_NOP, IMPL,        6},
-    [0x70] = {"BVS rel",   inst_BVS, REL,         2},
-    [0x71] = {"ADC ind,Y", inst_ADC, INDY,        5},
-    [0x72] = {"???",       inst_NOP, IMPL,        2},
-    [0x73] = {"???",       inst_NOP, IMPL,        8},
-    [0x74] = {"???",       inst_NOP, ZP,          4},
-    [0x75] = {"ADC zpg,X", inst_ADC, ZPX,         4},
-    [0x76] = {"ROR zpg,X", inst_ROR, ZPX,         6},
-    [0x77] = {"???",       inst_NOP, IMPL,        6},
-    [0x78] = {"SEI impl",  inst_SEI, IMPL,        2},
-    [0x79] = {"ADC abs,Y", inst_ADC, ABSY,        4},
-    [0x7A] = {"???",       inst_NOP, IMPL,        2},
-    [0x7B] = {"???",       inst_NOP, IMPL,        7},
-    [0x7C] = {"???",       inst_NOP, ABSX,        4},
-    [0x7D] = {"ADC abs,X", inst_ADC, ABSX,        4},
-    [0x7E] = {"ROR abs,X", inst_ROR, ABSX,        7},
-    [0x7F] = {"???",       inst_NOP, IMPL,        7},
-    [0x80] = {"???",       inst_NOP, IMM,         2},
-    [0x81] = {"STA X,ind", inst_STA, XIND,        6},
-    [0x82] = {"???",       inst_NOP, IMPL,        2},
-    [0x83] = {"???",       inst_NOP, IMPL,        6},
-    [0x84] = {"STY zpg",   inst_STY, ZP,          3},
-    [0x85] = {"STA zpg",   inst_STA, ZP,          3},
-    [0x86] = {"STX zpg",   inst_STX, ZP,          3},
-    [0x87] = {"???",       inst_NOP, IMPL,        3},
-    [0x88] = {"DEY impl",  inst_DEY, IMPL,        2},
-    [0x89] = {"???",       inst_NOP, IMPL,        2},
-    [0x8A] = {"TXA impl",  inst_TXA, IMPL,        2},
-    [0x8B] = {"???",       inst_NOP, IMPL,        2},
-    [0x8C] = {"STY abs",   inst_STY, ABS,         4},
-    [0x8D] = {"STA abs",   inst_STA, ABS,         4},
-    [0x8E] = {"STX abs",   inst_STX, ABS,         4},
-    [0x8F] = {"???",       inst_NOP, IMPL,        4},
-    [0x90] = {"BCC rel",   inst_BCC, REL,         2},
-    [0x91] = {"STA ind,Y", inst_STA, INDY,        6},
-    [0x92] = {"???",       inst_NOP, IMPL,        2},
-    [0x93] = {"???",       inst_NOP, IMPL,        6},
-    [0x94] = {"STY zpg,X", inst_STY, ZPX,         4},
-    [0x95] = {"STA zpg,X", inst_STA, ZPX,         4},
-    [0x96] = {"STX zpg,Y", inst_STX, ZPY,         4},
-    [0x97] = {"???",       inst_NOP, IMPL,        4},
-    [0x98] = {"TYA impl",  inst_TYA, IMPL,        2},
-    [0x99] = {"STA abs,Y", inst_STA, ABSY,        5},
-    [0x9A] = {"TXS impl",  inst_TXS, IMPL,        2},
-    [0x9B] = {"???",       inst_NOP, IMPL,        5},
-    [0x9C] = {"???",       inst_NOP, IMPL,        5},
-    [0x9D] = {"STA abs,X", inst_STA, ABSX,        5},
-    [0x9E] = {"???",       inst_NOP, IMPL,        5},
-    [0x9F] = {"???",       inst_NOP, IMPL,        5},
-    [0xA0] = {"LDY #",     inst_LDY, IMM,         2},
-    [0xA1] = {"LDA X,ind", inst_LDA, XIND,        6},
-    [0xA2] = {"LDX #",     inst_LDX, IMM,         2},
-    [0xA3] = {"???",       inst_NOP, IMPL,        6},
-    [0xA4] = {"LDY zpg",   inst_LDY, ZP,          3},
-    [0xA5] = {"LDA zpg",   inst_LDA, ZP,          3},
-    [0xA6] = {"LDX zpg",   inst_LDX, ZP,          3},
-    [0xA7] = {"???",       inst_NOP, IMPL,        3},
-    [0xA8] = {"TAY impl",  inst_TAY, IMPL,        2},
-    [0xA9] = {"LDA #",     inst_LDA, IMM,         2},
-    [0xAA] = {"TAX impl",  inst_TAX, IMPL,        2},
-    [0xAB] = {"???",       inst_NOP, IMPL,        2},
-    [0xAC] = {"LDY abs",   inst_LDY, ABS,         4},
-    [0xAD] = {"LDA abs",   inst_LDA, ABS,         4},
-    [0xAE] = {"LDX abs",   inst_LDX, ABS,         4},
-    [0xAF] = {"???",       inst_NOP, IMPL,        4},
-    [0xB0] = {"BCS rel",   inst_BCS, REL,         2},
-    [0xB1] = {"LDA ind,Y", inst_LDA, INDY,        5},
-    [0xB2] = {"???",       inst_NOP, IMPL,        2},
-    [0xB3] = {"???",       inst_NOP, IMPL,        5},
-    [0xB4] = {"LDY zpg,X", inst_LDY, ZPX,         4},
-    [0xB5] = {"LDA zpg,X", inst_LDA, ZPX,         4},
-    [0xB6] = {"LDX zpg,Y", inst_LDX, ZPY,         4},
-    [0xB7] = {"???",       inst_NOP, IMPL,        4},
-    [0xB8] = {"CLV impl",  inst_CLV, IMPL,        2},
-    [0xB9] = {"LDA abs,Y", inst_LDA, ABSY,        4},
-    [0xBA] = {"TSX impl",  inst_TSX, IMPL,        2},
-    [0xBB] = {"???",       inst_NOP, IMPL,        4},
-    [0xBC] = {"LDY abs,X", inst_LDY, ABSX,        4},
-    [0xBD] = {"LDA abs,X", inst_LDA, ABSX,        4},
-    [0xBE] = {"LDX abs,Y", inst_LDX, ABSY,        4},
-    [0xBF] = {"???",       inst_NOP, IMPL,        4},
-    [0xC0] = {"CPY #",     inst_CPY, IMM,         2},
-    [0xC1] = {"CMP X,ind", inst_CMP, XIND,        6},
-    [0xC2] = {"???",       inst_NOP, IMPL,        2},
-    [0xC3] = {"???",       inst_NOP, IMPL,        8},
-    [0xC4] = {"CPY zpg",   inst_CPY, ZP,          3},
-    [0xC5] = {"CMP zpg",   inst_CMP, ZP,          3},
-    [0xC6] = {"DEC zpg",   inst_DEC, ZP,          5},
-    [0xC7] = {"???",       inst_NOP, IMPL,        5},
-    [0xC8] = {"INY impl",  inst_INY, IMPL,        2},
-    [0xC9] = {"CMP #",     inst_CMP, IMM,         2},
-    [0xCA] = {"DEX impl",  inst_DEX, IMPL,        2},
-    [0xCB] = {"???",       inst_NOP, IMPL,        2},
-    [0xCC] = {"CPY abs",   inst_CPY, ABS,         4},
-    [0xCD] = {"CMP abs",   inst_CMP, ABS,         4},
-    [0xCE] = {"DEC abs",   inst_DEC, ABS,         6},
-    [0xCF] = {"???",       inst_NOP, IMPL,        6},
-    [0xD0] = {"BNE rel",   inst_BNE, REL,         2},
-    [0xD1] = {"CMP ind,Y", inst_CMP, INDY,        5},
-    [0xD2] = {"???",       inst_NOP, IMPL,        2},
-    [0xD3] = {"???",       inst_NOP, IMPL,        8},
-    [0xD4] = {"???",       inst_NOP, ZP,          4},
-    [0xD5] = {"CMP zpg,X", inst_CMP, ZPX,         4},
-    [0xD6] = {"DEC zpg,X", inst_DEC, ZPX,         6},
-    [0xD7] = {"???",       inst_NOP, IMPL,        6},
-    [0xD8] = {"CLD impl",  inst_CLD, IMPL,        2},
-    [0xD9] = {"CMP abs,Y", inst_CMP, ABSY,        4},
-    [0xDA] = {"???",       inst_NOP, IMPL,        2},
-    [0xDB] = {"???",       inst_NOP, IMPL,        7},
-    [0xDC] = {"???",       inst_NOP, ABSX,        4},
-    [0xDD] = {"CMP abs,X", inst_CMP, ABSX,        4},
-    [0xDE] = {"DEC abs,X", inst_DEC, ABSX,        7},
-    [0xDF] = {"???",       inst_NOP, IMPL,        7},
-    [0xE0] = {"CPX #",     inst_CPX, IMM,         2},
-    [0xE1] = {"SBC X,ind", inst_SBC, XIND,        6},
-    [0xE2] = {"???",       inst_NOP, IMPL,        2},
-    [0xE3] = {"???",       inst_NOP, IMPL,        8},
-    [0xE4] = {"CPX zpg",   inst_CPX, ZP,          3},
-    [0xE5] = {"SBC zpg",   inst_SBC, ZP,          3},
-    [0xE6] = {"INC zpg",   inst_INC, ZP,          5},
-    [0xE7] = {"???",       inst_NOP, IMPL,        5},
-    [0xE8] = {"INX impl",  inst_INX, IMPL,        2},
-    [0xE9] = {"SBC #",     inst_SBC, IMM,         2},
-    [0xEA] = {"NOP impl",  inst_NOP, IMPL,        2},
-    [0xEB] = {"???",       inst_NOP, IMPL,        2},
-    [0xEC] = {"CPX abs",   inst_CPX, ABS,         4},
-    [0xED] = {"SBC abs",   inst_SBC, ABS,         4},
-    [0xEE] = {"INC abs",   inst_INC, ABS,         6},
-    [0xEF] = {"???",       inst_NOP, IMPL,        6},
-    [0xF0] = {"BEQ rel",   inst_BEQ, REL,         2},
-    [0xF1] = {"SBC ind,Y", inst_SBC, INDY,        5},
-    [0xF2] = {"???",       inst_NOP, IMPL,        2},
-    [0xF3] = {"???",       inst_NOP, IMPL,        8},
-    [0xF4] = {"???",       inst_NOP, ZP,          4},
-    [0xF5] = {"SBC zpg,X", inst_SBC, ZPX,         4},
-    [0xF6] = {"INC zpg,X", inst_INC, ZPX,         6},
-    [0xF7] = {"???",       inst_NOP, IMPL,        6},
-    [0xF8] = {"SED impl",  inst_SED, IMPL,        2},
-    [0xF9] = {"SBC abs,Y", inst_SBC, ABSY,        4},
-    [0xFA] = {"???",       inst_NOP, IMPL,        2},
-    [0xFB] = {"???",       inst_NOP, IMPL,        7},
-    [0xFC] = {"???",       inst_NOP, ABSX,        4},
-    [0xFD] = {"SBC abs,X", inst_SBC, ABSX,        4},
-    [0xFE] = {"INC abs,X", inst_INC, ABSX,        7},
-    [0xFF] = {"???",       inst_NOP, IMPL,        7}
-};
+#define INSTRUCTION_ENTRY(opcode, mnemonic, name, mode, cycles) [opcode] = {mnemonic, inst_##name, mode, cycles},
+static const Instruction instructions[0x100] = {INSTRUCTION_LIST(INSTRUCTION_ENTRY)};
+#undef INSTRUCTION_ENTRY
 
 #endif // INCLUDE
 
-extern CPUMAP CPU;
-extern void  *read_addr;
-extern void  *write_addr;
+/* Decimal mode ADC and SBC results by model, carry, A and operand: A in the low byte, N, V, Z and C in the high byte */
+extern uint16_t bcd_adc[2][2][0x100][0x100];
+extern uint16_t bcd_sbc[2][2][0x100][0x100];
+
+/* Host monotonic time in nanoseconds */
+static inline uint64_t host_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * ONE_SECOND + now.tv_nsec;
+}
+
+/* Read a byte, going through the device handler of its page if there is one */
+static inline uint8_t read_byte(CPUMAP *cpu, uint16_t addr)
+{
+    IoRead read = cpu->io_read[addr >> 8];
+    return read ? read(cpu->io_device[addr >> 8], addr) : cpu->memory[addr];
+}
+
+/* Assert or release the IRQ line on behalf of one source bit */
+static inline void set_irq(CPUMAP *cpu, uint32_t source, bool asserted)
+{
+    if (asserted)
+        cpu->interrupts |= source;
+    else
+        cpu->interrupts &= ~source;
+}
+
+/* Latch an edge on the NMI line */
+static inline void trigger_nmi(CPUMAP *cpu)
+{
+    cpu->interrupts |= NMI_PENDING;
+}
+
+/* Whether the core has to stop at the next instruction boundary, to take an interrupt or to fire an event scheduled inside its run */
+static inline bool interrupt_pending(CPUMAP *cpu)
+{
+    return cpu->interrupts && ((cpu->interrupts & (NMI_PENDING | EVENT_DUE)) || !cpu->SR.bits.interrupt);
+}
+
+/* Fire the events that are due */
+void fire_events(CPUMAP *cpu);
+
+/* Fire the events that are due, if there are any */
+static inline void run_events(CPUMAP *cpu)
+{
+    if (cpu->total_cycles >= cpu->next_event) fire_events(cpu);
+}
+
+/* Drop the predecoded blocks that may hold code from a page about to be written */
+void invalidate_code(CPUMAP *cpu, uint8_t page);
+
+/* Drop every predecoded block, after memory was replaced behind the cores' back */
+void flush_blocks(CPUMAP *cpu);
+
+/* Write a byte, going through the device handler of its page if there is one */
+static inline void write_byte(CPUMAP *cpu, uint16_t addr, uint8_t val)
+{
+    IoWrite write = cpu->io_write[addr >> 8];
+
+    cpu->dirty_pages[addr >> 8] = 1;
+    if (cpu->code_pages[addr >> 8]) invalidate_code(cpu, addr >> 8);
+    if (write)
+        write(cpu->io_device[addr >> 8], addr, val);
+    else
+        cpu->memory[addr] = val;
+}
+
+/* Allocate a machine with empty memory and no devices */
+CPUMAP *create_cpu(void);
+
+/* Release a machine, its trace buffer, its profile, its predecoded blocks and their translations */
+void free_cpu(CPUMAP *cpu);
 
 /* Reset CPU state */
-void reset_cpu(int _a, int _x, int _y, int _sp, int _sr, int _pc);
+void reset_cpu(CPUMAP *cpu, int _a, int _x, int _y, int _sp, int _sr, int _pc);
+
+/* Set the processor status register, switching the decimal instruction table in or out */
+void set_status(CPUMAP *cpu, uint8_t sr);
+
+/* Load ROM file into memory, returning the number of bytes loaded */
+int load_rom(CPUMAP *cpu, char *filename, int load_addr);
+
+/* Enter the handler of the pending interrupt, returning the cycles it took, or 0 if only an event is due */
+int take_interrupt(CPUMAP *cpu);
+
+/* Execute an instruction, or enter the handler of a pending interrupt */
+int step_cpu(CPUMAP *cpu, int verbose);
+
+/* Execute instructions with the threaded core */
+StopReason run_threaded(CPUMAP *cpu, uint64_t budget, int break_pc);
 
-/* Load ROM file into memory */
-int load_rom(char *filename, int load_addr);
+/* Execute instructions until the budget is used up or the PC reaches break_pc, from predecoded blocks on the table core */
+StopReason run_cycles(CPUMAP *cpu, uint64_t budget, int break_pc, int threaded);
 
-/* Execute an instruction */
-int step_cpu(int verbose);
+/* Fast-forward whole passes of a loop the program spins in without changing memory, up to the budget, and return STOP_IDLE; runs at
+   most IDLE_STEPS instructions if it is not in one */
+StopReason run_idle(CPUMAP *cpu, uint64_t budget, int break_pc);
+
+/* Start writing a binary trace of every executed instruction */
+int open_trace(CPUMAP *cpu, const char *filename);
+
+/* Stop writing the binary trace */
+void close_trace(CPUMAP *cpu);
+
+/* Print a trace record in the nestest log layout */
+void print_trace(FILE *fp, const TraceRecord *rec, uint64_t total_cycles);
+
+/* Print a binary trace file in the -v text format */
+int decode_trace(const char *filename);
+
+/* Mnemonic and addressing mode of an opcode */
+const char *opcode_name(uint8_t opcode);
+
+/* Install device handlers for a memory page */
+void map_io(CPUMAP *cpu, uint8_t page, IoRead read, IoWrite write, void *device);
+
+/* Remove a device from every page it is mapped on */
+void unmap_device(CPUMAP *cpu, void *device);
+
+/* Hand every page of a device over to another one with the same handlers */
+void move_device(CPUMAP *cpu, void *from, void *to);
+
+/* Run the device's handler once the cycle count reaches when, replacing an earlier schedule of the same handler and device */
+void schedule_event(CPUMAP *cpu, uint64_t when, EventHandler handler, void *device);
+
+/* Drop the scheduled event of the handler and device, if there is one */
+void cancel_event(CPUMAP *cpu, EventHandler handler, void *device);
+
+/* Drop every event of a device */
+void cancel_events(CPUMAP *cpu, void *device);
 
 /* Memory dump */
-void save_memory(const char *filename);
+void save_memory(CPUMAP *cpu, const char *filename);
+
+/* Start a delta dump with its signature */
+void start_memory_delta(FILE *fp);
+
+/* Append the pages written since the last call to a delta dump */
+void save_memory_delta(CPUMAP *cpu, FILE *fp, uint64_t index);
+
+/* Rebuild the memory image at an instruction index from a delta dump */
+int load_memory_delta(CPUMAP *cpu, const char *filename, uint64_t index);
 
 #endif // INCLUDE_6502_H_
@@ -0,0 +1,428 @@
+/*
+ *
+ *      6522.c
+ *      VIA Controller
+ *
+ *      2024/12/13 By MicroFish
+ *      Based on MIT open source agreement
+ *      Copyright © 2020 ViudiraTech, based on the MIT agreement.
+ *
+ */
+
+#include <stdlib.h>
+
+#define INCLUDE
+#include "6502.h"
+#include "6522.h"
+
+/* VIA state, one per machine */
+struct Via {
+        CPUMAP  *cpu;
+        uint8_t  ora; // Port output latches, driving the pins set as outputs
+        uint8_t  orb;
+        uint8_t  ddra;
+        uint8_t  ddrb;
+        uint8_t  acr;
+        uint8_t  pcr;
+        uint8_t  ifr; // Interrupt flags, without bit 7
+        uint8_t  ier; // Interrupt enables, without bit 7
+        uint8_t  sr;
+        uint64_t event; // Cycle of the scheduled event, UINT64_MAX for none
+
+        /* The timers are never counted down: their counters follow from the cycle count at which they next time out */
+        uint16_t t1_latch;
+        uint64_t t1_timeout; // Cycle at which the counter reads $FFFF
+        bool     t1_armed;   // The next timeout sets the flag in one-shot mode
+        bool     t1_pb7;     // Output level on PB7
+        uint8_t  t2_latch;   // Low byte of the next count
+        uint64_t t2_timeout;
+        uint16_t t2_count; // Counter while counting pulses on PB6
+        bool     t2_armed;
+
+        /* Shift register, moving its byte one bit every sr_bit cycles */
+        uint64_t sr_start;
+        uint32_t sr_bit;
+        bool     sr_busy;
+};
+
+/* Cycles per shifted bit in the current shift mode, 0 when the shift never completes */
+static uint32_t sr_bit_cycles(Via *via)
+{
+    switch ((via->acr & ACR_SR_MASK) >> 2) {
+        case 1 :
+        case 5 :
+            return 2 * (via->t2_latch + 2); // CB1 toggles at every timeout of the low byte of timer 2
+        case 2 :
+        case 6 :
+            return 2; // CB1 runs at half the clock
+        default :
+            return 0; // Disabled, shifting out forever, or clocked by nothing on CB1
+    }
+}
+
+/* Content of the shift register, bits_done bits into its byte; nothing drives CB2, so bits shifted in are ones */
+static uint8_t sr_shifted(Via *via, unsigned bits_done)
+{
+    if (via->acr & 0x10) return (via->sr << bits_done) | (via->sr >> (8 - bits_done));
+    return (via->sr << bits_done) | ((1 << bits_done) - 1);
+}
+
+/* Bring the timers and the shift register up to the cycle count, raising the flags of what completed since */
+static void via_sync(Via *via, uint64_t now)
+{
+    uint64_t period, passes;
+
+    if (now >= via->t1_timeout) {
+        if (via->acr & ACR_T1_FREE) {
+            period = via->t1_latch + 2;
+            passes = (now - via->t1_timeout) / period + 1;
+            via->ifr |= IFR_T1;
+            via->t1_pb7 ^= passes & 1;
+            via->t1_timeout += passes * period;
+        } else if (via->t1_armed) {
+            via->ifr |= IFR_T1;
+            via->t1_armed = 0;
+            via->t1_pb7   = 1;
+        }
+    }
+    if (via->t2_armed && !(via->acr & ACR_T2_PULSE) && now >= via->t2_timeout) {
+        via->ifr |= IFR_T2;
+        via->t2_armed = 0;
+    }
+    if (via->sr_busy && now >= via->sr_start + 8 * via->sr_bit) {
+        via->sr = sr_shifted(via, 8);
+        via->ifr |= IFR_SR;
+        via->sr_busy = 0;
+    }
+}
+
+/* Timer 1 counter, once synced */
+static uint16_t t1_value(Via *via, uint64_t now)
+{
+    uint16_t left = via->t1_timeout - now - 1;
+
+    /* Free-running, it holds $FFFF for the cycle between timing out and reloading */
+    if ((via->acr & ACR_T1_FREE) && left > via->t1_latch) return 0xFFFF;
+    return left;
+}
+
+/* Timer 2 counter, once synced */
+static uint16_t t2_value(Via *via, uint64_t now)
+{
+    if (via->acr & ACR_T2_PULSE) return via->t2_count;
+    return via->t2_timeout - now - 1;
+}
+
+/* Shift register content, once synced */
+static uint8_t sr_value(Via *via, uint64_t now)
+{
+    if (!via->sr_busy) return via->sr;
+    return sr_shifted(via, (now - via->sr_start) / via->sr_bit);
+}
+
+/* Start moving a byte through the shift register */
+static void sr_start(Via *via, uint64_t now)
+{
+    via->ifr &= ~IFR_SR;
+    via->sr_bit   = sr_bit_cycles(via);
+    via->sr_busy  = via->sr_bit != 0;
+    via->sr_start = now;
+}
+
+/* A timer or the shift register has completed */
+static void via_event(void *device, uint64_t when);
+
+/* Drive the IRQ line from the flags and enables, and schedule an event for the next flag that would raise it */
+static void via_update(Via *via)
+{
+    uint64_t next = UINT64_MAX;
+    uint8_t  wait = ~via->ifr;
+
+    set_irq(via->cpu, VIA_IRQ, via->ifr & via->ier);
+
+    /* Every flag still to be raised gets an event, enabled or not, so nothing skipping ahead to the next event can run past it */
+    if ((wait & IFR_T1) && ((via->acr & ACR_T1_FREE) || via->t1_armed)) next = via->t1_timeout;
+    if ((wait & IFR_T2) && via->t2_armed && !(via->acr & ACR_T2_PULSE) && via->t2_timeout < next) next = via->t2_timeout;
+    if ((wait & IFR_SR) && via->sr_busy && via->sr_start + 8 * via->sr_bit < next) next = via->sr_start + 8 * via->sr_bit;
+    if (next == via->event) return;
+    via->event = next;
+    if (next == UINT64_MAX)
+        cancel_event(via->cpu, via_event, via);
+    else
+        schedule_event(via->cpu, next, via_event, via);
+}
+
+/* A timer or the shift register has completed */
+static void via_event(void *device, uint64_t when)
+{
+    Via *via = device;
+
+    via->event = UINT64_MAX;
+    via_sync(via, when);
+    via_update(via);
+}
+
+/* Port pins: outputs follow their latch, and nothing drives the inputs, which read high */
+static uint8_t port_pins(uint8_t out, uint8_t ddr)
+{
+    return (out & ddr) | ~ddr;
+}
+
+/* Read a VIA register */
+static uint8_t via_read(void *device, uint16_t addr)
+{
+    Via     *via = device;
+    uint64_t now = via->cpu->total_cycles;
+    uint8_t  val;
+
+    if ((addr & 0xFF) >= 16) return via->cpu->memory[addr];
+    via->cpu->io_accesses++;
+    via_sync(via, now);
+    switch (addr & 0x0F) {
+        case VIA_ORB :
+            via->ifr &= (via->pcr & 0xA0) == 0x20 ? ~IFR_CB1 : ~(IFR_CB1 | IFR_CB2);
+            val = port_pins(via->orb, via->ddrb);
+            if (via->acr & ACR_T1_PB7) val = (val & 0x7F) | (via->t1_pb7 << 7);
+            break;
+        case VIA_ORA :
+            via->ifr &= (via->pcr & 0x0A) == 0x02 ? ~IFR_CA1 : ~(IFR_CA1 | IFR_CA2);
+            val = port_pins(via->ora, via->ddra);
+            break;
+        case VIA_ORAN :
+            val = port_pins(via->ora, via->ddra);
+            break;
+        case VIA_DDRB :
+            val = via->ddrb;
+            break;
+        case VIA_DDRA :
+            val = via->ddra;
+            break;
+        case VIA_T1CL :
+            via->ifr &= ~IFR_T1;
+            val = t1_value(via, now);
+            break;
+        case VIA_T1CH :
+            val = t1_value(via, now) >> 8;
+            break;
+        case VIA_T1LL :
+            val = via->t1_latch;
+            break;
+        case VIA_T1LH :
+            val = via->t1_latch >> 8;
+            break;
+        case VIA_T2CL :
+            via->ifr &= ~IFR_T2;
+            val = t2_value(via, now);
+            break;
+        case VIA_T2CH :
+            val = t2_value(via, now) >> 8;
+            break;
+        case VIA_SR :
+            val = via->sr = sr_value(via, now);
+            sr_start(via, now);
+            break;
+        case VIA_ACR :
+            val = via->acr;
+            break;
+        case VIA_PCR :
+            val = via->pcr;
+            break;
+        case VIA_IFR :
+            val = via->ifr | ((via->ifr & via->ier) ? IFR_IRQ : 0);
+            break;
+        default :
+            val = via->ier | IFR_IRQ;
+            break;
+    }
+    via_update(via);
+    return val;
+}
+
+/* Switch the auxiliary control register, carrying the timers across a change of mode */
+static void via_set_acr(Via *via, uint8_t val, uint64_t now)
+{
+    uint8_t changed = via->acr ^ val;
+
+    /* A one-shot timer 1 that timed out long ago keeps wrapping; it starts running free at its next wrap */
+    if ((changed & val & ACR_T1_FREE) && via->t1_timeout <= now) via->t1_timeout += ((now - via->t1_timeout) / 0x10000 + 1) * 0x10000;
+    if (changed & ACR_T2_PULSE) {
+        if (val & ACR_T2_PULSE)
+            via->t2_count = t2_value(via, now);
+        else
+            via->t2_timeout = now + via->t2_count + 1;
+    }
+    /* A new shift mode drops the byte in flight where it stands */
+    if ((changed & ACR_SR_MASK) && via->sr_busy) {
+        via->sr      = sr_value(via, now);
+        via->sr_busy = 0;
+    }
+    via->acr = val;
+}
+
+/* Write a VIA register */
+static void via_write(void *device, uint16_t addr, uint8_t val)
+{
+    Via     *via = device;
+    uint64_t now = via->cpu->total_cycles;
+
+    via->cpu->memory[addr] = val;
+    if ((addr & 0xFF) >= 16) return;
+    via->cpu->io_accesses++;
+    via_sync(via, now);
+    switch (addr & 0x0F) {
+        case VIA_ORB :
+            via->ifr &= (via->pcr & 0xA0) == 0x20 ? ~IFR_CB1 : ~(IFR_CB1 | IFR_CB2);
+            via->orb = val;
+            break;
+        case VIA_ORA :
+            via->ifr &= (via->pcr & 0x0A) == 0x02 ? ~IFR_CA1 : ~(IFR_CA1 | IFR_CA2);
+            via->ora = val;
+            break;
+        case VIA_ORAN :
+            via->ora = val;
+            break;
+        case VIA_DDRB :
+            via->ddrb = val;
+            break;
+        case VIA_DDRA :
+            via->ddra = val;
+            break;
+        case VIA_T1CL :
+        case VIA_T1LL :
+            via->t1_latch = (via->t1_latch & 0xFF00) | val;
+            break;
+        case VIA_T1CH :
+            via->t1_latch   = (via->t1_latch & 0x00FF) | (val << 8);
+            via->t1_timeout = now + via->t1_latch + 1;
+            via->t1_armed   = 1;
+            via->t1_pb7     = 0;
+            via->ifr &= ~IFR_T1;
+            break;
+        case VIA_T1LH :
+            via->t1_latch = (via->t1_latch & 0x00FF) | (val << 8);
+            via->ifr &= ~IFR_T1;
+            break;
+        case VIA_T2CL :
+            via->t2_latch = val;
+            break;
+        case VIA_T2CH :
+            if (via->acr & ACR_T2_PULSE)
+                via->t2_count = (val << 8) | via->t2_latch;
+            else
+                via->t2_timeout = now + ((val << 8) | via->t2_latch) + 1;
+            via->t2_armed = 1;
+            via->ifr &= ~IFR_T2;
+            break;
+        case VIA_SR :
+            via->sr = val;
+            sr_start(via, now);
+            break;
+        case VIA_ACR :
+            via_set_acr(via, val, now);
+            break;
+        case VIA_PCR :
+            via->pcr = val;
+            break;
+        case VIA_IFR :
+            via->ifr &= ~val;
+            break;
+        default :
+            if (val & IFR_IRQ)
+                via->ier |= val & 0x7F;
+            else
+                via->ier &= ~val;
+            break;
+    }
+    via_update(via);
+}
+
+/* Initialize the VIA and map it at VIA_ADDR */
+Via *init_via(CPUMAP *cpu)
+{
+    Via *via = calloc(1, sizeof(Via));
+
+    if (via == NULL) {
+        fprintf(stderr, "Error: Unable to allocate the VIA.\n");
+        return NULL;
+    }
+    /* Reset clears the registers; the timers keep counting down from wherever they are */
+    via->cpu        = cpu;
+    via->event      = UINT64_MAX;
+    via->t1_timeout = cpu->total_cycles + 0x10000;
+    via->t2_timeout = cpu->total_cycles + 0x10000;
+    map_via(via, VIA_ADDR >> 8);
+    return via;
+}
+
+/* Map the VIA registers at the start of a page as well */
+void map_via(Via *via, uint8_t page)
+{
+    map_io(via->cpu, page, via_read, via_write, via);
+}
+
+/* Detach the VIA from its machine and free it */
+void close_via(Via *via)
+{
+    unmap_device(via->cpu, via);
+    set_irq(via->cpu, VIA_IRQ, 0);
+    cancel_events(via->cpu, via);
+    free(via);
+}
+
+/* Read the registers of the VIA */
+void get_via_state(Via *via, ViaState *state)
+{
+    uint64_t now = via->cpu->total_cycles;
+
+    via_sync(via, now);
+    state->ora      = via->ora;
+    state->orb      = via->orb;
+    state->ddra     = via->ddra;
+    state->ddrb     = via->ddrb;
+    state->acr      = via->acr;
+    state->pcr      = via->pcr;
+    state->ifr      = via->ifr;
+    state->ier      = via->ier;
+    state->sr       = via->sr;
+    state->t2_latch = via->t2_latch;
+    state->t1_latch = via->t1_latch;
+    state->t1_count = t1_value(via, now);
+    state->t2_count = t2_value(via, now);
+    state->sr_left  = via->sr_busy ? via->sr_start + 8 * via->sr_bit - now : 0;
+    state->flags    = (via->t1_armed ? VIA_T1_ARMED : 0) | (via->t1_pb7 ? VIA_T1_PB7 : 0) | (via->t2_armed ? VIA_T2_ARMED : 0) |
+                      (via->sr_busy ? VIA_SR_BUSY : 0);
+}
+
+/* Restore the registers of the VIA */
+void set_via_state(Via *via, const ViaState *state)
+{
+    uint64_t now = via->cpu->total_cycles;
+
+    via->ora      = state->ora;
+    via->orb      = state->orb;
+    via->ddra     = state->ddra;
+    via->ddrb     = state->ddrb;
+    via->acr      = state->acr;
+    via->pcr      = state->pcr;
+    via->ifr      = state->ifr & 0x7F;
+    via->ier      = state->ier & 0x7F;
+    via->sr       = state->sr;
+    via->t2_latch = state->t2_latch;
+    via->t1_latch = state->t1_latch;
+    via->t1_armed = (state->flags & VIA_T1_ARMED) != 0;
+    via->t1_pb7   = (state->flags & VIA_T1_PB7) != 0;
+    via->t2_armed = (state->flags & VIA_T2_ARMED) != 0;
+    via->sr_busy  = (state->flags & VIA_SR_BUSY) != 0;
+    via->t2_count = state->t2_count;
+
+    /* A free-running timer 1 saved in its $FFFF cycle reloads at the next one */
+    if ((via->acr & ACR_T1_FREE) && state->t1_count > via->t1_latch)
+        via->t1_timeout = now + via->t1_latch + 2;
+    else
+        via->t1_timeout = now + state->t1_count + 1;
+    via->t2_timeout = now + state->t2_count + 1;
+    via->sr_bit     = sr_bit_cycles(via);
+    via->sr_busy    = via->sr_busy && via->sr_bit != 0;
+    via->sr_start   = now + state->sr_left - 8 * via->sr_bit;
+    via_update(via);
+}
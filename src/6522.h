@@ -0,0 +1,101 @@
+/*
+ *
+ *      6522.h
+ *      VIA controller header file
+ *
+ *      2024/12/13 By MicroFish
+ *      Based on MIT open source agreement
+ *      Copyright © 2020 ViudiraTech, based on the MIT agreement.
+ *
+ */
+
+#ifndef INCLUDE_6522_H_
+#define INCLUDE_6522_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define VIA_ADDR 0xB000 // Base address of the 16 VIA registers; they sit at the start of every page the VIA is mapped on
+#define VIA_IRQ  0x02   // IRQ source bit of the VIA in CPUMAP.interrupts
+
+/* VIA registers, offsets from VIA_ADDR */
+#define VIA_ORB  0x0 // Port B output, input on read
+#define VIA_ORA  0x1 // Port A output, input on read, with handshake
+#define VIA_DDRB 0x2 // Port B data direction
+#define VIA_DDRA 0x3 // Port A data direction
+#define VIA_T1CL 0x4 // Timer 1 counter low byte, latch low byte on write
+#define VIA_T1CH 0x5 // Timer 1 counter high byte, starts timer 1 on write
+#define VIA_T1LL 0x6 // Timer 1 latch low byte
+#define VIA_T1LH 0x7 // Timer 1 latch high byte
+#define VIA_T2CL 0x8 // Timer 2 counter low byte, latch low byte on write
+#define VIA_T2CH 0x9 // Timer 2 counter high byte, starts timer 2 on write
+#define VIA_SR   0xA // Shift register
+#define VIA_ACR  0xB // Auxiliary control register
+#define VIA_PCR  0xC // Peripheral control register
+#define VIA_IFR  0xD // Interrupt flag register
+#define VIA_IER  0xE // Interrupt enable register
+#define VIA_ORAN 0xF // Port A without handshake
+
+/* Interrupt flag and enable bits */
+#define IFR_CA2 0x01
+#define IFR_CA1 0x02
+#define IFR_SR  0x04
+#define IFR_CB2 0x08
+#define IFR_CB1 0x10
+#define IFR_T2  0x20
+#define IFR_T1  0x40
+#define IFR_IRQ 0x80 // Any enabled flag set, in IFR; set or clear the given enables, in IER
+
+/* Auxiliary control register bits */
+#define ACR_PA_LATCH 0x01 // Latch port A inputs on CA1
+#define ACR_PB_LATCH 0x02 // Latch port B inputs on CB1
+#define ACR_SR_MASK  0x1C // Shift register mode
+#define ACR_T2_PULSE 0x20 // Timer 2 counts pulses on PB6
+#define ACR_T1_FREE  0x40 // Timer 1 runs free, reloading from its latch
+#define ACR_T1_PB7   0x80 // Timer 1 drives PB7
+
+/* VIA state, one per machine */
+typedef struct Via Via;
+
+/* VIA registers saved in a snapshot, with the timers as they read at the snapshot's cycle count */
+typedef struct {
+        uint8_t  ora;
+        uint8_t  orb;
+        uint8_t  ddra;
+        uint8_t  ddrb;
+        uint8_t  acr;
+        uint8_t  pcr;
+        uint8_t  ifr;
+        uint8_t  ier;
+        uint8_t  sr;
+        uint8_t  t2_latch;
+        uint8_t  flags; // Timer and shift register state bits below
+        uint8_t  reserved;
+        uint16_t t1_latch;
+        uint16_t t1_count;
+        uint16_t t2_count;
+        uint16_t sr_left; // Cycles until the shift register has moved its byte
+} ViaState;
+
+/* Timer state bits of ViaState.flags */
+#define VIA_T1_ARMED 0x01 // Timer 1 sets its flag at its next timeout
+#define VIA_T1_PB7   0x02 // Timer 1 output level on PB7
+#define VIA_T2_ARMED 0x04 // Timer 2 sets its flag at its next timeout
+#define VIA_SR_BUSY  0x08 // The shift register is moving a byte
+
+/* Initialize the VIA and map it at VIA_ADDR */
+Via *init_via(CPUMAP *cpu);
+
+/* Map the VIA registers at the start of a page as well */
+void map_via(Via *via, uint8_t page);
+
+/* Detach the VIA from its machine and free it */
+void close_via(Via *via);
+
+/* Read the registers of the VIA */
+void get_via_state(Via *via, ViaState *state);
+
+/* Restore the registers of the VIA */
+void set_via_state(Via *via, const ViaState *state);
+
+#endif // INCLUDE_6522_H_
@@ -9,68 +9,421 @@
  *
  */
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/poll.h>
+#include <time.h>
 #include <unistd.h>
 
 #define INCLUDE
 #include "6502.h"
 #include "6850.h"
 
-static int                 n;
-static union UartStatusReg uart_SR;
-static uint8_t             incoming_char;
-static int                 interactive;
+/* UART state, one per machine */
+struct Uart {
+        CPUMAP             *cpu;
+        union UartStatusReg SR;
+        uint8_t             incoming_char;
+        uint8_t             control; // Last value written to the control register
+        int                 interactive;
+        atomic_int          refs; // Held by the machine and by the reader thread
 
-/* Initialize UART */
-void init_uart(int is_interactive)
+        /* Transmit buffer, written out according to the flush policy */
+        FILE       *tx_out;
+        uint8_t     tx_buf[TX_BUFFER_SIZE];
+        size_t      tx_len;
+        FlushPolicy tx_policy;
+        int         tx_idle;
+        uint64_t    tx_flushed;
+        uint64_t    tx_writes; // Host writes issued by uart_flush
+
+        /* Receive FIFO, filled by the reader thread and drained by the CPU */
+        int             rx_fd;
+        uint8_t        *rx_fifo;
+        size_t          rx_depth;
+        atomic_size_t   rx_head;
+        atomic_size_t   rx_tail;
+        bool            rx_closing;
+        bool            rx_ended; // The reader hit the end of the input
+        bool            rx_wait;  // Input is a file or pipe: an empty FIFO waits for the reader until the input ends
+        atomic_bool     rx_quit;  // The user typed Ctrl-X on the interactive console
+        pthread_mutex_t rx_lock;
+        pthread_cond_t  rx_space;
+        pthread_cond_t  rx_ready; // Signalled when input arrives or ends
+        atomic_ullong   rx_reads; // Host reads issued by the reader thread
+
+        /* Character timing at the baud rate; without it characters move as fast as the program takes them */
+        uint64_t char_cycles; // Cycles one character takes on the line, 0 for no timing
+        bool     rx_full;     // A received character waits in the data register
+        bool     rx_clocked;  // The next character is scheduled to arrive
+
+        /* What the program did with the UART since the last look, to tell when it only waits for input */
+        uint64_t polls; // Status reads finding nothing to receive
+        bool     busy;  // Any other access: a character moved or the control register changed
+};
+
+/* Number of characters waiting in the receive FIFO */
+static inline size_t rx_pending(Uart *uart)
+{
+    return atomic_load_explicit(&uart->rx_head, memory_order_acquire) - atomic_load_explicit(&uart->rx_tail, memory_order_relaxed);
+}
+
+/* Number of characters the program finds waiting. Input from a file or pipe is waited for whenever the FIFO runs dry before its end,
+   so it reaches the program at the same instruction on every run however the reader thread is scheduled */
+static size_t rx_available(Uart *uart)
+{
+    size_t pending = rx_pending(uart);
+
+    if (pending != 0 || !uart->rx_wait) return pending;
+    pthread_mutex_lock(&uart->rx_lock);
+    while (rx_pending(uart) == 0 && !uart->rx_ended) pthread_cond_wait(&uart->rx_ready, &uart->rx_lock);
+    uart->rx_wait = !uart->rx_ended;
+    pthread_mutex_unlock(&uart->rx_lock);
+    return rx_pending(uart);
+}
+
+/* Drop a reference, freeing the UART with the last one */
+static void release_uart(Uart *uart)
 {
-    CPU.memory[DATA_ADDR] = 0;
+    if (atomic_fetch_sub(&uart->refs, 1) != 1) return;
+    close(uart->rx_fd);
+    pthread_mutex_destroy(&uart->rx_lock);
+    pthread_cond_destroy(&uart->rx_space);
+    pthread_cond_destroy(&uart->rx_ready);
+    free(uart->rx_fifo);
+    free(uart);
+}
+
+/* Host input reader thread */
+static void *uart_reader(void *arg)
+{
+    Uart   *uart = arg;
+    uint8_t buf[256];
+    size_t  head, space;
+    ssize_t len, i;
+    bool    closing;
 
-    uart_SR.byte      = 0;
-    uart_SR.bits.TDRE = 1;
+    for (;;) {
+        pthread_mutex_lock(&uart->rx_lock);
+        while (!uart->rx_closing && (space = uart->rx_depth - rx_pending(uart)) == 0) pthread_cond_wait(&uart->rx_space, &uart->rx_lock);
+        closing = uart->rx_closing;
+        pthread_mutex_unlock(&uart->rx_lock);
+        if (closing) break;
+
+        len = read(uart->rx_fd, buf, space < sizeof(buf) ? space : sizeof(buf));
+        atomic_fetch_add_explicit(&uart->rx_reads, 1, memory_order_relaxed);
+        if (len <= 0) break;
+        head = atomic_load_explicit(&uart->rx_head, memory_order_relaxed);
+        for (i = 0; i < len; i++) {
+            if (uart->interactive) {
+                if (buf[i] == 0x18) {
+                    atomic_store(&uart->rx_quit, 1);
+                    break;
+                }
+                if (buf[i] == 0x7F) { buf[i] = '\b'; }
+            }
+            uart->rx_fifo[head++ % uart->rx_depth] = buf[i];
+        }
+        atomic_store_explicit(&uart->rx_head, head, memory_order_release);
+        pthread_mutex_lock(&uart->rx_lock);
+        pthread_cond_signal(&uart->rx_ready);
+        pthread_mutex_unlock(&uart->rx_lock);
+        if (i < len) break;
+    }
+    pthread_mutex_lock(&uart->rx_lock);
+    uart->rx_ended = 1;
+    pthread_cond_signal(&uart->rx_ready);
+    pthread_mutex_unlock(&uart->rx_lock);
+    release_uart(uart);
+    return NULL;
+}
 
-    uart_SR.bits.RDRF = 0;
-    incoming_char     = 0;
+/* Move the next character of the receive FIFO into the data register */
+static void uart_receive(Uart *uart)
+{
+    size_t tail = atomic_load_explicit(&uart->rx_tail, memory_order_relaxed);
+    int    full;
 
-    interactive = is_interactive;
+    if (rx_available(uart) == 0) return;
+    full                = rx_pending(uart) == uart->rx_depth;
+    uart->incoming_char = uart->rx_fifo[tail % uart->rx_depth];
+    atomic_store_explicit(&uart->rx_tail, tail + 1, memory_order_release);
+    if (full) {
+        pthread_mutex_lock(&uart->rx_lock);
+        pthread_cond_signal(&uart->rx_space);
+        pthread_mutex_unlock(&uart->rx_lock);
+    }
 }
 
-/* Ready to read data */
-int stdin_ready(void)
+/* Write out the transmit buffer */
+void uart_flush(Uart *uart)
 {
-    struct pollfd fds;
-    fds.fd     = 0;
-    fds.events = POLLIN;
-    return poll(&fds, 1, 0) == 1;
+    if (uart->tx_len == 0) return;
+    fwrite(uart->tx_buf, 1, uart->tx_len, uart->tx_out);
+    fflush(uart->tx_out);
+    uart->tx_len     = 0;
+    uart->tx_flushed = host_time();
+    uart->tx_writes++;
 }
 
-/* Simulate UART read and write operations */
-void step_uart(void)
+/* Queue a character for output */
+static void uart_transmit(Uart *uart, uint8_t val)
 {
-    if (write_addr == &CPU.memory[DATA_ADDR]) {
-        putchar(CPU.memory[DATA_ADDR]);
-        if (CPU.memory[DATA_ADDR] == '\b') printf(" \b");
-        fflush(stdout);
-        write_addr = NULL;
-    } else if (read_addr == &CPU.memory[DATA_ADDR]) {
-        uart_SR.bits.RDRF = 0;
-        read_addr         = NULL;
+    uart->tx_buf[uart->tx_len++] = val;
+    if (val == '\b') {
+        uart->tx_buf[uart->tx_len++] = ' ';
+        uart->tx_buf[uart->tx_len++] = '\b';
     }
-    if ((n++ % 100) == 0) {
-        if (!uart_SR.bits.RDRF && stdin_ready()) {
-            if (read(0, &incoming_char, 1) != 1) printf("Warning: read() returns 0\n");
-            if (interactive) {
-                if (incoming_char == 0x18) {
-                    printf("\r\n");
-                    exit(0);
-                }
-                if (incoming_char == 0x7F) { incoming_char = '\b'; }
+    uart->tx_idle = 0;
+    if (uart->tx_policy == FLUSH_CHAR || uart->tx_len > TX_BUFFER_SIZE - 3 || (uart->tx_policy == FLUSH_LINE && val == '\n')) uart_flush(uart);
+}
+
+/* Drive the IRQ line from the interrupt enables of the control register and the status */
+static void uart_irq(Uart *uart)
+{
+    bool rx = (uart->control & CR_RX_IRQ) && (uart->char_cycles ? uart->rx_full : rx_available(uart) != 0);
+    bool tx = (uart->control & CR_TX_MASK) == CR_TX_IRQ && uart->SR.bits.TDRE;
+
+    uart->SR.bits.IRQ = rx || tx;
+    set_irq(uart->cpu, UART_IRQ, uart->SR.bits.IRQ);
+}
+
+/* A character has arrived on the line: move it into the data register and schedule the next one while input is waiting */
+static void uart_rx_event(void *device, uint64_t when)
+{
+    Uart *uart = device;
+
+    /* The sender holds back while the data register is full, so nothing is overrun */
+    if (!uart->rx_full && rx_available(uart) != 0) {
+        uart_receive(uart);
+        uart->rx_full = 1;
+        uart_irq(uart);
+    }
+    uart->rx_clocked = rx_available(uart) != 0;
+    if (uart->rx_clocked) schedule_event(uart->cpu, when + uart->char_cycles, uart_rx_event, uart);
+}
+
+/* Start clocking in input that arrived while the line was quiet */
+static void uart_clock_rx(Uart *uart)
+{
+    if (uart->rx_clocked || rx_available(uart) == 0) return;
+    uart->rx_clocked = 1;
+    schedule_event(uart->cpu, uart->cpu->total_cycles + uart->char_cycles, uart_rx_event, uart);
+}
+
+/* The transmitted character has left the shift register */
+static void uart_tx_event(void *device, uint64_t when)
+{
+    Uart *uart = device;
+
+    uart->SR.bits.TDRE = 1;
+    uart_irq(uart);
+}
+
+/* Read a UART register */
+static uint8_t uart_read(void *device, uint16_t addr)
+{
+    Uart *uart = device;
+
+    switch (addr & 0xFF) {
+        case DATA_REG :
+            if (uart->char_cycles)
+                uart->rx_full = 0;
+            else
+                uart_receive(uart);
+            uart_irq(uart);
+            uart->busy = 1;
+            uart->cpu->io_accesses++;
+            return uart->incoming_char;
+        case CTRL_REG :
+            if (uart->char_cycles) uart_clock_rx(uart);
+            uart->SR.bits.RDRF = uart->char_cycles ? uart->rx_full : rx_available(uart) != 0;
+            /* Two status reads in a row with nothing to receive: the program is waiting for input */
+            if (!uart->SR.bits.RDRF) {
+                if (uart->tx_idle) uart_flush(uart);
+                uart->tx_idle = 1;
+                uart->polls++;
+            } else {
+                uart->busy = 1;
+                uart->cpu->io_accesses++;
             }
-            uart_SR.bits.RDRF = 1;
+            uart_irq(uart);
+            return uart->SR.byte;
+        default :
+            return uart->cpu->memory[addr];
+    }
+}
+
+/* Write a UART register */
+static void uart_write(void *device, uint16_t addr, uint8_t val)
+{
+    Uart *uart = device;
+
+    if ((addr & 0xFF) == DATA_REG || (addr & 0xFF) == CTRL_REG) uart->cpu->io_accesses++;
+    if ((addr & 0xFF) == DATA_REG) {
+        uart_transmit(uart, val);
+        uart->busy = 1;
+        if (uart->char_cycles) {
+            uart->SR.bits.TDRE = 0;
+            uart_irq(uart);
+            schedule_event(uart->cpu, uart->cpu->total_cycles + uart->char_cycles, uart_tx_event, uart);
         }
     }
-    CPU.memory[DATA_ADDR] = incoming_char;
-    CPU.memory[CTRL_ADDR] = uart_SR.byte;
+    if ((addr & 0xFF) == CTRL_REG) {
+        if (val != uart->control) uart->busy = 1;
+        uart->control = val;
+        uart_irq(uart);
+    }
+    uart->cpu->memory[addr] = val;
+}
+
+/* Initialize UART */
+Uart *init_uart(CPUMAP *cpu, int in_fd, FILE *out, int is_interactive, size_t fifo_depth, FlushPolicy policy)
+{
+    pthread_t          reader;
+    pthread_condattr_t attr;
+    Uart              *uart = calloc(1, sizeof(Uart));
+
+    if (uart == NULL || (uart->rx_fifo = malloc(fifo_depth)) == NULL) {
+        fprintf(stderr, "Error: Unable to allocate the UART.\n");
+        close(in_fd);
+        free(uart);
+        return NULL;
+    }
+    uart->cpu          = cpu;
+    uart->SR.byte      = 0;
+    uart->SR.bits.TDRE = 1;
+
+    uart->SR.bits.RDRF  = 0;
+    uart->incoming_char = 0;
+
+    uart->interactive = is_interactive;
+    uart->tx_out      = out;
+    uart->tx_policy   = policy;
+    uart->tx_flushed  = host_time();
+
+    uart->rx_fd    = in_fd;
+    uart->rx_depth = fifo_depth;
+    uart->rx_wait  = !isatty(in_fd);
+    atomic_init(&uart->refs, 2);
+    atomic_init(&uart->rx_quit, 0);
+    pthread_mutex_init(&uart->rx_lock, NULL);
+    pthread_cond_init(&uart->rx_space, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&uart->rx_ready, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&reader, NULL, uart_reader, uart) != 0) {
+        fprintf(stderr, "Error: Unable to start the UART reader.\n");
+        atomic_store(&uart->refs, 1);
+        release_uart(uart);
+        return NULL;
+    }
+    pthread_detach(reader);
+    map_uart(uart, CTRL_ADDR >> 8);
+    return uart;
+}
+
+/* Map the UART registers at the start of a page as well */
+void map_uart(Uart *uart, uint8_t page)
+{
+    map_io(uart->cpu, page, uart_read, uart_write, uart);
+}
+
+/* Flush the output, detach the UART from its machine and stop its reader */
+void close_uart(Uart *uart)
+{
+    uart_flush(uart);
+    unmap_device(uart->cpu, uart);
+    set_irq(uart->cpu, UART_IRQ, 0);
+    cancel_events(uart->cpu, uart);
+    pthread_mutex_lock(&uart->rx_lock);
+    uart->rx_closing = 1;
+    pthread_cond_signal(&uart->rx_space);
+    pthread_mutex_unlock(&uart->rx_lock);
+    release_uart(uart);
+}
+
+/* Service the UART once per time slice, raising the receive interrupt for input that arrived since, or starting to clock it in */
+void step_uart(Uart *uart)
+{
+    if (uart->tx_len > 0 && host_time() - uart->tx_flushed >= FLUSH_INTERVAL) uart_flush(uart);
+    if (!(uart->control & CR_RX_IRQ)) return;
+    /* A polled receiver starts clocking at the program's next status read */
+    if (uart->char_cycles)
+        uart_clock_rx(uart);
+    else
+        uart_irq(uart);
+}
+
+/* Whether the program did nothing with the UART since the last call but poll an empty receiver or wait for its interrupt */
+bool uart_waiting(Uart *uart)
+{
+    bool waiting = !uart->busy && (uart->polls > 0 || (uart->control & CR_RX_IRQ));
+
+    uart->polls = 0;
+    uart->busy  = 0;
+    return waiting && rx_available(uart) == 0 && !uart->rx_full && uart->SR.bits.TDRE;
+}
+
+/* Whether the user asked to leave the emulator by typing Ctrl-X on the interactive console */
+bool uart_quit(Uart *uart)
+{
+    return atomic_load(&uart->rx_quit);
+}
+
+/* Block until input arrives or ends, or for at most timeout nanoseconds */
+void uart_wait_input(Uart *uart, uint64_t timeout)
+{
+    uint64_t        until = host_time() + timeout;
+    struct timespec deadline;
+
+    deadline.tv_sec  = until / (uint64_t)ONE_SECOND;
+    deadline.tv_nsec = until % (uint64_t)ONE_SECOND;
+    pthread_mutex_lock(&uart->rx_lock);
+    while (rx_pending(uart) == 0 && !uart->rx_ended && pthread_cond_timedwait(&uart->rx_ready, &uart->rx_lock, &deadline) != ETIMEDOUT) continue;
+    pthread_mutex_unlock(&uart->rx_lock);
+}
+
+/* Read the registers of the UART */
+void get_uart_state(Uart *uart, UartState *state)
+{
+    state->status        = uart->SR.byte;
+    state->incoming_char = uart->incoming_char;
+    state->control       = uart->control;
+}
+
+/* Restore the registers of the UART */
+void set_uart_state(Uart *uart, const UartState *state)
+{
+    uart->SR.byte       = state->status;
+    uart->incoming_char = state->incoming_char;
+    uart->control       = state->control;
+    uart->rx_full       = uart->char_cycles && uart->SR.bits.RDRF;
+    if (!uart->char_cycles)
+        uart->SR.bits.TDRE = 1;
+    else if (!uart->SR.bits.TDRE)
+        schedule_event(uart->cpu, uart->cpu->total_cycles + uart->char_cycles, uart_tx_event, uart);
+    uart_irq(uart);
+}
+
+/* Time characters at the baud rate, char_cycles apart, or move them at once if it is 0 */
+void set_uart_timing(Uart *uart, uint64_t char_cycles)
+{
+    uart->char_cycles = char_cycles;
+}
+
+/* Cycles one character takes, 0 without timing */
+uint64_t get_uart_timing(Uart *uart)
+{
+    return uart->char_cycles;
+}
+
+/* Read the host I/O counters of the UART */
+void get_uart_counters(Uart *uart, UartCounters *counters)
+{
+    counters->reads  = atomic_load_explicit(&uart->rx_reads, memory_order_relaxed);
+    counters->writes = uart->tx_writes;
 }
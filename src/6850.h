@@ -13,9 +13,30 @@
 #define INCLUDE_6850_H_
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
 
-#define CTRL_ADDR 0xA000 // Control address
-#define DATA_ADDR 0xA001 // Data address
+#define CTRL_ADDR 0xA000             // Control address
+#define DATA_ADDR 0xA001             // Data address
+#define CTRL_REG  (CTRL_ADDR & 0xFF) // Control register offset in every page the UART is mapped on
+#define DATA_REG  (DATA_ADDR & 0xFF) // Data register offset in every page the UART is mapped on
+#define FIFO_SIZE 256                // Default receive FIFO depth
+
+#define CR_TX_MASK 0x60 // Transmit control bits of the control register
+#define CR_TX_IRQ  0x20 // Transmit control value enabling the transmit interrupt
+#define CR_RX_IRQ  0x80 // Receive interrupt enable bit of the control register
+#define UART_IRQ   0x01 // IRQ source bit of the UART in CPUMAP.interrupts
+#define CHAR_BITS  10   // Bits on the line per character: start, 8 data, stop
+
+#define TX_BUFFER_SIZE 4096 // Transmit buffer size
+#define FLUSH_INTERVAL 50e6 // Longest time output stays buffered (ns)
+
+/* Transmit flush policies */
+typedef enum {
+    FLUSH_CHAR,  // Write every character immediately
+    FLUSH_LINE,  // Flush on newline, full buffer, timer or idle
+    FLUSH_BLOCK, // Flush on full buffer, timer or idle
+} FlushPolicy;
 
 /* UART Status Bits */
 struct UartStatusBits {
@@ -35,10 +56,59 @@ union UartStatusReg {
         uint8_t               byte;
 };
 
-/* Initialize UART */
-void init_uart(int is_interactive);
+/* UART state, one per machine */
+typedef struct Uart Uart;
+
+/* UART registers saved in a snapshot */
+typedef struct {
+        uint8_t status;
+        uint8_t incoming_char;
+        uint8_t control;
+} UartState;
+
+/* Host I/O calls issued by a UART */
+typedef struct {
+        uint64_t reads;
+        uint64_t writes;
+} UartCounters;
+
+/* Initialize UART, reading input from in_fd (which it takes over) and writing output to out */
+Uart *init_uart(CPUMAP *cpu, int in_fd, FILE *out, int is_interactive, size_t fifo_depth, FlushPolicy policy);
+
+/* Map the UART registers at the start of a page as well */
+void map_uart(Uart *uart, uint8_t page);
+
+/* Flush the output, detach the UART from its machine and stop its reader */
+void close_uart(Uart *uart);
+
+/* Write out the transmit buffer */
+void uart_flush(Uart *uart);
+
+/* Service the UART once per time slice, starting to clock in input that arrived since */
+void step_uart(Uart *uart);
+
+/* Whether the program did nothing with the UART since the last call but poll an empty receiver or wait for its interrupt */
+bool uart_waiting(Uart *uart);
+
+/* Whether the user asked to leave the emulator by typing Ctrl-X on the interactive console */
+bool uart_quit(Uart *uart);
+
+/* Block until input arrives or ends, or for at most timeout nanoseconds */
+void uart_wait_input(Uart *uart, uint64_t timeout);
+
+/* Read the registers of the UART */
+void get_uart_state(Uart *uart, UartState *state);
+
+/* Restore the registers of the UART */
+void set_uart_state(Uart *uart, const UartState *state);
+
+/* Time characters at the baud rate, char_cycles apart, or move them at once if it is 0 */
+void set_uart_timing(Uart *uart, uint64_t char_cycles);
+
+/* Cycles one character takes, 0 without timing */
+uint64_t get_uart_timing(Uart *uart);
 
-/* Simulate UART read and write operations */
-void step_uart(void);
+/* Read the host I/O counters of the UART */
+void get_uart_counters(Uart *uart, UartCounters *counters);
 
 #endif // INCLUDE_6850_H_
@@ -9,6 +9,8 @@
  *
  */
 
+#include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <termios.h>
@@ -17,42 +19,231 @@
 
 #define INCLUDE
 #include "6502.h"
+#include "6522.h"
 #include "6850.h"
+#include "batch.h"
+#include "jit.h"
+#include "memmap.h"
+#include "profile.h"
+#include "snapshot.h"
+#include "validate.h"
 
 struct termios initial_termios;
 
-/* Controlling the delay of the simulation */
-void step_delay(void)
+/* The machine run from the command line, its console UART and its VIA */
+static CPUMAP *machine;
+static Uart   *console;
+static Via    *board_via;
+
+/* Profile reports written when the program exits */
+static char *profile_report;
+static char *profile_folded;
+
+/* Wall clock and cycle count the pacing is measured from */
+static uint64_t pace_start;
+static uint64_t pace_cycles;
+static double   pace_freq;
+
+/* Host-side counters of the run */
+typedef struct {
+        uint64_t time;         // Host time of the sample
+        uint64_t cycles;       // Emulated cycles
+        uint64_t instructions; // Emulated instructions
+        uint64_t uart_time;    // Host time spent in step_uart
+        uint64_t sleep_time;   // Host time spent sleeping in step_delay or waiting for input
+        uint64_t sleeps;       // clock_nanosleep calls and waits for input
+        uint64_t reads;        // UART reads of the host input
+        uint64_t writes;       // UART writes of the host output
+} HostStats;
+
+/* Running counters, and the samples the reports are measured from */
+static HostStats host_stats;
+static HostStats run_begin;
+static HostStats last_report;
+static uint64_t  stats_interval; // Host time between periodic reports, 0 for none
+static char     *stats_file;     // File rewritten at every report instead of printing to stderr
+
+/* Sleep until the wall clock reaches the time of the emulated cycle count */
+void step_delay(CPUMAP *cpu)
+{
+    uint64_t        target = pace_start + (uint64_t)((cpu->total_cycles - pace_cycles) * ONE_SECOND / pace_freq);
+    uint64_t        now    = host_time();
+    struct timespec deadline;
+
+    if (now > target + CATCHUP_WINDOW) {
+        /* Stalled for too long; give up the lag beyond the window instead of racing to recover it */
+        pace_start += now - target - CATCHUP_WINDOW;
+        return;
+    }
+    if (now >= target) return;
+    deadline.tv_sec  = target / (uint64_t)ONE_SECOND;
+    deadline.tv_nsec = target % (uint64_t)ONE_SECOND;
+    do host_stats.sleeps++;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+    host_stats.sleep_time += host_time() - now;
+}
+
+/* Sample the counters of the command line machine */
+void sample_stats(HostStats *sample)
 {
-    struct timespec req, rem;
+    UartCounters io;
 
-    req.tv_sec  = 0;
-    req.tv_nsec = STEP_DURATION;
+    get_uart_counters(console, &io);
+    *sample              = host_stats;
+    sample->time         = host_time();
+    sample->cycles       = machine->total_cycles;
+    sample->instructions = machine->total_instructions;
+    sample->reads        = io.reads;
+    sample->writes       = io.writes;
+}
 
-    nanosleep(&req, &rem);
+/* Print the rates between two samples on one line */
+void print_stats(FILE *fp, const HostStats *from, const HostStats *to)
+{
+    double elapsed = (to->time - from->time) / ONE_SECOND;
+    double mhz;
+
+    if (elapsed <= 0) return;
+    mhz = (to->cycles - from->cycles) / elapsed / 1e6;
+    fprintf(fp, "%" PRIu64 " cycles in %.3f s (%.3f MHz, %.0f%% of %.3f MHz), %.3f MIPS, uart %.1f%%, sleeping %.1f%%, %" PRIu64 " syscalls\n",
+            to->cycles - from->cycles, elapsed, mhz, mhz * 1e8 / pace_freq, pace_freq / 1e6, (to->instructions - from->instructions) / elapsed / 1e6,
+            (to->uart_time - from->uart_time) / (elapsed * ONE_SECOND) * 100, (to->sleep_time - from->sleep_time) / (elapsed * ONE_SECOND) * 100,
+            (to->sleeps - from->sleeps) + (to->reads - from->reads) + (to->writes - from->writes));
+}
+
+/* Rewrite the stats file with the totals of the run and the rates since the previous report */
+void write_stats(const HostStats *from, const HostStats *to)
+{
+    char  temp[4096];
+    FILE *fp;
+
+    snprintf(temp, sizeof(temp), "%s.tmp", stats_file);
+    if ((fp = fopen(temp, "w")) == NULL) return;
+    fprintf(fp, "elapsed %.3f\ncycles %" PRIu64 "\ninstructions %" PRIu64 "\ntarget_mhz %.3f\n", (to->time - run_begin.time) / ONE_SECOND,
+            to->cycles - run_begin.cycles, to->instructions - run_begin.instructions, pace_freq / 1e6);
+    fprintf(fp, "uart_seconds %.6f\nsleep_seconds %.6f\nsleeps %" PRIu64 "\nuart_reads %" PRIu64 "\nuart_writes %" PRIu64 "\n",
+            (to->uart_time - run_begin.uart_time) / ONE_SECOND, (to->sleep_time - run_begin.sleep_time) / ONE_SECOND, to->sleeps - run_begin.sleeps,
+            to->reads - run_begin.reads, to->writes - run_begin.writes);
+    if (to->time > from->time)
+        fprintf(fp, "mhz %.3f\nmips %.3f\n", (to->cycles - from->cycles) * 1e3 / (to->time - from->time),
+                (to->instructions - from->instructions) * 1e3 / (to->time - from->time));
+    fclose(fp);
+    rename(temp, stats_file);
+}
+
+/* Periodic report of the host counters since the previous one */
+void report_stats(void)
+{
+    HostStats now;
+
+    sample_stats(&now);
+    if (stats_file)
+        write_stats(&last_report, &now);
+    else
+        print_stats(stderr, &last_report, &now);
+    last_report = now;
+}
+
+/* Report the processor speed and host counters of the whole run */
+void report_speed(void)
+{
+    HostStats now;
+
+    sample_stats(&now);
+    print_stats(stderr, &run_begin, &now);
+    if (stats_file) write_stats(&run_begin, &now);
+}
+
+/* Flush the console, close the trace and write the profile when the program exits */
+void finish_machine(void)
+{
+    uart_flush(console);
+    close_trace(machine);
+    if (machine->profile == NULL) return;
+    if (profile_report) write_profile(machine->profile, profile_report);
+    if (profile_folded) write_folded(machine->profile, profile_folded);
 }
 
 /* Running CPU simulation */
-void run_cpu(uint64_t cycle_stop, int verbose, int mem_dump, int break_pc, int fast)
+void run_cpu(CPUMAP *cpu, Uart *uart, uint64_t cycle_stop, int verbose, int mem_dump, int break_pc, int fast, int threaded, double freq, double slice)
 {
-    uint64_t cycles          = 0;
-    uint64_t cycles_per_step = (CPU_FREQ / (ONE_SECOND / STEP_DURATION));
+    uint64_t   cycles          = 0;
+    uint64_t   cycles_per_step = freq * slice / ONE_SECOND;
+    uint64_t   budget, start, now, next_report;
+    uint64_t   index = 0;
+    StopReason reason;
+    FILE      *delta = NULL;
+    bool       idle = 0, looping = 0;
+
+    if (mem_dump && (delta = fopen("memdump.delta", "w")) == NULL) {
+        fprintf(stderr, "Error: Unable to create memdump.delta.\n");
+        return;
+    }
+    if (delta) start_memory_delta(delta);
+    if (cycles_per_step == 0) cycles_per_step = 1;
+    sample_stats(&run_begin);
+    last_report = run_begin;
+    next_report = run_begin.time + stats_interval;
+    pace_freq   = freq;
+    pace_start  = run_begin.time;
+    pace_cycles = cpu->total_cycles;
+    atexit(report_speed);
     for (;;) {
         for (cycles %= cycles_per_step; cycles < cycles_per_step;) {
-            if (mem_dump) save_memory(NULL);
-            cycles += step_cpu(verbose);
-            if ((cycle_stop > 0) && (CPU.total_cycles >= cycle_stop)) goto end;
-            step_uart();
-            if (break_pc >= 0 && CPU.PC == (uint16_t)break_pc) {
-                fprintf(stderr, "break at %04x\n", break_pc);
-                save_memory(NULL);
-                goto end;
+            if (verbose || mem_dump) {
+                /* Tracing and per-instruction dumps still go one instruction at a time */
+                if (mem_dump) save_memory_delta(cpu, delta, index++);
+                cycles += step_cpu(cpu, verbose);
+                run_events(cpu);
+                reason = (break_pc >= 0 && cpu->PC == (uint16_t)break_pc) ? STOP_BREAK : STOP_BUDGET;
+                if (cpu->reference && reference_done(cpu->reference)) reason = STOP_REFERENCE;
+            } else {
+                budget = cycles_per_step - cycles;
+                if ((cycle_stop > 0) && (cycle_stop - cpu->total_cycles < budget)) budget = cycle_stop - cpu->total_cycles;
+                start = cpu->total_cycles;
+                if (idle) {
+                    /* The program only spins waiting for input; skip ahead over its loop */
+                    reason  = run_idle(cpu, budget, break_pc);
+                    looping = reason == STOP_IDLE;
+                    idle    = 0;
+                } else {
+                    reason = run_cycles(cpu, budget, break_pc, threaded);
+                }
+                cycles += cpu->total_cycles - start;
             }
+            if ((cycle_stop > 0) && (cpu->total_cycles >= cycle_stop)) goto end;
+            if (reason == STOP_BREAK) goto brk;
+            if (reason == STOP_REFERENCE) goto end;
+        }
+        now = host_time();
+        step_uart(uart);
+        if (uart_quit(uart)) {
+            uart_flush(uart);
+            printf("\r\n");
+            goto end;
+        }
+        idle = uart_waiting(uart);
+        host_stats.uart_time += host_time() - now;
+        if (!fast) {
+            step_delay(cpu);
+        } else if (idle && looping) {
+            /* Still spinning in the same loop: nothing to do at full speed but wait for the input, up to one slice */
+            now = host_time();
+            uart_wait_input(uart, slice);
+            host_stats.sleeps++;
+            host_stats.sleep_time += host_time() - now;
+        }
+        looping = 0;
+        if (stats_interval && now >= next_report) {
+            report_stats();
+            next_report = now + stats_interval;
         }
-        if (!fast) step_delay();
     }
+brk:
+    fprintf(stderr, "break at %04x\n", break_pc);
+    save_memory(cpu, NULL);
 end:
-    return;
+    if (delta) fclose(delta);
 }
 
 /* Restore the terminal to its original configuration */
@@ -83,6 +274,23 @@ int hex2int(char *str)
     return val;
 }
 
+/* Convert an output flush policy name */
+int parse_policy(char *str)
+{
+    if (strcmp(str, "char") == 0) return FLUSH_CHAR;
+    if (strcmp(str, "line") == 0) return FLUSH_LINE;
+    if (strcmp(str, "block") == 0) return FLUSH_BLOCK;
+    return -1;
+}
+
+/* Convert a decimal mode model name */
+int parse_decimal(char *str)
+{
+    if (strcmp(str, "nmos") == 0) return DECIMAL_NMOS;
+    if (strcmp(str, "cmos") == 0) return DECIMAL_CMOS;
+    return -1;
+}
+
 /* Program Instructions */
 void usage(char *argv[])
 {
@@ -96,41 +304,90 @@ void usage(char *argv[])
             "	-y HEX set Y register (default is 0)\n"
             "	-s HEX Set stack pointer (default is $ff)\n"
             "	-p HEX Set processor status register (default is 0)\n"
+            "	-D MODEL Set the decimal mode behaviour of ADC and SBC: nmos or cmos (default: nmos)\n"
             "	-r ADDR Set the default run address (default: load on RST_VEC)\n"
             "\n  Simulator Control Parameters\n"
             "	-v Print CPU information for each operation\n"
             "	-i connect stdin/stdout to the emulator\n"
+            "	-m Append the memory pages changed by each instruction to memdump.delta\n"
+            "	-T FILE Write a binary trace of every instruction to FILE\n"
+            "	-R Print the binary trace FILE in the -v format, and exit\n"
+            "	-V FILE Check every instruction against the reference trace FILE (-T binary or -v text), at full speed,\n"
+            "	        and stop at the end of the reference or at the first divergence\n"
+            "	-P FILE Profile cycles per address, opcode and subroutine, and write the sorted report to FILE on exit\n"
+            "	-G FILE Profile cycles per call chain, and write folded stacks for flame graphs to FILE on exit\n"
+            "	-B Run every job of the manifest FILE on a thread pool, print their results, and exit\n"
+            "	-j NUM Set the number of batch worker threads (default: one per CPU)\n"
+            "	-W FILE Write a snapshot of the machine to FILE when the run stops\n"
+            "	-X FILE When the run stops, fork one child per line of FILE from that state, print their results, and exit\n"
+            "	-M NUM Rebuild memdump from the delta FILE as it was before instruction NUM, and exit\n"
             "	-b ADDR Stop when the PC reaches this address, dump memory, and then exit\n"
             "	-c NUM Stop after NUM periods (default: never)\n"
             "	-f Run at maximum speed possible; no delay loop\n"
+            "	-F HZ Set the target processor frequency (default: 4e6)\n"
+            "	-S MS Set the length of each pacing slice in milliseconds (default: 10)\n"
+            "	-I SEC Report emulated speed, UART and sleep time and syscalls every SEC seconds\n"
+            "	-O FILE Rewrite FILE with the host counters at every report instead of printing them (default interval: 1 s)\n"
+            "	-d NUM Set the UART receive FIFO depth (default: 256)\n"
+            "	-o MODE Set the UART output flush policy: char, line or block (default: line)\n"
+            "	-U BAUD Time UART characters at this baud rate of the -F clock (default: 0, untimed)\n"
+            "	-t Use the threaded interpreter core\n"
+            "	-J Translate hot blocks of the table core to native x86-64 code\n"
             "\n  Memory initialization\n"
             "	-l ADDR is the ROM file loading address (default is $c000)\n"
-            "	FILE Load binary file\n",
+            "	-L MAP Lay out RAM, ROM, mirrors and the UART and VIA pages from the machine description file MAP,\n"
+            "	       or from MAP itself, as in ram=0000-7FFF,rom=C000-FFFF,uart=A000,via=B000\n"
+            "	FILE Load binary file, or resume a snapshot written by -W\n",
             argv[0]);
 }
 
 /* Program entry */
 int main(int argc, char *argv[])
 {
-    int      a, x, y, sp, sr, pc, load_addr;
-    int      verbose, interactive, mem_dump, break_pc, fast;
-    uint64_t cycles;
-    int      opt;
-
-    verbose     = 0;
-    interactive = 0;
-    mem_dump    = 0;
-    cycles      = 0;
-    load_addr   = 0xC000;
-    break_pc    = -1;
-    fast        = 0;
-    a           = 0;
-    x           = 0;
-    y           = 0;
-    sp          = 0xFF;
-    sr          = 0;
-    pc          = -RST_VEC;
-    while ((opt = getopt(argc, argv, "hvimfa:b:x:y:r:p:s:g:c:l:")) != -1) {
+    int             a, x, y, sp, sr, pc, load_addr, loaded_size;
+    int             verbose, interactive, mem_dump, break_pc, fast, threaded, jit, render, batch, workers;
+    char           *trace, *snapshot, *fanout, *reference, *map_spec;
+    const Snapshot *snap;
+    MemoryMap      *memory_map;
+    uint64_t        cycles;
+    uint64_t        rebuild;
+    size_t          fifo_depth;
+    double          freq, slice, baud, interval;
+    int             flush_policy, decimal, valid;
+    int             opt;
+
+    verbose      = 0;
+    interactive  = 0;
+    mem_dump     = 0;
+    cycles       = 0;
+    rebuild      = UINT64_MAX;
+    trace        = NULL;
+    reference    = NULL;
+    snapshot     = NULL;
+    fanout       = NULL;
+    map_spec     = NULL;
+    memory_map   = NULL;
+    render       = 0;
+    batch        = 0;
+    workers      = sysconf(_SC_NPROCESSORS_ONLN);
+    load_addr    = 0xC000;
+    break_pc     = -1;
+    fast         = 0;
+    threaded     = 0;
+    jit          = 0;
+    fifo_depth   = FIFO_SIZE;
+    freq         = CPU_FREQ;
+    slice        = STEP_DURATION;
+    baud         = 0;
+    flush_policy = FLUSH_LINE;
+    decimal      = DECIMAL_NMOS;
+    a            = 0;
+    x            = 0;
+    y            = 0;
+    sp           = 0xFF;
+    sr           = 0;
+    pc           = -RST_VEC;
+    while ((opt = getopt(argc, argv, "hvimftJa:b:x:y:r:p:s:g:c:l:L:d:o:U:D:M:T:RV:P:G:F:S:I:O:Bj:W:X:")) != -1) {
         switch (opt) {
             case 'v' :
                 verbose = 1;
@@ -144,6 +401,12 @@ int main(int argc, char *argv[])
             case 'f' :
                 fast = 1;
                 break;
+            case 't' :
+                threaded = 1;
+                break;
+            case 'J' :
+                jit = 1;
+                break;
             case 'b' :
                 break_pc = hex2int(optarg);
                 break;
@@ -172,6 +435,86 @@ int main(int argc, char *argv[])
             case 'l' :
                 load_addr = hex2int(optarg);
                 break;
+            case 'L' :
+                map_spec = optarg;
+                break;
+            case 'd' :
+                fifo_depth = atol(optarg);
+                if (fifo_depth == 0) fifo_depth = 1;
+                break;
+            case 'U' :
+                if ((baud = strtod(optarg, NULL)) < 0) {
+                    usage(argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'F' :
+                if ((freq = strtod(optarg, NULL)) <= 0) {
+                    usage(argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S' :
+                if ((slice = strtod(optarg, NULL) * 1e6) <= 0) {
+                    usage(argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'I' :
+                /* Range checked as a double, since converting a negative or too large one to the unsigned count is undefined */
+                interval = strtod(optarg, NULL) * ONE_SECOND;
+                if (!(interval >= 1 && interval < UINT64_MAX)) {
+                    usage(argv);
+                    exit(EXIT_FAILURE);
+                }
+                stats_interval = interval;
+                break;
+            case 'O' :
+                stats_file = optarg;
+                break;
+            case 'T' :
+                trace = optarg;
+                break;
+            case 'R' :
+                render = 1;
+                break;
+            case 'V' :
+                reference = optarg;
+                fast      = 1;
+                break;
+            case 'P' :
+                profile_report = optarg;
+                break;
+            case 'G' :
+                profile_folded = optarg;
+                break;
+            case 'B' :
+                batch = 1;
+                break;
+            case 'j' :
+                workers = atoi(optarg);
+                break;
+            case 'X' :
+                fanout = optarg;
+                break;
+            case 'W' :
+                snapshot = optarg;
+                break;
+            case 'M' :
+                rebuild = strtoull(optarg, NULL, 10);
+                break;
+            case 'o' :
+                if ((flush_policy = parse_policy(optarg)) < 0) {
+                    usage(argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'D' :
+                if ((decimal = parse_decimal(optarg)) < 0) {
+                    usage(argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case 'h' :
             default :
                 usage(argv);
@@ -182,16 +525,61 @@ int main(int argc, char *argv[])
         usage(argv);
         exit(EXIT_FAILURE);
     }
-    if (load_rom(argv[optind], load_addr) != 0) {
+    if (stats_file && stats_interval == 0) stats_interval = ONE_SECOND;
+    if (render) return decode_trace(argv[optind]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (batch) return run_batch(argv[optind], workers, threaded, fifo_depth) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    if ((machine = create_cpu()) == NULL) {
+        fprintf(stderr, "Error: Unable to allocate the machine.\n");
+        return EXIT_FAILURE;
+    }
+    machine->decimal = decimal;
+    if (map_spec && (memory_map = load_memory_map(map_spec)) == NULL) return EXIT_FAILURE;
+    if (rebuild != UINT64_MAX) {
+        if (load_memory_delta(machine, argv[optind], rebuild) != 0) return EXIT_FAILURE;
+        save_memory(machine, NULL);
+        return EXIT_SUCCESS;
+    }
+    if (map_snapshot(argv[optind], &snap) < 0) return EXIT_FAILURE;
+    if (snap) {
+        fprintf(stderr, "Resuming snapshot at %" PRIu64 " cycles\n", snap->total_cycles);
+    } else if ((loaded_size = load_rom(machine, argv[optind], load_addr)) < 0) {
         printf("Error loading \"%s\".\n", argv[optind]);
         return EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "Loading $%04x bytes: $%04x - $%04x\n", loaded_size, load_addr, load_addr + loaded_size - 1);
     }
     if (interactive) {
         printf("*** Enter interactive mode, CTRL+X to exit ***\n\n");
         raw_stdin();
     }
-    init_uart(interactive);
-    reset_cpu(a, x, y, sp, sr, pc);
-    run_cpu(cycles, verbose, mem_dump, break_pc, fast);
+    if ((console = init_uart(machine, STDIN_FILENO, stdout, interactive, fifo_depth, flush_policy)) == NULL) return EXIT_FAILURE;
+    if (baud > 0) set_uart_timing(console, freq * CHAR_BITS / baud > 1 ? freq * CHAR_BITS / baud : 1);
+    if ((board_via = init_via(machine)) == NULL) return EXIT_FAILURE;
+    if (memory_map) apply_memory_map(machine, memory_map, console, board_via);
+    atexit(finish_machine);
+    if (snap) {
+        restore_snapshot(machine, console, board_via, snap);
+        unmap_snapshot(snap);
+        if (cycles > 0) cycles += machine->total_cycles;
+    } else {
+        reset_cpu(machine, a, x, y, sp, sr, pc);
+    }
+    if (trace && open_trace(machine, trace) != 0) return EXIT_FAILURE;
+    if ((profile_report || profile_folded) && (machine->profile = create_profile(machine)) == NULL) {
+        fprintf(stderr, "Error: Unable to allocate the profiler.\n");
+        return EXIT_FAILURE;
+    }
+    if (reference && (machine->reference = open_reference(reference)) == NULL) return EXIT_FAILURE;
+    if (jit && (machine->jit = create_jit()) == NULL) {
+        fprintf(stderr, "Error: Native translation needs an x86-64 host.\n");
+        return EXIT_FAILURE;
+    }
+    run_cpu(machine, console, cycles, verbose, mem_dump, break_pc, fast, threaded, freq, slice);
+    if (uart_quit(console)) return EXIT_SUCCESS;
+    valid = machine->reference == NULL || close_reference(machine->reference) == 0;
+    machine->reference = NULL;
+    if (snapshot && save_snapshot(machine, console, board_via, snapshot) != 0) return EXIT_FAILURE;
+    if (!valid) return EXIT_FAILURE;
+    if (fanout) return fan_out(machine, console, fanout, workers, threaded, fifo_depth) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,527 @@
+/*
+ *
+ *      batch.c
+ *      Batch job runner
+ *
+ *      2024/12/13 By MicroFish
+ *      Based on MIT open source agreement
+ *      Copyright © 2020 ViudiraTech, based on the MIT agreement.
+ *
+ */
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define INCLUDE
+#include "6502.h"
+#include "6522.h"
+#include "6850.h"
+#include "batch.h"
+#include "memmap.h"
+#include "snapshot.h"
+
+/* One manifest line: a ROM, how to start it, when to stop it, and its result */
+typedef struct {
+        char      *rom;
+        char      *input;
+        char      *output;
+        char      *map; // Machine description, or NULL for the default layout
+        size_t     line;
+        int        load_addr;
+        int        a, x, y, sp, sr, pc; // -1 when not given; a negative pc names the start vector
+        int        decimal; // DecimalModel, -1 when not given
+        int        break_pc;
+        uint64_t   cycles;
+        int        status; // 0 once the job has run, -1 if it could not be started
+        StopReason reason;
+        uint8_t    A, X, Y, SP, SR;
+        uint16_t   PC;
+        uint64_t   total_cycles;
+        uint64_t   digest; // FNV-1a hash of the final memory image
+} BatchJob;
+
+/* Result of a job that a fan-out child sends back through its pipe */
+typedef struct {
+        int        status;
+        StopReason reason;
+        uint8_t    A, X, Y, SP, SR;
+        uint16_t   PC;
+        uint64_t   total_cycles;
+        uint64_t   digest;
+} ChildResult;
+
+/* Jobs [head, tail) owned by a worker; it takes from the tail, idle workers steal from the head */
+typedef struct {
+        pthread_mutex_t lock;
+        size_t          head;
+        size_t          tail;
+} JobQueue;
+
+/* State shared by the workers of a batch run */
+typedef struct {
+        BatchJob *jobs;
+        JobQueue *queues;
+        int       workers;
+        int       threaded;
+        size_t    fifo_depth;
+} Batch;
+
+/* Worker thread argument */
+typedef struct {
+        Batch *batch;
+        int    id;
+} Worker;
+
+/* Convert hexadecimal string to integer */
+static int parse_hex(const char *str)
+{
+    if (*str == '$') str++;
+    return strtol(str, NULL, 16);
+}
+
+/* Convert a decimal mode model name */
+static int parse_decimal(const char *str)
+{
+    if (strcmp(str, "nmos") == 0) return DECIMAL_NMOS;
+    if (strcmp(str, "cmos") == 0) return DECIMAL_CMOS;
+    return -1;
+}
+
+/* Release the strings of a job */
+static void free_job(BatchJob *job)
+{
+    free(job->rom);
+    free(job->input);
+    free(job->output);
+    free(job->map);
+}
+
+/* Parse a manifest line into a job, led by a ROM when image is set; returns 0 for blank and comment lines */
+static int parse_job(BatchJob *job, char *line, const char *manifest, size_t number, int image)
+{
+    char *save, *token, *value;
+    char  name[32];
+
+    memset(job, 0, sizeof(BatchJob));
+    job->line      = number;
+    job->load_addr = 0xC000;
+    job->a         = -1;
+    job->x         = -1;
+    job->y         = -1;
+    job->sp        = -1;
+    job->sr        = -1;
+    job->pc        = -RST_VEC;
+    job->decimal   = -1;
+    job->break_pc  = -1;
+
+    token = strtok_r(line, " \t\r\n", &save);
+    if (token == NULL || *token == '#') return 0;
+    if (image) {
+        job->rom = strdup(token);
+        token    = strtok_r(NULL, " \t\r\n", &save);
+    }
+    for (; token != NULL; token = strtok_r(NULL, " \t\r\n", &save)) {
+        if ((value = strchr(token, '=')) == NULL) goto bad;
+        *value++ = '\0';
+        if (strcmp(token, "l") == 0)
+            job->load_addr = parse_hex(value);
+        else if (strcmp(token, "a") == 0)
+            job->a = parse_hex(value);
+        else if (strcmp(token, "x") == 0)
+            job->x = parse_hex(value);
+        else if (strcmp(token, "y") == 0)
+            job->y = parse_hex(value);
+        else if (strcmp(token, "s") == 0)
+            job->sp = parse_hex(value);
+        else if (strcmp(token, "p") == 0)
+            job->sr = parse_hex(value);
+        else if (strcmp(token, "r") == 0 || strcmp(token, "g") == 0)
+            job->pc = parse_hex(value);
+        else if (strcmp(token, "D") == 0) {
+            if ((job->decimal = parse_decimal(value)) < 0) goto bad;
+        } else if (strcmp(token, "b") == 0)
+            job->break_pc = parse_hex(value);
+        else if (strcmp(token, "c") == 0)
+            job->cycles = strtoull(value, NULL, 10);
+        else if (strcmp(token, "in") == 0)
+            job->input = strdup(value);
+        else if (strcmp(token, "out") == 0)
+            job->output = strdup(value);
+        else if (strcmp(token, "map") == 0)
+            job->map = strdup(value);
+        else
+            goto bad;
+    }
+    if (job->cycles == 0 && job->break_pc < 0) {
+        fprintf(stderr, "Error: %s:%zu: job has no stop condition (c= or b=).\n", manifest, number);
+        free_job(job);
+        return -1;
+    }
+    if (job->cycles == 0) job->cycles = BATCH_CYCLES;
+    if (job->output == NULL) {
+        snprintf(name, sizeof(name), "job%zu.out", number);
+        job->output = strdup(name);
+    }
+    return 1;
+bad:
+    fprintf(stderr, "Error: %s:%zu: bad field \"%s\".\n", manifest, number, token);
+    free_job(job);
+    return -1;
+}
+
+/* Hash a memory image */
+static uint64_t memory_digest(const uint8_t *memory)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    int      i;
+
+    for (i = 0; i < 0x10000; i++) hash = (hash ^ memory[i]) * 0x100000001b3;
+    return hash;
+}
+
+/* Give a register its default when the job did not set it */
+static inline int job_reg(int value, int unset)
+{
+    return value < 0 ? unset : value;
+}
+
+/* Run a prepared machine until the job's stop condition and record where it stopped */
+static void finish_job(BatchJob *job, CPUMAP *cpu, Uart *uart, int threaded)
+{
+    uint64_t budget, stop;
+    bool     idle = 0;
+
+    /* The cycle limit counts from the start of the job, which is not 0 for a snapshot */
+    stop        = cpu->total_cycles + job->cycles;
+    job->reason = STOP_BUDGET;
+    while (cpu->total_cycles < stop) {
+        budget = stop - cpu->total_cycles < BATCH_SLICE ? stop - cpu->total_cycles : BATCH_SLICE;
+        if (idle) {
+            /* The job only waits for input; let the reader catch up with its file, then skip ahead over the loop */
+            uart_wait_input(uart, STEP_DURATION);
+            job->reason = run_idle(cpu, budget, job->break_pc);
+        } else {
+            job->reason = run_cycles(cpu, budget, job->break_pc, threaded);
+        }
+        if (job->reason == STOP_BREAK) break;
+        step_uart(uart);
+        idle = uart_waiting(uart);
+    }
+    job->A            = cpu->A;
+    job->X            = cpu->X;
+    job->Y            = cpu->Y;
+    job->SP           = cpu->SP;
+    job->SR           = cpu->SR.byte;
+    job->PC           = cpu->PC;
+    job->total_cycles = cpu->total_cycles;
+    job->digest       = memory_digest(cpu->memory);
+    job->status       = 0;
+}
+
+/* Print the result line of a job */
+static void print_job(const BatchJob *job, const char *name)
+{
+    if (job->status != 0)
+        printf("%zu %s: failed to start\n", job->line, name);
+    else
+        printf("%zu %s: %s at %" PRIu64 " cycles  A:%02X X:%02X Y:%02X P:%02X SP:%02X PC:%04X  MEM:%016" PRIx64 "\n", job->line, name,
+               job->reason == STOP_BREAK ? "break" : "limit", job->total_cycles, job->A, job->X, job->Y, job->SR, job->SP, job->PC, job->digest);
+}
+
+/* Run one job on a machine of its own */
+static void run_job(BatchJob *job, int threaded, size_t fifo_depth)
+{
+    CPUMAP         *cpu  = create_cpu();
+    FILE           *out  = NULL;
+    Uart           *uart = NULL;
+    Via            *via  = NULL;
+    MemoryMap      *map  = NULL;
+    const Snapshot *snap = NULL;
+    int             in_fd;
+
+    job->status = -1;
+    if (cpu == NULL || map_snapshot(job->rom, &snap) < 0) goto done;
+    if (job->map && (map = load_memory_map(job->map)) == NULL) goto done;
+    if (snap == NULL && load_rom(cpu, job->rom, job->load_addr) < 0) goto done;
+    if ((out = fopen(job->output, "w")) == NULL) goto done;
+    if ((in_fd = open(job->input ? job->input : "/dev/null", O_RDONLY)) < 0) goto done;
+    if ((uart = init_uart(cpu, in_fd, out, 0, fifo_depth, FLUSH_BLOCK)) == NULL) goto done;
+    if ((via = init_via(cpu)) == NULL) goto done;
+    if (map) apply_memory_map(cpu, map, uart, via);
+    if (job->decimal >= 0) cpu->decimal = job->decimal;
+    if (snap)
+        restore_snapshot(cpu, uart, via, snap);
+    else
+        reset_cpu(cpu, job_reg(job->a, 0), job_reg(job->x, 0), job_reg(job->y, 0), job_reg(job->sp, 0xFF), job_reg(job->sr, 0), job->pc);
+    finish_job(job, cpu, uart, threaded);
+done:
+    if (snap) unmap_snapshot(snap);
+    if (via) close_via(via);
+    if (uart) close_uart(uart);
+    if (out) fclose(out);
+    free_cpu(cpu);
+    free(map);
+}
+
+/* Take a job from the worker's own queue, or steal one from another worker */
+static int take_job(Batch *batch, int id, size_t *index)
+{
+    JobQueue *queue;
+    int       i, found = 0;
+
+    for (i = 0; i < batch->workers && !found; i++) {
+        queue = &batch->queues[(id + i) % batch->workers];
+        pthread_mutex_lock(&queue->lock);
+        if (queue->head < queue->tail) {
+            *index = i == 0 ? --queue->tail : queue->head++;
+            found  = 1;
+        }
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return found;
+}
+
+/* Worker thread: run jobs until every queue is empty */
+static void *batch_worker(void *arg)
+{
+    Worker *worker = arg;
+    Batch  *batch  = worker->batch;
+    size_t  index;
+
+    while (take_job(batch, worker->id, &index)) run_job(&batch->jobs[index], batch->threaded, batch->fifo_depth);
+    return NULL;
+}
+
+/* Read every job of a manifest; returns the number of jobs, or -1 on error */
+static long read_manifest(const char *manifest, BatchJob **jobs, int image)
+{
+    FILE    *fp = fopen(manifest, "r");
+    char    *line = NULL;
+    size_t   size = 0, number = 0;
+    long     count = 0, capacity = 0;
+    BatchJob job, *grown;
+    int      parsed;
+
+    *jobs = NULL;
+    if (fp == NULL) {
+        printf("Error: Unable to open file.\n");
+        return -1;
+    }
+    while (getline(&line, &size, fp) != -1) {
+        if ((parsed = parse_job(&job, line, manifest, ++number, image)) < 0) goto fail;
+        if (parsed == 0) continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            if ((grown = realloc(*jobs, capacity * sizeof(BatchJob))) == NULL) {
+                free_job(&job);
+                goto fail;
+            }
+            *jobs = grown;
+        }
+        (*jobs)[count++] = job;
+    }
+    free(line);
+    fclose(fp);
+    return count;
+fail:
+    while (count > 0) free_job(&(*jobs)[--count]);
+    free(*jobs);
+    free(line);
+    fclose(fp);
+    return -1;
+}
+
+/* Run every job of a manifest on a pool of worker threads and print their results */
+int run_batch(const char *manifest, int workers, int threaded, size_t fifo_depth)
+{
+    Batch      batch;
+    Worker    *worker;
+    pthread_t *threads;
+    long       count, i;
+    int        failed = 0;
+
+    if ((count = read_manifest(manifest, &batch.jobs, 1)) < 0) return -1;
+    if (workers > count) workers = count;
+    if (workers < 1) workers = 1;
+    batch.workers    = workers;
+    batch.threaded   = threaded;
+    batch.fifo_depth = fifo_depth;
+    batch.queues     = calloc(workers, sizeof(JobQueue));
+    worker           = calloc(workers, sizeof(Worker));
+    threads          = calloc(workers, sizeof(pthread_t));
+    if (batch.queues == NULL || worker == NULL || threads == NULL) {
+        fprintf(stderr, "Error: Unable to allocate the worker pool.\n");
+        goto fail;
+    }
+
+    /* Deal out contiguous runs of jobs; stealing evens out the ones that take longer */
+    for (i = 0; i < workers; i++) {
+        pthread_mutex_init(&batch.queues[i].lock, NULL);
+        batch.queues[i].head = count * i / workers;
+        batch.queues[i].tail = count * (i + 1) / workers;
+        worker[i].batch      = &batch;
+        worker[i].id         = i;
+    }
+    for (i = 0; i < workers; i++) {
+        if (pthread_create(&threads[i], NULL, batch_worker, &worker[i]) != 0) {
+            fprintf(stderr, "Error: Unable to start a batch worker.\n");
+            workers = i;
+            break;
+        }
+    }
+    if (workers == 0) batch_worker(&worker[0]);
+    for (i = 0; i < workers; i++) pthread_join(threads[i], NULL);
+
+    for (i = 0; i < count; i++) {
+        print_job(&batch.jobs[i], batch.jobs[i].rom);
+        failed += batch.jobs[i].status != 0;
+        free_job(&batch.jobs[i]);
+    }
+    for (i = 0; i < batch.workers; i++) pthread_mutex_destroy(&batch.queues[i].lock);
+    free(batch.jobs);
+    free(batch.queues);
+    free(worker);
+    free(threads);
+    return failed;
+fail:
+    while (count > 0) free_job(&batch.jobs[--count]);
+    free(batch.jobs);
+    free(batch.queues);
+    free(worker);
+    free(threads);
+    return -1;
+}
+
+/* Child side of a fan-out: run one line from the inherited machine state and report back through the pipe */
+static void run_child(BatchJob *job, CPUMAP *cpu, Uart *uart, int threaded, size_t fifo_depth, int result)
+{
+    UartState   state;
+    ChildResult done;
+    FILE       *out;
+    Uart       *child_uart;
+    IoRead      home_read   = cpu->io_read[CTRL_ADDR >> 8];
+    IoWrite     home_write  = cpu->io_write[CTRL_ADDR >> 8];
+    void       *home_device = cpu->io_device[CTRL_ADDR >> 8];
+    int         in_fd;
+
+    /* The parent's reader thread does not exist after fork, so the UART is rebuilt around the child's input */
+    get_uart_state(uart, &state);
+    cancel_events(cpu, uart);
+    if ((out = fopen(job->output, "w")) != NULL && (in_fd = open(job->input ? job->input : "/dev/null", O_RDONLY)) >= 0 &&
+        (child_uart = init_uart(cpu, in_fd, out, 0, fifo_depth, FLUSH_BLOCK)) != NULL) {
+        /* It takes over the pages the memory map gave the parent's UART */
+        map_io(cpu, CTRL_ADDR >> 8, home_read, home_write, home_device);
+        move_device(cpu, uart, child_uart);
+        set_uart_timing(child_uart, get_uart_timing(uart));
+        set_uart_state(child_uart, &state);
+        if (job->a >= 0) cpu->A = job->a;
+        if (job->x >= 0) cpu->X = job->x;
+        if (job->y >= 0) cpu->Y = job->y;
+        if (job->sp >= 0) cpu->SP = job->sp;
+        if (job->sr >= 0) set_status(cpu, job->sr);
+        if (job->pc >= 0) cpu->PC = job->pc;
+        if (job->decimal >= 0) cpu->decimal = job->decimal;
+        finish_job(job, cpu, child_uart, threaded);
+        close_uart(child_uart);
+    }
+    if (out) fclose(out);
+    memset(&done, 0, sizeof(done));
+    done.status       = job->status;
+    done.reason       = job->reason;
+    done.A            = job->A;
+    done.X            = job->X;
+    done.Y            = job->Y;
+    done.SP           = job->SP;
+    done.SR           = job->SR;
+    done.PC           = job->PC;
+    done.total_cycles = job->total_cycles;
+    done.digest       = job->digest;
+    if (write(result, &done, sizeof(done)) != sizeof(done)) _exit(EXIT_FAILURE);
+    _exit(job->status == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/* Fork one child per line of a fan-out file from the current machine state and print their results */
+int fan_out(CPUMAP *cpu, Uart *uart, const char *spec, int workers, int threaded, size_t fifo_depth)
+{
+    BatchJob   *jobs;
+    ChildResult child;
+    pid_t      *pids;
+    int        *results;
+    long        count, next, done;
+    int         fds[2], failed = 0;
+
+    if ((count = read_manifest(spec, &jobs, 0)) < 0) return -1;
+    if (workers < 1) workers = 1;
+    pids    = calloc(count, sizeof(pid_t));
+    results = calloc(count, sizeof(int));
+    if (count > 0 && (pids == NULL || results == NULL)) {
+        fprintf(stderr, "Error: Unable to allocate the fan-out.\n");
+        while (count > 0) free_job(&jobs[--count]);
+        free(jobs);
+        free(pids);
+        free(results);
+        return -1;
+    }
+
+    /* Nothing buffered may be inherited, or every child would write it out again */
+    close_trace(cpu);
+    uart_flush(uart);
+    fflush(stdout);
+    fflush(stderr);
+
+    for (next = done = 0; done < count;) {
+        if (next < count && next - done < workers) {
+            jobs[next].status = -1;
+            pids[next]        = -1;
+            results[next]     = -1;
+            if (pipe(fds) == 0) {
+                if ((pids[next] = fork()) == 0) {
+                    close(fds[0]);
+                    run_child(&jobs[next], cpu, uart, threaded, fifo_depth, fds[1]);
+                }
+                close(fds[1]);
+                if (pids[next] > 0)
+                    results[next] = fds[0];
+                else
+                    close(fds[0]);
+            }
+            if (pids[next] < 0) fprintf(stderr, "Error: Unable to start a fan-out child.\n");
+            next++;
+            continue;
+        }
+
+        /* Collect the oldest child first so the results come out in file order */
+        if (results[done] >= 0) {
+            /* Only the result comes back; the job's own strings stay the parent's */
+            if (read(results[done], &child, sizeof(child)) == sizeof(child)) {
+                jobs[done].status       = child.status;
+                jobs[done].reason       = child.reason;
+                jobs[done].A            = child.A;
+                jobs[done].X            = child.X;
+                jobs[done].Y            = child.Y;
+                jobs[done].SP           = child.SP;
+                jobs[done].SR           = child.SR;
+                jobs[done].PC           = child.PC;
+                jobs[done].total_cycles = child.total_cycles;
+                jobs[done].digest       = child.digest;
+            }
+            close(results[done]);
+            waitpid(pids[done], NULL, 0);
+        }
+        print_job(&jobs[done], jobs[done].output);
+        fflush(stdout);
+        failed += jobs[done].status != 0;
+        done++;
+    }
+    while (count > 0) free_job(&jobs[--count]);
+    free(jobs);
+    free(pids);
+    free(results);
+    return failed;
+}
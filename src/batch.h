@@ -0,0 +1,26 @@
+/*
+ *
+ *      batch.h
+ *      Batch job runner header file
+ *
+ *      2024/12/13 By MicroFish
+ *      Based on MIT open source agreement
+ *      Copyright © 2020 ViudiraTech, based on the MIT agreement.
+ *
+ */
+
+#ifndef INCLUDE_BATCH_H_
+#define INCLUDE_BATCH_H_
+
+#include <stddef.h>
+
+#define BATCH_SLICE  1000000    // Cycles a job runs between UART services
+#define BATCH_CYCLES 100000000  // Cycle limit of a job that only gives a break address
+
+/* Run every job of a manifest on a pool of worker threads and print their results */
+int run_batch(const char *manifest, int workers, int threaded, size_t fifo_depth);
+
+/* Fork one child per line of a fan-out file from the current machine state and print their results */
+int fan_out(CPUMAP *cpu, Uart *uart, const char *spec, int workers, int threaded, size_t fifo_depth);
+
+#endif // INCLUDE_BATCH_H_
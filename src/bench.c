@@ -0,0 +1,252 @@
+/*
+ *
+ *      bench.c
+ *      Headless microbenchmarks of the CPU cores
+ *
+ *      2024/12/13 By MicroFish
+ *      Based on MIT open source agreement
+ *      Copyright © 2020 ViudiraTech, based on the MIT agreement.
+ *
+ */
+
+#include <inttypes.h>
+#include <math.h>
+#include <unistd.h>
+
+#define INCLUDE
+#include "6502.h"
+#include "6850.h"
+#include "jit.h"
+
+#define BENCH_ORIGIN  0xC000 // Load address of the synthetic workloads
+#define BENCH_SLICE   1000000 // Cycles run between UART services
+#define BENCH_CYCLES  50e6   // Default cycles per run
+#define BENCH_REPEATS 5      // Default measured runs per workload and core
+
+/* Cores under test */
+typedef enum { CORE_TABLE, CORE_THREADED, CORE_JIT, NUM_CORES } Core;
+static const char *const core_names[NUM_CORES] = {"table", "threaded", "jit"};
+
+/* Tight branch loops: DEY/BNE nested in DEX/BNE */
+static const uint8_t bench_branch[] = {
+    0xA2, 0x00,       // C000  LDX #$00
+    0xA0, 0x00,       // C002  LDY #$00
+    0x88,             // C004  DEY
+    0xD0, 0xFD,       // C005  BNE $C004
+    0xCA,             // C007  DEX
+    0xD0, 0xFA,       // C008  BNE $C004
+    0x4C, 0x00, 0xC0, // C00A  JMP $C000
+};
+
+/* Memory loop over zero page,X, absolute,X and (indirect),Y operands */
+static const uint8_t bench_memory[] = {
+    0xA9, 0x00,       // C000  LDA #$00
+    0x85, 0xF0,       // C002  STA $F0
+    0xA9, 0x05,       // C004  LDA #$05
+    0x85, 0xF1,       // C006  STA $F1       ; ($F0) points to $0500
+    0xA2, 0x00,       // C008  LDX #$00
+    0x8A,             // C00A  TXA
+    0xA8,             // C00B  TAY
+    0x18,             // C00C  CLC
+    0xB5, 0x10,       // C00D  LDA $10,X
+    0x75, 0x20,       // C00F  ADC $20,X
+    0x7D, 0x00, 0x02, // C011  ADC $0200,X
+    0x9D, 0x00, 0x04, // C014  STA $0400,X
+    0x71, 0xF0,       // C017  ADC ($F0),Y
+    0x91, 0xF0,       // C019  STA ($F0),Y
+    0xE6, 0xE0,       // C01B  INC $E0
+    0xA5, 0xE0,       // C01D  LDA $E0
+    0xE8,             // C01F  INX
+    0xD0, 0xE8,       // C020  BNE $C00A
+    0x4C, 0x0A, 0xC0, // C022  JMP $C00A
+};
+
+/* Doubly recursive subroutine, 2^12 JSR/RTS pairs per pass */
+static const uint8_t bench_recursion[] = {
+    0xA2, 0xFF,       // C000  LDX #$FF
+    0x9A,             // C002  TXS
+    0xA9, 0x0C,       // C003  LDA #$0C
+    0x20, 0x0B, 0xC0, // C005  JSR $C00B
+    0x4C, 0x03, 0xC0, // C008  JMP $C003
+    0xF0, 0x11,       // C00B  BEQ $C01E     ; depth in A
+    0x48,             // C00D  PHA
+    0x38,             // C00E  SEC
+    0xE9, 0x01,       // C00F  SBC #$01
+    0x20, 0x0B, 0xC0, // C011  JSR $C00B
+    0x68,             // C014  PLA
+    0x48,             // C015  PHA
+    0x38,             // C016  SEC
+    0xE9, 0x01,       // C017  SBC #$01
+    0x20, 0x0B, 0xC0, // C019  JSR $C00B
+    0x68,             // C01C  PLA
+    0x60,             // C01D  RTS
+    0x60,             // C01E  RTS
+};
+
+/* Decimal mode counters: a 4-digit BCD increment and a BCD subtraction */
+static const uint8_t bench_decimal[] = {
+    0xF8,             // C000  SED
+    0xA2, 0x00,       // C001  LDX #$00
+    0x18,             // C003  CLC
+    0xA5, 0x10,       // C004  LDA $10
+    0x69, 0x01,       // C006  ADC #$01
+    0x85, 0x10,       // C008  STA $10
+    0xA5, 0x11,       // C00A  LDA $11
+    0x69, 0x00,       // C00C  ADC #$00
+    0x85, 0x11,       // C00E  STA $11
+    0x38,             // C010  SEC
+    0xA5, 0x12,       // C011  LDA $12
+    0xE9, 0x07,       // C013  SBC #$07
+    0x85, 0x12,       // C015  STA $12
+    0xCA,             // C017  DEX
+    0xD0, 0xE9,       // C018  BNE $C003
+    0x4C, 0x03, 0xC0, // C01A  JMP $C003
+};
+
+/* One workload: a program placed at BENCH_ORIGIN, or a ROM driven through the UART */
+typedef struct {
+        const char    *name;
+        const uint8_t *code;
+        size_t         size;
+        const char    *rom;   // ROM loaded at $C000 instead of code
+        const char    *input; // Text fed to the UART of the ROM
+} Workload;
+
+static const Workload workloads[] = {
+    {"branch",    bench_branch,    sizeof(bench_branch),    NULL,               NULL                                                  },
+    {"memory",    bench_memory,    sizeof(bench_memory),    NULL,               NULL                                                  },
+    {"recursion", bench_recursion, sizeof(bench_recursion), NULL,               NULL                                                  },
+    {"decimal",   bench_decimal,   sizeof(bench_decimal),   NULL,               NULL                                                  },
+    {"ehbasic",   NULL,            0,                       "roms/ehbasic.bin", "C\r\r10 I=I+1:S=S+SQR(I)*I/3:A$=STR$(S):GOTO 10\rRUN\r"},
+};
+
+/* Pipe holding the whole UART input of a workload */
+static int input_pipe(const char *text)
+{
+    size_t len = strlen(text);
+    int    fds[2];
+
+    if (pipe(fds) != 0) return -1;
+    if (write(fds[1], text, len) != (ssize_t)len) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    close(fds[1]);
+    return fds[0];
+}
+
+/* Run a workload once on a fresh machine, returning its emulated MHz and host ns per instruction */
+static int run_workload(const Workload *work, Core core, uint64_t cycles, double *mhz, double *ns)
+{
+    CPUMAP  *cpu  = create_cpu();
+    Uart    *uart = NULL;
+    FILE    *out  = NULL;
+    uint64_t start, elapsed;
+    int      fd, status = -1;
+
+    if (cpu == NULL) return -1;
+    if (core == CORE_JIT && (cpu->jit = create_jit()) == NULL) goto done;
+    if (work->rom) {
+        if (load_rom(cpu, (char *)work->rom, 0xC000) < 0) goto done;
+        if ((out = fopen("/dev/null", "w")) == NULL || (fd = input_pipe(work->input)) < 0) goto done;
+        if ((uart = init_uart(cpu, fd, out, 0, FIFO_SIZE, FLUSH_BLOCK)) == NULL) goto done;
+    } else {
+        memcpy(&cpu->memory[BENCH_ORIGIN], work->code, work->size);
+        cpu->memory[RST_VEC]     = BENCH_ORIGIN & 0xFF;
+        cpu->memory[RST_VEC + 1] = BENCH_ORIGIN >> 8;
+    }
+    reset_cpu(cpu, 0, 0, 0, 0xFF, 0, -RST_VEC);
+
+    start = host_time();
+    while (cpu->total_cycles < cycles) {
+        run_cycles(cpu, BENCH_SLICE, -1, core == CORE_THREADED);
+        if (uart) step_uart(uart);
+    }
+    elapsed = host_time() - start;
+    *mhz    = cpu->total_cycles * 1e3 / elapsed;
+    *ns     = (double)elapsed / cpu->total_instructions;
+    status  = 0;
+done:
+    if (uart) close_uart(uart);
+    if (out) fclose(out);
+    free_cpu(cpu);
+    return status;
+}
+
+/* Order doubles for qsort */
+static int compare_double(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+/* Median of a sorted array */
+static double median(const double *val, int num)
+{
+    return num % 2 ? val[num / 2] : (val[num / 2 - 1] + val[num / 2]) / 2;
+}
+
+/* Measure a workload on one core and print a result line */
+static int bench_workload(const Workload *work, Core core, uint64_t cycles, int repeats)
+{
+    double mhz[repeats], ns[repeats];
+    double mean = 0, var = 0, warm;
+    int    i;
+
+    /* The first run only warms up the caches and the decimal tables */
+    if (run_workload(work, core, cycles, &warm, &warm) != 0) {
+        printf("%-10s %-8s  unable to run\n", work->name, core_names[core]);
+        return -1;
+    }
+    for (i = 0; i < repeats; i++)
+        if (run_workload(work, core, cycles, &mhz[i], &ns[i]) != 0) return -1;
+    for (i = 0; i < repeats; i++) mean += mhz[i] / repeats;
+    for (i = 0; i < repeats; i++) var += (mhz[i] - mean) * (mhz[i] - mean) / repeats;
+    qsort(mhz, repeats, sizeof(double), compare_double);
+    qsort(ns, repeats, sizeof(double), compare_double);
+    printf("%-10s %-8s %10.1f %10.1f %10.1f %7.1f%% %10.2f\n", work->name, core_names[core], median(mhz, repeats), mhz[0],
+           mhz[repeats - 1], mean > 0 ? sqrt(var) * 100 / mean : 0, median(ns, repeats));
+    return 0;
+}
+
+/* Program entry */
+int main(int argc, char *argv[])
+{
+    uint64_t cycles  = BENCH_CYCLES;
+    int      repeats = BENCH_REPEATS;
+    int      failed  = 0;
+    Jit     *jit     = create_jit();
+    int      cores   = jit ? NUM_CORES : CORE_JIT; // Native translation only exists on x86-64 hosts
+    int      opt, core;
+    size_t   i;
+
+    while ((opt = getopt(argc, argv, "c:r:")) != -1) {
+        switch (opt) {
+            case 'c' :
+                cycles = strtod(optarg, NULL);
+                break;
+            case 'r' :
+                repeats = atoi(optarg);
+                break;
+            default :
+                fprintf(stderr, "Usage: %s [-c CYCLES] [-r REPEATS] [workload...]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (repeats < 1 || cycles == 0) {
+        fprintf(stderr, "Error: need at least one run of at least one cycle.\n");
+        return EXIT_FAILURE;
+    }
+    free_jit(jit);
+    printf("%" PRIu64 " cycles per run, median of %d runs\n\n", cycles, repeats);
+    printf("%-10s %-8s %10s %10s %10s %8s %10s\n", "Workload", "Core", "MHz", "min", "max", "stddev", "ns/instr");
+    for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        if (optind < argc) {
+            for (opt = optind; opt < argc && strcmp(argv[opt], workloads[i].name) != 0; opt++);
+            if (opt == argc) continue;
+        }
+        for (core = 0; core < cores; core++) failed |= bench_workload(&workloads[i], core, cycles, repeats);
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,375 @@
+/*
+ *
+ *      check.c
+ *      Headless regression checks of the CPU cores and devices
+ *
+ *      2024/12/13 By MicroFish
+ *      Based on MIT open source agreement
+ *      Copyright © 2020 ViudiraTech, based on the MIT agreement.
+ *
+ */
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#define INCLUDE
+#include "6502.h"
+#include "6522.h"
+#include "6850.h"
+#include "batch.h"
+#include "jit.h"
+
+#define CHECK_ORIGIN 0xC000  // Load address of the check programs
+#define CHECK_SLICE  1000    // Cycles between UART services, short enough for the idle skip to kick in early
+#define CHECK_CYCLES 1000000 // Cycles a check program must reach its break address in
+#define CHECK_RUNS   4       // Runs of every core and mode, to catch results that depend on host thread scheduling
+#define CHECK_FIFO   1       // UART receive FIFO depth, making the reader thread refill it between characters
+#define CHECK_JOBS   8       // Identical jobs in the batch run of a check with input
+#define CHECK_WORKER 4       // Batch worker threads
+#define CHECK_TEMP   "/tmp/Sim6502-check-XXXXXX"
+
+/* Cores under test */
+typedef enum { CORE_TABLE, CORE_THREADED, CORE_JIT, NUM_CORES } Core;
+static const char *const core_names[NUM_CORES] = {"table", "threaded", "jit"};
+
+/* Polls the VIA IFR for a timer 1 timeout, with the UART receive interrupt enabled, and saves the counter after it */
+static const uint8_t check_ifr_poll[] = {
+    0xA2, 0xFF,       // C000  LDX #$FF
+    0x9A,             // C002  TXS
+    0xA9, 0x80,       // C003  LDA #$80
+    0x8D, 0x00, 0xA0, // C005  STA $A000     ; UART receive interrupt on
+    0xA9, 0x00,       // C008  LDA #$00
+    0x8D, 0x04, 0xB0, // C00A  STA $B004
+    0xA9, 0x80,       // C00D  LDA #$80
+    0x8D, 0x05, 0xB0, // C00F  STA $B005     ; timer 1 one-shot from $8000
+    0xAD, 0x0D, 0xB0, // C012  LDA $B00D
+    0x29, 0x40,       // C015  AND #$40
+    0xF0, 0xF9,       // C017  BEQ $C012
+    0xAD, 0x04, 0xB0, // C019  LDA $B004
+    0x85, 0x10,       // C01C  STA $10
+    0xAD, 0x05, 0xB0, // C01E  LDA $B005
+    0x85, 0x11,       // C021  STA $11
+    0x4C, 0x23, 0xC0, // C023  JMP $C023     ; break
+};
+
+/* Polls the UART status until a timer 1 interrupt handler has saved the counter */
+static const uint8_t check_irq_wait[] = {
+    0xA2, 0xFF,       // C000  LDX #$FF
+    0x9A,             // C002  TXS
+    0xA9, 0xC0,       // C003  LDA #$C0
+    0x8D, 0x0E, 0xB0, // C005  STA $B00E     ; timer 1 interrupt on
+    0xA9, 0x00,       // C008  LDA #$00
+    0x8D, 0x04, 0xB0, // C00A  STA $B004
+    0xA9, 0x80,       // C00D  LDA #$80
+    0x8D, 0x05, 0xB0, // C00F  STA $B005     ; timer 1 one-shot from $8000
+    0x58,             // C012  CLI
+    0xAD, 0x00, 0xA0, // C013  LDA $A000
+    0xA5, 0x12,       // C016  LDA $12
+    0xF0, 0xF9,       // C018  BEQ $C013
+    0x4C, 0x1A, 0xC0, // C01A  JMP $C01A     ; break
+    0xAD, 0x04, 0xB0, // C01D  LDA $B004     ; IRQ handler
+    0x85, 0x10,       // C020  STA $10
+    0xAD, 0x05, 0xB0, // C022  LDA $B005
+    0x85, 0x11,       // C025  STA $11
+    0xE6, 0x12,       // C027  INC $12
+    0x40,             // C029  RTI
+};
+
+/* Packs the status register after results setting and keeping N and Z, through PHP, 64 times over so the JIT translates the loop */
+static const uint8_t check_flags[] = {
+    0xA9, 0x40,       // C000  LDA #$40
+    0x85, 0x11,       // C002  STA $11       ; passes
+    0xA2, 0x00,       // C004  LDX #$00
+    0xA9, 0x80,       // C006  LDA #$80
+    0x08,             // C008  PHP
+    0x68,             // C009  PLA
+    0x95, 0x20,       // C00A  STA $20,X
+    0xE8,             // C00C  INX
+    0xA9, 0x00,       // C00D  LDA #$00
+    0x08,             // C00F  PHP
+    0x68,             // C010  PLA
+    0x95, 0x20,       // C011  STA $20,X
+    0xE8,             // C013  INX
+    0xA0, 0x7F,       // C014  LDY #$7F
+    0xC8,             // C016  INY
+    0x08,             // C017  PHP
+    0x68,             // C018  PLA
+    0x95, 0x20,       // C019  STA $20,X
+    0xE8,             // C01B  INX
+    0x38,             // C01C  SEC
+    0xA9, 0x10,       // C01D  LDA #$10
+    0xE9, 0x20,       // C01F  SBC #$20
+    0x08,             // C021  PHP
+    0x68,             // C022  PLA
+    0x95, 0x20,       // C023  STA $20,X
+    0xE8,             // C025  INX
+    0xA9, 0x80,       // C026  LDA #$80
+    0x0A,             // C028  ASL A
+    0x08,             // C029  PHP
+    0x68,             // C02A  PLA
+    0x95, 0x20,       // C02B  STA $20,X
+    0xE8,             // C02D  INX
+    0xA9, 0xC0,       // C02E  LDA #$C0
+    0x85, 0x10,       // C030  STA $10
+    0xA9, 0x3F,       // C032  LDA #$3F
+    0x24, 0x10,       // C034  BIT $10
+    0x08,             // C036  PHP
+    0x68,             // C037  PLA
+    0x95, 0x20,       // C038  STA $20,X
+    0xE8,             // C03A  INX
+    0xA9, 0x01,       // C03B  LDA #$01
+    0xC9, 0x01,       // C03D  CMP #$01
+    0x08,             // C03F  PHP
+    0x68,             // C040  PLA
+    0x95, 0x20,       // C041  STA $20,X
+    0xE8,             // C043  INX
+    0xA9, 0x80,       // C044  LDA #$80
+    0x18,             // C046  CLC           ; N and Z survive
+    0xB8,             // C047  CLV
+    0x08,             // C048  PHP
+    0x68,             // C049  PLA
+    0x95, 0x20,       // C04A  STA $20,X
+    0xE8,             // C04C  INX
+    0xA9, 0x50,       // C04D  LDA #$50
+    0x69, 0x50,       // C04F  ADC #$50
+    0x08,             // C051  PHP
+    0x68,             // C052  PLA
+    0x95, 0x20,       // C053  STA $20,X
+    0xE8,             // C055  INX
+    0xA9, 0xFF,       // C056  LDA #$FF
+    0x48,             // C058  PHA
+    0x28,             // C059  PLP           ; every flag set
+    0xD8,             // C05A  CLD
+    0x08,             // C05B  PHP
+    0x68,             // C05C  PLA
+    0x95, 0x20,       // C05D  STA $20,X
+    0xE8,             // C05F  INX
+    0xA9, 0x00,       // C060  LDA #$00
+    0x48,             // C062  PHA
+    0x28,             // C063  PLP           ; every flag clear
+    0x08,             // C064  PHP
+    0x68,             // C065  PLA
+    0x95, 0x20,       // C066  STA $20,X
+    0xE8,             // C068  INX
+    0xC6, 0x11,       // C069  DEC $11
+    0xD0, 0x97,       // C06B  BNE $C004
+    0x4C, 0x6D, 0xC0, // C06D  JMP $C06D     ; break
+};
+
+/* Polls the UART status and stores every character received at $10 onwards, up to a carriage return */
+static const uint8_t check_file_input[] = {
+    0xA2, 0x00,       // C000  LDX #$00
+    0xAD, 0x00, 0xA0, // C002  LDA $A000
+    0x4A,             // C005  LSR A
+    0x90, 0xFA,       // C006  BCC $C002
+    0xAD, 0x01, 0xA0, // C008  LDA $A001
+    0x95, 0x10,       // C00B  STA $10,X
+    0xE8,             // C00D  INX
+    0xC9, 0x0D,       // C00E  CMP #$0D
+    0xD0, 0xF0,       // C010  BNE $C002
+    0x4C, 0x12, 0xC0, // C012  JMP $C012     ; break
+};
+
+/* One check: a program placed at CHECK_ORIGIN that stops at break_pc */
+typedef struct {
+        const char    *name;
+        const uint8_t *code;
+        size_t         size;
+        uint16_t       break_pc;
+        uint16_t       irq;   // IRQ handler address, 0 without one
+        const char    *input; // Text fed to the UART from a file, NULL for none
+} Check;
+
+static const Check checks[] = {
+    {"ifr-poll",   check_ifr_poll,   sizeof(check_ifr_poll),   0xC023, 0,      NULL         },
+    {"irq-wait",   check_irq_wait,   sizeof(check_irq_wait),   0xC01A, 0xC01D, NULL         },
+    {"flags",      check_flags,      sizeof(check_flags),      0xC06D, 0,      NULL         },
+    {"file-input", check_file_input, sizeof(check_file_input), 0xC012, 0,      "PRINT 2+2\r"},
+};
+
+/* Machine state a check compares between runs */
+typedef struct {
+        StopReason reason;
+        uint64_t   total_cycles;
+        uint8_t    A, X, Y, SP, SR;
+        uint16_t   PC;
+        uint8_t    zero_page[0x100];
+} Result;
+
+/* Open a file holding text for the UART to read, or /dev/null without any */
+static int open_input(const char *text)
+{
+    FILE *file;
+    int   fd = -1;
+
+    if (text == NULL) return open("/dev/null", O_RDONLY);
+    if ((file = tmpfile()) == NULL) return -1;
+    if (fputs(text, file) >= 0 && fflush(file) == 0 && (fd = dup(fileno(file))) >= 0) lseek(fd, 0, SEEK_SET);
+    fclose(file);
+    return fd;
+}
+
+/* Run a check program on a fresh machine and core, fast-forwarding idle loops the way the pacing loop does when idle_skip is set */
+static int run_check(const Check *check, Core core, bool idle_skip, Result *result)
+{
+    CPUMAP *cpu  = create_cpu();
+    Uart   *uart = NULL;
+    Via    *via  = NULL;
+    FILE   *out  = NULL;
+    bool    idle = 0;
+    int     fd, status = -1;
+
+    memset(result, 0, sizeof(Result));
+    if (cpu == NULL) return -1;
+    if (core == CORE_JIT && (cpu->jit = create_jit()) == NULL) goto done;
+    if ((out = fopen("/dev/null", "w")) == NULL || (fd = open_input(check->input)) < 0) goto done;
+    if ((uart = init_uart(cpu, fd, out, 0, CHECK_FIFO, FLUSH_BLOCK)) == NULL) goto done;
+    if ((via = init_via(cpu)) == NULL) goto done;
+    memcpy(&cpu->memory[CHECK_ORIGIN], check->code, check->size);
+    cpu->memory[RST_VEC]     = CHECK_ORIGIN & 0xFF;
+    cpu->memory[RST_VEC + 1] = CHECK_ORIGIN >> 8;
+    cpu->memory[IRQ_VEC]     = check->irq & 0xFF;
+    cpu->memory[IRQ_VEC + 1] = check->irq >> 8;
+    reset_cpu(cpu, 0, 0, 0, 0xFF, 0, -RST_VEC);
+
+    result->reason = STOP_BUDGET;
+    while (result->reason != STOP_BREAK && cpu->total_cycles < CHECK_CYCLES) {
+        if (idle)
+            result->reason = run_idle(cpu, CHECK_SLICE, check->break_pc);
+        else
+            result->reason = run_cycles(cpu, CHECK_SLICE, check->break_pc, core == CORE_THREADED);
+        step_uart(uart);
+        idle = idle_skip && uart_waiting(uart);
+    }
+    result->total_cycles = cpu->total_cycles;
+    result->A            = cpu->A;
+    result->X            = cpu->X;
+    result->Y            = cpu->Y;
+    result->SP           = cpu->SP;
+    result->SR           = cpu->SR.byte;
+    result->PC           = cpu->PC;
+    memcpy(result->zero_page, cpu->memory, sizeof(result->zero_page));
+    status = 0;
+done:
+    if (via) close_via(via);
+    if (uart) close_uart(uart);
+    if (out) fclose(out);
+    free_cpu(cpu);
+    return status;
+}
+
+/* Print a run of a check that differs from the reference run */
+static void print_result(const char *label, const Result *result)
+{
+    printf("    %-18s %s at %" PRIu64 " cycles  A:%02X X:%02X Y:%02X P:%02X SP:%02X PC:%04X  $10:%02X%02X\n", label,
+           result->reason == STOP_BREAK ? "break" : "limit", result->total_cycles, result->A, result->X, result->Y, result->SR,
+           result->SP, result->PC, result->zero_page[0x11], result->zero_page[0x10]);
+}
+
+/* Run a check several times on every core with and without the idle skip; every run must stop at the break exactly like the table
+   core running every instruction */
+static int run_checks(const Check *check, int cores)
+{
+    Result reference, result;
+    char   label[32];
+    int    core, skip, run, failed = 0;
+
+    if (run_check(check, CORE_TABLE, 0, &reference) != 0 || reference.reason != STOP_BREAK) {
+        printf("%-10s FAIL  the table core does not reach the break\n", check->name);
+        return -1;
+    }
+    for (core = 0; core < cores; core++) {
+        for (skip = 0; skip < 2; skip++) {
+            for (run = 0; run < CHECK_RUNS; run++) {
+                if (run_check(check, core, skip, &result) == 0 && memcmp(&result, &reference, sizeof(Result)) == 0) continue;
+                if (!failed) {
+                    printf("%-10s FAIL\n", check->name);
+                    print_result("table", &reference);
+                }
+                snprintf(label, sizeof(label), "%s%s", core_names[core], skip ? " idle skip" : "");
+                print_result(label, &result);
+                failed = -1;
+            }
+        }
+    }
+    if (!failed) printf("%-10s ok\n", check->name);
+    return failed;
+}
+
+/* Write data to a new temporary file, naming it in path; path is left empty on failure */
+static int write_temp(char *path, const void *data, size_t size)
+{
+    int fd;
+
+    strcpy(path, CHECK_TEMP);
+    if ((fd = mkstemp(path)) >= 0) {
+        if (write(fd, data, size) == (ssize_t)size && close(fd) == 0) return 0;
+        close(fd);
+        unlink(path);
+    }
+    *path = '\0';
+    return -1;
+}
+
+/* Run a check with input as a batch of identical jobs on several workers; every job must stop at the break with the same result */
+static int run_batch_check(const Check *check)
+{
+    char  rom[sizeof(CHECK_TEMP)] = "", input[sizeof(CHECK_TEMP)] = "", manifest[sizeof(CHECK_TEMP)] = "";
+    char  jobs[CHECK_JOBS * 128], line[256], first[256] = "";
+    char *result;
+    FILE *results = NULL;
+    int   saved = -1, status = -1, count = 0, failed = 0;
+    int   i;
+
+    if (write_temp(rom, check->code, check->size) < 0 || write_temp(input, check->input, strlen(check->input)) < 0) goto done;
+    for (i = 0, *jobs = '\0'; i < CHECK_JOBS; i++)
+        snprintf(jobs + strlen(jobs), sizeof(jobs) - strlen(jobs), "%s r=%04X b=%04X c=%d in=%s out=/dev/null\n", rom, CHECK_ORIGIN,
+                 check->break_pc, CHECK_CYCLES, input);
+    if (write_temp(manifest, jobs, strlen(jobs)) < 0) goto done;
+
+    /* The batch prints its result lines on stdout; catch them in a file */
+    fflush(stdout);
+    if ((results = tmpfile()) == NULL || (saved = dup(STDOUT_FILENO)) < 0 || dup2(fileno(results), STDOUT_FILENO) < 0) goto done;
+    status = run_batch(manifest, CHECK_WORKER, 0, CHECK_FIFO);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    rewind(results);
+    while (fgets(line, sizeof(line), results)) {
+        result = strchr(line, ':') ? strchr(line, ':') + 1 : line; // Past the line number and ROM name
+        if (count++ == 0) snprintf(first, sizeof(first), "%s", result);
+        if (strcmp(result, first) == 0) continue;
+        if (!failed) printf("%s batch FAIL\n    job 1:%s", check->name, first);
+        printf("    job %d:%s", count, result);
+        failed = -1;
+    }
+done:
+    if (saved >= 0) close(saved);
+    if (results) fclose(results);
+    if (*rom) unlink(rom);
+    if (*input) unlink(input);
+    if (*manifest) unlink(manifest);
+    if (failed) return -1;
+    if (status != 0 || count != CHECK_JOBS || strncmp(first, " break at", 9) != 0) {
+        printf("%s batch FAIL  the jobs do not all reach the break\n", check->name);
+        return -1;
+    }
+    printf("%s batch ok\n", check->name);
+    return 0;
+}
+
+/* Program entry */
+int main(void)
+{
+    Jit   *jit    = create_jit();
+    int    cores  = jit ? NUM_CORES : CORE_JIT; // Native translation only exists on x86-64 hosts
+    int    failed = 0;
+    size_t i;
+
+    free_jit(jit);
+    for (i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        failed |= run_checks(&checks[i], cores);
+        if (checks[i].input) failed |= run_batch_check(&checks[i]);
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,1096 @@
+/*
+ *
+ *      jit.c
+ *      x86-64 translation of hot basic blocks
+ *
+ *      2024/12/13 By MicroFish
+ *      Based on MIT open source agreement
+ *      Copyright © 2020 ViudiraTech, based on the MIT agreement.
+ *
+ */
+
+#define INCLUDE
+#include "6502.h"
+#include "jit.h"
+
+#if defined(__x86_64__)
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+#define JIT_FAILED UINT32_MAX // Index entry of a block that cannot be translated
+
+/* Operations of the instruction list */
+typedef enum {
+    J_ADC, J_AND, J_ASL, J_BCC, J_BCS, J_BEQ, J_BIT, J_BMI, J_BNE, J_BPL, J_BRK, J_BVC, J_BVS, J_CLC,
+    J_CLD, J_CLI, J_CLV, J_CMP, J_CPX, J_CPY, J_DEC, J_DEX, J_DEY, J_EOR, J_INC, J_INX, J_INY, J_JMP,
+    J_JSR, J_LDA, J_LDX, J_LDY, J_LSR, J_NOP, J_ORA, J_PHA, J_PHP, J_PLA, J_PLP, J_ROL, J_ROR, J_RTI,
+    J_RTS, J_SBC, J_SEC, J_SED, J_SEI, J_STA, J_STX, J_STY, J_TAX, J_TAY, J_TSX, J_TXA, J_TXS, J_TYA,
+} JitOp;
+
+/* Operation, addressing mode and base cycles of an opcode */
+typedef struct {
+        JitOp   op;
+        Mode    mode;
+        uint8_t cycles;
+} JitInst;
+
+#define JIT_ENTRY(opcode, mnemonic, name, mode, cycles) [opcode] = {J_##name, mode, cycles},
+static const JitInst jit_insts[0x100] = {INSTRUCTION_LIST(JIT_ENTRY)};
+
+/* Translated block, followed by its native code */
+typedef struct {
+        uint16_t cycles; // Most cycles one pass through the block takes
+        uint16_t bytes;  // Bytes of 6502 code it covers
+        uint32_t entry;  // Offset of the native entry point from the block
+        uint32_t body;   // Offset of its first instruction, entered by other translations, from the block
+} JitBlock;
+
+/* Translations of one machine */
+struct Jit {
+        uint8_t *code;           // Executable buffer holding the translations
+        size_t   used;           // Bytes of it in use
+        uint32_t entry[0x10000]; // Offset of the translation of the block starting at each address plus one, 0 if none
+        uint8_t  heat[0x10000];  // Entries of each untranslated block, up to JIT_HOT
+        bool     dropped;        // Set when translations were dropped, so the running one may be gone
+};
+
+/* Host registers; the 6502 state lives in callee-saved ones, so helper calls only spill the caller-saved rest */
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+#define R_CPU   RBX // Machine
+#define R_A     R12 // Accumulator
+#define R_X     R13 // X register
+#define R_Y     R14 // Y register
+#define R_NRES  R15 // Last result, whose bit 7 is the sign flag
+#define R_ZRES  RBP // Last result, zero when the zero flag is set
+#define R_C     R8  // Carry flag, 0 or 1
+#define R_V     R9  // Overflow flag, 0 or 1
+#define R_SP    R10 // Stack pointer
+#define R_EXTRA R11 // Page crossing cycles of the current pass
+#define NONE    -1  // No index register
+
+/* ALU operations, as the /digit of the immediate forms */
+enum { ADD = 0, OR = 1, AND = 4, SUB = 5, XOR = 6, CMP = 7 };
+
+/* Shift operations, as the /digit of the immediate forms */
+enum { SHL = 4, SHR = 5 };
+
+/* Condition codes */
+enum { CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7 };
+
+/* Status register bits kept in memory while translated code runs */
+#define SR_KEPT (SR_INTERRUPT | SR_DECIMAL | SR_BRK | SR_UNUSED)
+
+/* Stack frame of translated code: the cycle counts a pass has to stay under to loop back and to chain to another block */
+#define FRAME_LOOP  0
+#define FRAME_CHAIN 8
+#define FRAME_SIZE  24 // Keeps the stack aligned for helper calls after the six saved registers
+
+/* Flag next to the byte returned by the read helper when the device made an interrupt or event due */
+#define JIT_INTERRUPT 0x100
+
+/* Native code of one block being emitted */
+typedef struct {
+        Jit     *jit;      // Translations the block joins
+        uint8_t *buf;      // Start of the code
+        size_t   len;      // Bytes emitted
+        size_t   epilogue; // Offset of the code storing the state back
+        size_t   body;     // Offset of the first instruction
+        uint16_t start;    // Address of the block
+        uint16_t max;      // Most cycles of one pass
+        uint16_t at;       // Base cycles before the current instruction
+        uint16_t cycles;   // Base cycles up to the end of the current instruction
+        uint16_t count;    // Instructions up to the end of the current instruction
+        uint16_t next;     // Address after the current instruction
+} Emitter;
+
+/* ↓Encoding↓ */
+
+static void emit8(Emitter *e, uint8_t val)
+{
+    e->buf[e->len++] = val;
+}
+
+static void emit32(Emitter *e, uint32_t val)
+{
+    memcpy(&e->buf[e->len], &val, sizeof(val));
+    e->len += sizeof(val);
+}
+
+static void emit64(Emitter *e, uint64_t val)
+{
+    memcpy(&e->buf[e->len], &val, sizeof(val));
+    e->len += sizeof(val);
+}
+
+/* REX prefix, left out when empty unless a byte register needs it */
+static void emit_rex(Emitter *e, int w, int reg, int index, int rm, int byte)
+{
+    uint8_t rex = 0x40 | w << 3 | (reg & 8) >> 1 | (index & 8) >> 2 | (rm & 8) >> 3;
+    if (rex != 0x40 || byte) emit8(e, rex);
+}
+
+/* Opcode of one or two bytes */
+static void emit_opcode(Emitter *e, uint16_t opcode)
+{
+    if (opcode > 0xFF) emit8(e, opcode >> 8);
+    emit8(e, opcode & 0xFF);
+}
+
+/* Instruction with a register operand and a register or /digit operand */
+static void emit_rr(Emitter *e, int w, int byte, uint16_t opcode, int reg, int rm)
+{
+    emit_rex(e, w, reg, 0, rm, byte);
+    emit_opcode(e, opcode);
+    emit8(e, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* Instruction with a register or /digit operand and the memory operand [base + index * (1 << scale) + disp] */
+static void emit_mem(Emitter *e, int w, int byte, uint16_t opcode, int reg, int base, int index, int scale, int32_t disp)
+{
+    emit_rex(e, w, reg, index == NONE ? 0 : index, base, byte);
+    emit_opcode(e, opcode);
+    if (index == NONE && (base & 7) != RSP) {
+        emit8(e, 0x80 | (reg & 7) << 3 | (base & 7));
+    } else {
+        emit8(e, 0x80 | (reg & 7) << 3 | RSP);
+        emit8(e, scale << 6 | (index == NONE ? RSP : index & 7) << 3 | (base & 7));
+    }
+    emit32(e, disp);
+}
+
+/* Instruction with a register or /digit operand and the memory operand [cpu + index * (1 << scale) + disp] */
+static void emit_rm(Emitter *e, int w, int byte, uint16_t opcode, int reg, int index, int scale, int32_t disp)
+{
+    emit_mem(e, w, byte, opcode, reg, R_CPU, index, scale, disp);
+}
+
+static void mov_rr(Emitter *e, int dst, int src)
+{
+    emit_rr(e, 0, 0, 0x89, src, dst);
+}
+
+static void mov_ri(Emitter *e, int dst, uint32_t imm)
+{
+    emit_rex(e, 0, 0, 0, dst, 0);
+    emit8(e, 0xB8 | (dst & 7));
+    emit32(e, imm);
+}
+
+static void mov_ri64(Emitter *e, int dst, uint64_t imm)
+{
+    emit_rex(e, 1, 0, 0, dst, 0);
+    emit8(e, 0xB8 | (dst & 7));
+    emit64(e, imm);
+}
+
+static void alu_rr(Emitter *e, int alu, int dst, int src)
+{
+    emit_rr(e, 0, 0, alu << 3 | 1, src, dst);
+}
+
+static void alu_ri(Emitter *e, int alu, int dst, uint32_t imm)
+{
+    if ((int32_t)imm == (int8_t)imm) {
+        emit_rr(e, 0, 0, 0x83, alu, dst);
+        emit8(e, imm);
+    } else {
+        emit_rr(e, 0, 0, 0x81, alu, dst);
+        emit32(e, imm);
+    }
+}
+
+static void shift_ri(Emitter *e, int shift, int dst, uint8_t count)
+{
+    emit_rr(e, 0, 0, 0xC1, shift, dst);
+    emit8(e, count);
+}
+
+static void test_rr(Emitter *e, int dst, int src)
+{
+    emit_rr(e, 0, 0, 0x85, src, dst);
+}
+
+static void test_ri(Emitter *e, int dst, uint32_t imm)
+{
+    emit_rr(e, 0, 0, 0xF7, 0, dst);
+    emit32(e, imm);
+}
+
+static void not_r(Emitter *e, int dst)
+{
+    emit_rr(e, 0, 0, 0xF7, 2, dst);
+}
+
+static void setcc(Emitter *e, int cc, int dst)
+{
+    emit_rr(e, 0, 1, 0x0F90 | cc, 0, dst);
+}
+
+/* Zero extend the low byte of a register */
+static void movzx_rr(Emitter *e, int dst, int src)
+{
+    emit_rr(e, 0, 1, 0x0FB6, dst, src);
+}
+
+/* Load a zero extended byte of the machine */
+static void load8(Emitter *e, int dst, int index, int32_t disp)
+{
+    emit_rm(e, 0, 0, 0x0FB6, dst, index, 0, disp);
+}
+
+/* Store the low byte of a register into the machine */
+static void store8(Emitter *e, int src, int index, int32_t disp)
+{
+    emit_rm(e, 0, 1, 0x88, src, index, 0, disp);
+}
+
+/* Store a constant byte into the machine */
+static void store8_i(Emitter *e, int index, int32_t disp, uint8_t imm)
+{
+    emit_rm(e, 0, 0, 0xC6, 0, index, 0, disp);
+    emit8(e, imm);
+}
+
+/* ALU operation on a byte of the machine and a constant */
+static void alu_mi8(Emitter *e, int alu, int index, int32_t disp, uint8_t imm)
+{
+    emit_rm(e, 0, 0, 0x80, alu, index, 0, disp);
+    emit8(e, imm);
+}
+
+/* Compare a pointer of the machine with NULL */
+static void test_ptr(Emitter *e, int index, int32_t disp)
+{
+    emit_rm(e, 1, 0, 0x83, CMP, index, 3, disp);
+    emit8(e, 0);
+}
+
+static void push_r(Emitter *e, int reg)
+{
+    emit_rex(e, 0, 0, 0, reg, 0);
+    emit8(e, 0x50 | (reg & 7));
+}
+
+static void pop_r(Emitter *e, int reg)
+{
+    emit_rex(e, 0, 0, 0, reg, 0);
+    emit8(e, 0x58 | (reg & 7));
+}
+
+/* Conditional jump to a later label, returning where to patch it */
+static size_t jcc(Emitter *e, int cc)
+{
+    emit8(e, 0x0F);
+    emit8(e, 0x80 | cc);
+    emit32(e, 0);
+    return e->len;
+}
+
+/* Jump to a later label, returning where to patch it */
+static size_t jmp(Emitter *e)
+{
+    emit8(e, 0xE9);
+    emit32(e, 0);
+    return e->len;
+}
+
+/* Jump to an earlier label */
+static void jmp_to(Emitter *e, size_t label)
+{
+    emit8(e, 0xE9);
+    emit32(e, (uint32_t)(label - (e->len + 4)));
+}
+
+/* Conditional jump to an earlier label */
+static void jcc_to(Emitter *e, int cc, size_t label)
+{
+    emit8(e, 0x0F);
+    emit8(e, 0x80 | cc);
+    emit32(e, (uint32_t)(label - (e->len + 4)));
+}
+
+/* Point a jump at the current position */
+static void patch(Emitter *e, size_t at)
+{
+    uint32_t rel = (uint32_t)(e->len - at);
+    memcpy(&e->buf[at - 4], &rel, sizeof(rel));
+}
+
+/* ↓Helpers called from translated code↓ */
+
+/* Read a byte through the device of its page, with JIT_INTERRUPT set if the device made an interrupt or event due; the device sees
+   the cycle count at the start of the instruction, elapsed cycles into the pass */
+static int jit_read(CPUMAP *cpu, uint16_t addr, unsigned int elapsed)
+{
+    int val;
+
+    cpu->total_cycles += elapsed;
+    val = read_byte(cpu, addr) | (interrupt_pending(cpu) ? JIT_INTERRUPT : 0);
+    cpu->total_cycles -= elapsed;
+    return val;
+}
+
+/* Write a byte through a device or onto predecoded code, returning whether translated code was dropped or an interrupt or event is
+   due; like jit_read, elapsed cycles into the pass */
+static int jit_write(CPUMAP *cpu, uint16_t addr, uint8_t val, unsigned int elapsed)
+{
+    cpu->jit->dropped = 0;
+    cpu->total_cycles += elapsed;
+    write_byte(cpu, addr, val);
+    cpu->total_cycles -= elapsed;
+    return cpu->jit->dropped || interrupt_pending(cpu);
+}
+
+/* Call a helper with the machine as first argument and the cycles of the pass before the current instruction in arg, keeping the
+   6502 state of caller-saved registers */
+static void emit_call(Emitter *e, void *function, int arg)
+{
+    static const int saved[] = {RCX, RDX, R8, R9, R10, R11};
+    int              i;
+
+    for (i = 0; i < 6; i++) push_r(e, saved[i]);
+    emit_rr(e, 1, 0, 0x89, R_CPU, RDI);
+    mov_ri(e, arg, e->at);
+    alu_rr(e, ADD, arg, R_EXTRA);
+    emit8(e, 0x48);
+    emit8(e, 0xB8);
+    emit64(e, (uint64_t)(uintptr_t)function);
+    emit8(e, 0xFF);
+    emit8(e, 0xD0);
+    for (i = 5; i >= 0; i--) pop_r(e, saved[i]);
+}
+
+/* ↓Block structure↓ */
+
+/* Pack the flags into eax as a status register byte, using edx */
+static void emit_pack(Emitter *e)
+{
+    load8(e, RAX, NONE, offsetof(CPUMAP, SR));
+    alu_ri(e, AND, RAX, SR_KEPT);
+    alu_rr(e, OR, RAX, R_C);
+    alu_rr(e, XOR, RDX, RDX);
+    test_rr(e, R_ZRES, R_ZRES);
+    setcc(e, CC_E, RDX);
+    shift_ri(e, SHL, RDX, 1);
+    alu_rr(e, OR, RAX, RDX);
+    mov_rr(e, RDX, R_V);
+    shift_ri(e, SHL, RDX, 6);
+    alu_rr(e, OR, RAX, RDX);
+    mov_rr(e, RDX, R_NRES);
+    alu_ri(e, AND, RDX, SR_SIGN);
+    alu_rr(e, OR, RAX, RDX);
+}
+
+/* Store the state back and return, given the PC in edx */
+static void emit_epilogue(Emitter *e)
+{
+    static const int saved[] = {RBX, RBP, R12, R13, R14, R15};
+    int              i;
+
+    e->epilogue = e->len;
+    emit8(e, 0x66);
+    emit_rm(e, 0, 0, 0x89, RDX, NONE, 0, offsetof(CPUMAP, PC));
+    store8(e, R_A, NONE, offsetof(CPUMAP, A));
+    store8(e, R_X, NONE, offsetof(CPUMAP, X));
+    store8(e, R_Y, NONE, offsetof(CPUMAP, Y));
+    store8(e, R_SP, NONE, offsetof(CPUMAP, SP));
+    emit_pack(e);
+    store8(e, RAX, NONE, offsetof(CPUMAP, SR));
+    emit_rr(e, 1, 0, 0x83, ADD, RSP);
+    emit8(e, FRAME_SIZE);
+    for (i = 5; i >= 0; i--) pop_r(e, saved[i]);
+    emit8(e, 0xC3);
+}
+
+/* Load the state, given the machine in rdi and the cycle counts to stay under to loop back in rsi and to chain in rdx */
+static void emit_prologue(Emitter *e)
+{
+    static const int saved[] = {RBX, RBP, R12, R13, R14, R15};
+    int              i;
+
+    for (i = 0; i < 6; i++) push_r(e, saved[i]);
+    emit_rr(e, 1, 0, 0x83, SUB, RSP);
+    emit8(e, FRAME_SIZE);
+    emit_mem(e, 1, 0, 0x89, RSI, RSP, NONE, 0, FRAME_LOOP);
+    emit_mem(e, 1, 0, 0x89, RDX, RSP, NONE, 0, FRAME_CHAIN);
+    emit_rr(e, 1, 0, 0x89, RDI, R_CPU);
+    load8(e, R_A, NONE, offsetof(CPUMAP, A));
+    load8(e, R_X, NONE, offsetof(CPUMAP, X));
+    load8(e, R_Y, NONE, offsetof(CPUMAP, Y));
+    load8(e, R_SP, NONE, offsetof(CPUMAP, SP));
+    load8(e, RAX, NONE, offsetof(CPUMAP, SR));
+    mov_rr(e, R_C, RAX);
+    alu_ri(e, AND, R_C, 1);
+    mov_rr(e, R_V, RAX);
+    shift_ri(e, SHR, R_V, 6);
+    alu_ri(e, AND, R_V, 1);
+    mov_rr(e, R_NRES, RAX);
+    alu_ri(e, AND, R_NRES, SR_SIGN);
+    mov_rr(e, R_ZRES, RAX);
+    alu_ri(e, AND, R_ZRES, SR_ZERO);
+    alu_ri(e, XOR, R_ZRES, SR_ZERO);
+    alu_rr(e, XOR, R_EXTRA, R_EXTRA);
+}
+
+/* Add the base cycles and instructions of the way to an exit and the extra cycles of the pass to the totals */
+static void emit_commit(Emitter *e, uint16_t cycles, uint16_t count)
+{
+    mov_ri(e, RAX, cycles);
+    emit_rr(e, 1, 0, 0x01, R_EXTRA, RAX);
+    emit_rm(e, 1, 0, 0x01, RAX, NONE, 0, offsetof(CPUMAP, total_cycles));
+    mov_ri(e, RSI, count);
+    emit_rm(e, 1, 0, 0x01, RSI, NONE, 0, offsetof(CPUMAP, total_instructions));
+    alu_rr(e, XOR, R_EXTRA, R_EXTRA);
+}
+
+/* Go on at the PC in edx: in its translation if there is one whose pass fits under the chaining cycle count, else in the interpreter */
+static void emit_chain(Emitter *e)
+{
+    size_t none, over;
+
+    mov_ri64(e, RAX, (uintptr_t)e->jit->entry);
+    emit_mem(e, 0, 0, 0x8B, RAX, RAX, RDX, 2, 0);
+    alu_ri(e, SUB, RAX, 1);
+    alu_ri(e, CMP, RAX, JIT_FAILED - 1);
+    none = jcc(e, CC_AE);
+    mov_ri64(e, RCX, (uintptr_t)e->jit->code);
+    emit_rr(e, 1, 0, 0x01, RAX, RCX);
+    emit_mem(e, 0, 0, 0x0FB7, RAX, RCX, NONE, 0, offsetof(JitBlock, cycles));
+    emit_rm(e, 1, 0, 0x03, RAX, NONE, 0, offsetof(CPUMAP, total_cycles));
+    emit_mem(e, 1, 0, 0x3B, RAX, RSP, NONE, 0, FRAME_CHAIN);
+    over = jcc(e, CC_A);
+    emit_mem(e, 0, 0, 0x8B, RAX, RCX, NONE, 0, offsetof(JitBlock, body));
+    emit_rr(e, 1, 0, 0x01, RAX, RCX);
+    emit_rr(e, 0, 0, 0xFF, 4, RCX); // jmp rcx
+    patch(e, none);
+    patch(e, over);
+    jmp_to(e, e->epilogue);
+}
+
+/* Leave the block for an address, given the base cycles and instructions of the way there */
+static void emit_exit(Emitter *e, uint16_t pc, uint16_t cycles, uint16_t count)
+{
+    emit_commit(e, cycles, count);
+    if (pc == e->start) {
+        /* Loop straight back while another pass fits under the cycle count */
+        emit_rm(e, 1, 0, 0x8B, RAX, NONE, 0, offsetof(CPUMAP, total_cycles));
+        emit_rr(e, 1, 0, 0x81, ADD, RAX);
+        emit32(e, e->max);
+        emit_mem(e, 1, 0, 0x3B, RAX, RSP, NONE, 0, FRAME_LOOP);
+        jcc_to(e, CC_BE, e->body);
+    }
+    mov_ri(e, RDX, pc);
+    emit_chain(e);
+}
+
+/* ↓Memory access↓ */
+
+/* Read the byte at the address in esi into eax through the helper; an interrupt it made due ends the run at the block's exit */
+static void read_slow(Emitter *e)
+{
+    size_t quiet;
+
+    emit_call(e, jit_read, RDX);
+    test_ri(e, RAX, JIT_INTERRUPT);
+    quiet = jcc(e, CC_E);
+    emit_mem(e, 1, 0, 0xC7, 0, RSP, NONE, 0, FRAME_LOOP);
+    emit32(e, 0);
+    emit_mem(e, 1, 0, 0xC7, 0, RSP, NONE, 0, FRAME_CHAIN);
+    emit32(e, 0);
+    patch(e, quiet);
+    movzx_rr(e, RAX, RAX);
+}
+
+/* Read the byte at a constant address into eax */
+static void read_const(Emitter *e, uint16_t addr)
+{
+    size_t slow, done;
+
+    test_ptr(e, NONE, offsetof(CPUMAP, io_read) + (addr >> 8) * sizeof(IoRead));
+    slow = jcc(e, CC_NE);
+    load8(e, RAX, NONE, addr);
+    done = jmp(e);
+    patch(e, slow);
+    mov_ri(e, RSI, addr);
+    read_slow(e);
+    patch(e, done);
+}
+
+/* Read the byte at the address in ecx into eax */
+static void read_dynamic(Emitter *e)
+{
+    size_t slow, done;
+
+    mov_rr(e, RAX, RCX);
+    shift_ri(e, SHR, RAX, 8);
+    test_ptr(e, RAX, offsetof(CPUMAP, io_read));
+    slow = jcc(e, CC_NE);
+    load8(e, RAX, RCX, 0);
+    done = jmp(e);
+    patch(e, slow);
+    mov_rr(e, RSI, RCX);
+    read_slow(e);
+    patch(e, done);
+}
+
+/* Write edx to the address in esi through the helper, returning to the interpreter if that dropped translated code or made an
+   interrupt due */
+static void write_slow(Emitter *e)
+{
+    size_t kept;
+
+    emit_call(e, jit_write, RCX);
+    test_rr(e, RAX, RAX);
+    kept = jcc(e, CC_E);
+    emit_commit(e, e->cycles, e->count);
+    mov_ri(e, RDX, e->next);
+    jmp_to(e, e->epilogue);
+    patch(e, kept);
+}
+
+/* Write edx to a constant address */
+static void write_const(Emitter *e, uint16_t addr)
+{
+    size_t device, code, done;
+
+    test_ptr(e, NONE, offsetof(CPUMAP, io_write) + (addr >> 8) * sizeof(IoWrite));
+    device = jcc(e, CC_NE);
+    alu_mi8(e, CMP, NONE, offsetof(CPUMAP, code_pages) + (addr >> 8), 0);
+    code = jcc(e, CC_NE);
+    store8(e, RDX, NONE, addr);
+    store8_i(e, NONE, offsetof(CPUMAP, dirty_pages) + (addr >> 8), 1);
+    done = jmp(e);
+    patch(e, device);
+    patch(e, code);
+    mov_ri(e, RSI, addr);
+    write_slow(e);
+    patch(e, done);
+}
+
+/* Write edx to the address in ecx */
+static void write_dynamic(Emitter *e)
+{
+    size_t device, code, done;
+
+    mov_rr(e, RAX, RCX);
+    shift_ri(e, SHR, RAX, 8);
+    test_ptr(e, RAX, offsetof(CPUMAP, io_write));
+    device = jcc(e, CC_NE);
+    alu_mi8(e, CMP, RAX, offsetof(CPUMAP, code_pages), 0);
+    code = jcc(e, CC_NE);
+    store8(e, RDX, RCX, 0);
+    store8_i(e, RAX, offsetof(CPUMAP, dirty_pages), 1);
+    done = jmp(e);
+    patch(e, device);
+    patch(e, code);
+    mov_rr(e, RSI, RCX);
+    write_slow(e);
+    patch(e, done);
+}
+
+/* Add a cycle when the low address byte plus an index register crosses a page */
+static void emit_cross(Emitter *e, int index, uint8_t low)
+{
+    alu_ri(e, CMP, index, 0xFF - low);
+    setcc(e, CC_A, RAX);
+    movzx_rr(e, RAX, RAX);
+    alu_rr(e, ADD, R_EXTRA, RAX);
+}
+
+/* Compute the effective address of a memory operand: return it if constant, else leave it in ecx and return -1 */
+static int emit_address(Emitter *e, Mode mode, uint16_t operand, bool cross)
+{
+    int index = (mode == ABSY || mode == ZPY) ? R_Y : R_X;
+
+    switch (mode) {
+        case IMPL :
+            return 0;
+        case ZP :
+            return operand & 0xFF;
+        case ABS :
+            return operand;
+        case ZPX :
+        case ZPY :
+            mov_rr(e, RCX, index);
+            alu_ri(e, ADD, RCX, operand & 0xFF);
+            alu_ri(e, AND, RCX, 0xFF);
+            return -1;
+        case ABSX :
+        case ABSY :
+            if (cross) emit_cross(e, index, operand & 0xFF);
+            mov_rr(e, RCX, index);
+            alu_ri(e, ADD, RCX, operand);
+            alu_ri(e, AND, RCX, 0xFFFF);
+            return -1;
+        case XIND :
+            mov_rr(e, RAX, R_X);
+            alu_ri(e, ADD, RAX, operand & 0xFF);
+            alu_ri(e, AND, RAX, 0xFF);
+            load8(e, RCX, RAX, 0);
+            alu_ri(e, ADD, RAX, 1);
+            alu_ri(e, AND, RAX, 0xFF);
+            load8(e, RDX, RAX, 0);
+            shift_ri(e, SHL, RDX, 8);
+            alu_rr(e, OR, RCX, RDX);
+            return -1;
+        case INDY :
+            load8(e, RCX, NONE, operand & 0xFF);
+            load8(e, RDX, NONE, (operand + 1) & 0xFF);
+            shift_ri(e, SHL, RDX, 8);
+            alu_rr(e, OR, RCX, RDX);
+            if (cross) {
+                movzx_rr(e, RAX, RCX);
+                alu_rr(e, ADD, RAX, R_Y);
+                alu_ri(e, CMP, RAX, 0xFF);
+                setcc(e, CC_A, RAX);
+                movzx_rr(e, RAX, RAX);
+                alu_rr(e, ADD, R_EXTRA, RAX);
+            }
+            alu_rr(e, ADD, RCX, R_Y);
+            alu_ri(e, AND, RCX, 0xFFFF);
+            return -1;
+        default :
+            return 0;
+    }
+}
+
+/* Read the operand of an instruction into eax */
+static void emit_load(Emitter *e, JitInst inst, uint16_t operand, bool cross)
+{
+    int addr;
+
+    if (inst.mode == ACC) {
+        mov_rr(e, RAX, R_A);
+    } else if (inst.mode == IMM) {
+        mov_ri(e, RAX, operand & 0xFF);
+    } else {
+        addr = emit_address(e, inst.mode, operand, cross);
+        if (addr < 0)
+            read_dynamic(e);
+        else
+            read_const(e, addr);
+    }
+}
+
+/* Write edx to an effective address returned by emit_address */
+static void emit_store(Emitter *e, int addr)
+{
+    if (addr < 0)
+        write_dynamic(e);
+    else
+        write_const(e, addr);
+}
+
+/* Record a result for the sign and zero flags */
+static void emit_nz(Emitter *e, int reg)
+{
+    mov_rr(e, R_NRES, reg);
+    mov_rr(e, R_ZRES, reg);
+}
+
+/* Push the low byte of a register or, given NONE, a constant */
+static void emit_push(Emitter *e, int reg, uint8_t imm)
+{
+    if (reg == NONE)
+        store8_i(e, R_SP, 0x100, imm);
+    else
+        store8(e, reg, R_SP, 0x100);
+    alu_ri(e, SUB, R_SP, 1);
+    alu_ri(e, AND, R_SP, 0xFF);
+    store8_i(e, NONE, offsetof(CPUMAP, dirty_pages) + 1, 1);
+}
+
+/* Pull a byte into a register */
+static void emit_pull(Emitter *e, int reg)
+{
+    alu_ri(e, ADD, R_SP, 1);
+    alu_ri(e, AND, R_SP, 0xFF);
+    load8(e, reg, R_SP, 0x100);
+}
+
+/* Whether an instruction can be translated */
+static bool translatable(CPUMAP *cpu, uint16_t pc, uint8_t opcode)
+{
+    JitInst inst = jit_insts[opcode];
+
+    switch (inst.op) {
+        case J_BRK :
+        case J_RTI :
+        case J_PLP :
+        case J_CLI :
+        case J_SED :
+        case J_CLD :
+            return 0; // Leave interrupts, unmasking them and the decimal flag to the interpreter
+        default :
+            /* Immediate operands are read through the I/O map, which translated code takes as plain memory */
+            return inst.mode != JMP_IND_BUG && !(inst.mode == IMM && cpu->io_read[(uint16_t)(pc + 1) >> 8]);
+    }
+}
+
+/* Emit one instruction, returning 1 if it always leaves the block */
+static int emit_inst(Emitter *e, uint16_t pc, uint8_t opcode, uint16_t operand)
+{
+    JitInst inst  = jit_insts[opcode];
+    bool    cross = (inst.mode == ABSX || inst.mode == ABSY || inst.mode == INDY) && inst.op != J_STA && inst.cycles != 7;
+    int     reg, cc, addr;
+
+    switch (inst.op) {
+        case J_LDA :
+        case J_LDX :
+        case J_LDY :
+            reg = inst.op == J_LDA ? R_A : inst.op == J_LDX ? R_X : R_Y;
+            emit_load(e, inst, operand, cross);
+            mov_rr(e, reg, RAX);
+            emit_nz(e, reg);
+            break;
+        case J_STA :
+        case J_STX :
+        case J_STY :
+            addr = emit_address(e, inst.mode, operand, 0);
+            mov_rr(e, RDX, inst.op == J_STA ? R_A : inst.op == J_STX ? R_X : R_Y);
+            emit_store(e, addr);
+            break;
+        case J_AND :
+        case J_ORA :
+        case J_EOR :
+            emit_load(e, inst, operand, cross);
+            alu_rr(e, inst.op == J_AND ? AND : inst.op == J_ORA ? OR : XOR, R_A, RAX);
+            emit_nz(e, R_A);
+            break;
+        case J_ADC :
+            emit_load(e, inst, operand, cross);
+            mov_rr(e, RCX, R_A);
+            alu_rr(e, ADD, RCX, RAX);
+            alu_rr(e, ADD, RCX, R_C);
+            mov_rr(e, RDX, R_A);
+            alu_rr(e, XOR, RDX, RCX);
+            alu_rr(e, XOR, RAX, RCX);
+            alu_rr(e, AND, RAX, RDX);
+            shift_ri(e, SHR, RAX, 7);
+            alu_ri(e, AND, RAX, 1);
+            mov_rr(e, R_V, RAX);
+            mov_rr(e, R_C, RCX);
+            shift_ri(e, SHR, R_C, 8);
+            movzx_rr(e, R_A, RCX);
+            emit_nz(e, R_A);
+            break;
+        case J_SBC :
+            emit_load(e, inst, operand, cross);
+            mov_rr(e, RCX, R_A);
+            alu_rr(e, SUB, RCX, RAX);
+            alu_rr(e, ADD, RCX, R_C);
+            alu_ri(e, SUB, RCX, 1);
+            mov_rr(e, RDX, R_A);
+            alu_rr(e, XOR, RDX, RCX);
+            alu_rr(e, XOR, RAX, R_A);
+            alu_rr(e, AND, RAX, RDX);
+            shift_ri(e, SHR, RAX, 7);
+            alu_ri(e, AND, RAX, 1);
+            mov_rr(e, R_V, RAX);
+            mov_rr(e, R_C, RCX);
+            not_r(e, R_C);
+            shift_ri(e, SHR, R_C, 31);
+            movzx_rr(e, R_A, RCX);
+            emit_nz(e, R_A);
+            break;
+        case J_CMP :
+        case J_CPX :
+        case J_CPY :
+            reg = inst.op == J_CMP ? R_A : inst.op == J_CPX ? R_X : R_Y;
+            emit_load(e, inst, operand, cross);
+            mov_rr(e, RCX, reg);
+            alu_rr(e, SUB, RCX, RAX);
+            alu_ri(e, AND, RCX, 0xFF);
+            emit_nz(e, RCX);
+            alu_rr(e, XOR, R_C, R_C);
+            alu_rr(e, CMP, reg, RAX);
+            setcc(e, CC_AE, R_C);
+            break;
+        case J_BIT :
+            emit_load(e, inst, operand, cross);
+            mov_rr(e, R_NRES, RAX);
+            mov_rr(e, R_ZRES, RAX);
+            alu_rr(e, AND, R_ZRES, R_A);
+            shift_ri(e, SHR, RAX, 6);
+            alu_ri(e, AND, RAX, 1);
+            mov_rr(e, R_V, RAX);
+            break;
+        case J_NOP :
+            if (inst.mode != IMM) emit_load(e, inst, operand, cross);
+            break;
+        case J_ASL :
+        case J_LSR :
+        case J_ROL :
+        case J_ROR :
+        case J_INC :
+        case J_DEC :
+            addr = inst.mode == ACC ? 0 : emit_address(e, inst.mode, operand, 0);
+            if (inst.mode == ACC)
+                mov_rr(e, RAX, R_A);
+            else if (addr < 0)
+                read_dynamic(e);
+            else
+                read_const(e, addr);
+            if (inst.op == J_ASL) {
+                mov_rr(e, R_C, RAX);
+                shift_ri(e, SHR, R_C, 7);
+                shift_ri(e, SHL, RAX, 1);
+            } else if (inst.op == J_LSR) {
+                mov_rr(e, R_C, RAX);
+                alu_ri(e, AND, R_C, 1);
+                shift_ri(e, SHR, RAX, 1);
+            } else if (inst.op == J_ROL) {
+                shift_ri(e, SHL, RAX, 1);
+                alu_rr(e, OR, RAX, R_C);
+                mov_rr(e, R_C, RAX);
+                shift_ri(e, SHR, R_C, 8);
+            } else if (inst.op == J_ROR) {
+                mov_rr(e, RDX, R_C);
+                shift_ri(e, SHL, RDX, 8);
+                alu_rr(e, OR, RAX, RDX);
+                mov_rr(e, R_C, RAX);
+                alu_ri(e, AND, R_C, 1);
+                shift_ri(e, SHR, RAX, 1);
+            } else {
+                alu_ri(e, inst.op == J_INC ? ADD : SUB, RAX, 1);
+            }
+            alu_ri(e, AND, RAX, 0xFF);
+            emit_nz(e, RAX);
+            if (inst.mode == ACC) {
+                mov_rr(e, R_A, RAX);
+            } else {
+                mov_rr(e, RDX, RAX);
+                emit_store(e, addr);
+            }
+            break;
+        case J_INX :
+        case J_INY :
+        case J_DEX :
+        case J_DEY :
+            reg = (inst.op == J_INX || inst.op == J_DEX) ? R_X : R_Y;
+            alu_ri(e, (inst.op == J_INX || inst.op == J_INY) ? ADD : SUB, reg, 1);
+            alu_ri(e, AND, reg, 0xFF);
+            emit_nz(e, reg);
+            break;
+        case J_TAX :
+        case J_TAY :
+        case J_TXA :
+        case J_TYA :
+        case J_TSX :
+            reg = inst.op == J_TAX || inst.op == J_TSX ? R_X : inst.op == J_TAY ? R_Y : R_A;
+            mov_rr(e, reg, inst.op == J_TAX || inst.op == J_TAY ? R_A : inst.op == J_TXA ? R_X : inst.op == J_TYA ? R_Y : R_SP);
+            emit_nz(e, reg);
+            break;
+        case J_TXS :
+            mov_rr(e, R_SP, R_X);
+            break;
+        case J_CLC :
+            alu_rr(e, XOR, R_C, R_C);
+            break;
+        case J_SEC :
+            mov_ri(e, R_C, 1);
+            break;
+        case J_CLV :
+            alu_rr(e, XOR, R_V, R_V);
+            break;
+        case J_CLI :
+            alu_mi8(e, AND, NONE, offsetof(CPUMAP, SR), (uint8_t)~SR_INTERRUPT);
+            break;
+        case J_SEI :
+            alu_mi8(e, OR, NONE, offsetof(CPUMAP, SR), SR_INTERRUPT);
+            break;
+        case J_PHA :
+            emit_push(e, R_A, 0);
+            break;
+        case J_PHP :
+            emit_pack(e);
+            alu_ri(e, OR, RAX, SR_BRK);
+            emit_push(e, RAX, 0);
+            break;
+        case J_PLA :
+            emit_pull(e, R_A);
+            emit_nz(e, R_A);
+            break;
+        case J_BCC :
+        case J_BCS :
+        case J_BEQ :
+        case J_BNE :
+        case J_BMI :
+        case J_BPL :
+        case J_BVC :
+        case J_BVS : {
+            uint16_t ea = pc + (int8_t)operand;
+            size_t   skip;
+
+            /* Jump over the exit unless the branch is taken */
+            if (inst.op == J_BCC || inst.op == J_BCS)
+                test_rr(e, R_C, R_C);
+            else if (inst.op == J_BVC || inst.op == J_BVS)
+                test_rr(e, R_V, R_V);
+            else if (inst.op == J_BEQ || inst.op == J_BNE)
+                test_rr(e, R_ZRES, R_ZRES);
+            else
+                test_ri(e, R_NRES, SR_SIGN);
+            cc   = (inst.op == J_BCC || inst.op == J_BVC || inst.op == J_BEQ || inst.op == J_BPL) ? CC_NE : CC_E;
+            skip = jcc(e, cc);
+            emit_exit(e, ea + 2, e->cycles + 1 + (((ea ^ e->next) & 0xFF00) != 0), e->count);
+            patch(e, skip);
+            break;
+        }
+        case J_JMP :
+            emit_exit(e, operand, e->cycles, e->count);
+            return 1;
+        case J_JSR :
+            emit_push(e, NONE, (uint16_t)(pc + 2) >> 8);
+            emit_push(e, NONE, (pc + 2) & 0xFF);
+            emit_exit(e, operand, e->cycles, e->count);
+            return 1;
+        case J_RTS :
+            emit_pull(e, RDX);
+            emit_pull(e, RAX);
+            shift_ri(e, SHL, RAX, 8);
+            alu_rr(e, OR, RDX, RAX);
+            alu_ri(e, ADD, RDX, 1);
+            alu_ri(e, AND, RDX, 0xFFFF);
+            emit_commit(e, e->cycles, e->count);
+            emit_chain(e);
+            return 1;
+        default :
+            break;
+    }
+    return 0;
+}
+
+/* Translate the predecoded block at the PC, returning its index entry */
+static uint32_t translate(Jit *jit, CPUMAP *cpu, const BlockOp *op)
+{
+    JitBlock *block;
+    Emitter   e;
+    uint16_t  pc = cpu->PC;
+    int       num, last;
+
+    /* Size the block: it stops before the first instruction left to the interpreter */
+    memset(&e, 0, sizeof(e));
+    e.jit   = jit;
+    e.start = pc;
+    for (num = 0; op[num].length && translatable(cpu, pc, op[num].opcode); num++) {
+        e.max += jit_insts[op[num].opcode].cycles + 2;
+        pc += op[num].length;
+    }
+    if (num == 0) return JIT_FAILED;
+    if (jit->used + JIT_BLOCK > JIT_CODE_SIZE) jit_flush(jit);
+
+    block  = (JitBlock *)&jit->code[jit->used];
+    e.buf  = &jit->code[jit->used + sizeof(JitBlock)];
+    emit_epilogue(&e);
+    block->entry = sizeof(JitBlock) + e.len;
+    emit_prologue(&e);
+    e.body      = e.len;
+    block->body = sizeof(JitBlock) + e.len;
+
+    /* Emit the instructions, leaving at the end of the block or wherever one moves the PC */
+    for (pc = e.start, last = 0; num-- && e.len + JIT_INST <= JIT_BLOCK && !last; op++) {
+        e.at = e.cycles;
+        e.cycles += jit_insts[op->opcode].cycles;
+        e.count++;
+        e.next = pc + op->length;
+        last   = emit_inst(&e, pc, op->opcode, op->operand);
+        pc     = e.next;
+    }
+    if (!last) emit_exit(&e, pc, e.cycles, e.count);
+
+    block->cycles = e.max;
+    block->bytes  = pc - e.start;
+    jit->used     = (jit->used + sizeof(JitBlock) + e.len + 15) & ~(size_t)15;
+    return (uint32_t)((uint8_t *)block - jit->code) + 1;
+}
+
+/* Set up native translation of hot blocks, or return NULL if the host is not x86-64 */
+Jit *create_jit(void)
+{
+    Jit *jit = calloc(1, sizeof(Jit));
+
+    if (jit == NULL) return NULL;
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+    return jit;
+}
+
+/* Release the translations */
+void free_jit(Jit *jit)
+{
+    if (jit == NULL) return;
+    munmap(jit->code, JIT_CODE_SIZE);
+    free(jit);
+}
+
+/* Run the translation of the predecoded block at the PC if it is hot and stays within the budget and clear of break_pc; returns 0 if
+   the interpreter has to run the block instead */
+int jit_run(CPUMAP *cpu, const BlockOp *op, uint64_t end, int break_pc)
+{
+    Jit      *jit   = cpu->jit;
+    uint16_t  pc    = cpu->PC;
+    uint32_t  entry = jit->entry[pc];
+    JitBlock *block;
+
+    if (entry == 0) {
+        if (++jit->heat[pc] < JIT_HOT) return 0;
+        entry = jit->entry[pc] = translate(jit, cpu, op);
+    }
+    if (entry == JIT_FAILED || (cpu->SR.byte & SR_DECIMAL) || cpu->code_pages[1]) return 0;
+    block = (JitBlock *)&jit->code[entry - 1];
+    if (cpu->total_cycles + block->cycles > end) return 0;
+    if (break_pc >= 0 && (uint16_t)(break_pc - pc - 1) < block->bytes - 1) return 0;
+
+    /* Passes only loop back while break_pc is elsewhere, and only chain to other blocks when there is no break_pc to watch */
+    ((void (*)(CPUMAP *, uint64_t, uint64_t))((uint8_t *)block + block->entry))(cpu, break_pc == pc ? 0 : end, break_pc >= 0 ? 0 : end);
+    return 1;
+}
+
+/* Drop the translations that may hold code from a page about to be written */
+void jit_invalidate(Jit *jit, uint8_t page)
+{
+    memset(&jit->entry[page << 8], 0, 0x100 * sizeof(uint32_t));
+    memset(&jit->entry[(uint8_t)(page - 1) << 8], 0, 0x100 * sizeof(uint32_t));
+    memset(&jit->heat[page << 8], 0, 0x100);
+    memset(&jit->heat[(uint8_t)(page - 1) << 8], 0, 0x100);
+    jit->dropped = 1;
+}
+
+/* Drop every translation */
+void jit_flush(Jit *jit)
+{
+    memset(jit->entry, 0, sizeof(jit->entry));
+    memset(jit->heat, 0, sizeof(jit->heat));
+    jit->used    = 0;
+    jit->dropped = 1;
+}
+
+#else
+
+/* Set up native translation of hot blocks, or return NULL if the host is not x86-64 */
+Jit *create_jit(void)
+{
+    return NULL;
+}
+
+/* Release the translations */
+void free_jit(Jit *jit) {}
+
+/* Run the translation of the block at the PC; there is none on this host */
+int jit_run(CPUMAP *cpu, const BlockOp *op, uint64_t end, int break_pc)
+{
+    return 0;
+}
+
+/* Drop the translations that may hold code from a page about to be written */
+void jit_invalidate(Jit *jit, uint8_t page) {}
+
+/* Drop every translation */
+void jit_flush(Jit *jit) {}
+
+#endif
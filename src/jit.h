@@ -0,0 +1,36 @@
+/*
+ *
+ *      jit.h
+ *      x86-64 translation of hot basic blocks header file
+ *
+ *      2024/12/13 By MicroFish
+ *      Based on MIT open source agreement
+ *      Copyright © 2020 ViudiraTech, based on the MIT agreement.
+ *
+ */
+
+#ifndef INCLUDE_JIT_H_
+#define INCLUDE_JIT_H_
+
+#define JIT_HOT       32          // Entries of a block before it is translated
+#define JIT_CODE_SIZE (16 << 20)  // Bytes of native code kept before every translation is dropped
+#define JIT_BLOCK     (16 << 10)  // Most bytes of native code for one block
+#define JIT_INST      512         // Most bytes of native code for one instruction
+
+/* Set up native translation of hot blocks, or return NULL if the host is not x86-64 */
+Jit *create_jit(void);
+
+/* Release the translations */
+void free_jit(Jit *jit);
+
+/* Run the translation of the predecoded block at the PC if it is hot and stays within the budget and clear of break_pc; returns 0 if
+   the interpreter has to run the block instead */
+int jit_run(CPUMAP *cpu, const BlockOp *op, uint64_t end, int break_pc);
+
+/* Drop the translations that may hold code from a page about to be written */
+void jit_invalidate(Jit *jit, uint8_t page);
+
+/* Drop every translation */
+void jit_flush(Jit *jit);
+
+#endif // INCLUDE_JIT_H_
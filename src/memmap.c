@@ -0,0 +1,232 @@
+/*
+ *
+ *      memmap.c
+ *      Memory map of the machine
+ *
+ *      2024/12/13 By MicroFish
+ *      Based on MIT open source agreement
+ *      Copyright © 2020 ViudiraTech, based on the MIT agreement.
+ *
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INCLUDE
+#include "6502.h"
+#include "6522.h"
+#include "6850.h"
+#include "memmap.h"
+
+/* Region names of a machine description, in PageKind order */
+static const char *const kind_names[] = {"ram", "rom", "mirror", "uart", "via"};
+
+/* Parse a hexadecimal address, returning -1 unless there is one */
+static long parse_addr(const char *str, char **end)
+{
+    long addr;
+
+    if (*str == '$') str++;
+    if (!isxdigit((unsigned char)*str)) return -1;
+    addr = strtol(str, end, 16);
+    return addr <= 0xFFFF ? addr : -1;
+}
+
+/* Give the pages of a region ("rom=C000-FFFF", "mirror=0800-1FFF:0000") their kind and, for a mirror, the pages it stands for */
+static int add_region(MemoryMap *map, uint8_t *target, const char *token)
+{
+    const char *value = strchr(token, '=');
+    char       *end;
+    long        first, last, to = 0;
+    int         kind, page;
+
+    if (value == NULL) return -1;
+    for (kind = 0; kind <= PAGE_VIA; kind++)
+        if (strlen(kind_names[kind]) == (size_t)(value - token) && strncmp(token, kind_names[kind], value - token) == 0) break;
+    if (kind > PAGE_VIA || (first = parse_addr(value + 1, &end)) < 0) return -1;
+    last = first | 0xFF;
+    if (*end == '-' && (last = parse_addr(end + 1, &end)) < 0) return -1;
+    if (kind == PAGE_MIRROR && (*end != ':' || (to = parse_addr(end + 1, &end)) < 0)) return -1;
+
+    /* Regions are made of whole pages */
+    if (*end != '\0' || (first & 0xFF) != 0 || (last & 0xFF) != 0xFF || last < first || (to & 0xFF) != 0 || to + last - first > 0xFFFF)
+        return -1;
+    for (page = first >> 8; page <= last >> 8; page++) {
+        map->kind[page] = kind;
+        target[page]    = (to >> 8) + page - (first >> 8);
+    }
+    return 0;
+}
+
+/* Add the regions listed in a line of a machine description */
+static int add_regions(MemoryMap *map, uint8_t *target, char *text, const char *spec, size_t number)
+{
+    char *save, *token;
+
+    for (token = strtok_r(text, " \t\r\n,", &save); token != NULL; token = strtok_r(NULL, " \t\r\n,", &save)) {
+        if (add_region(map, target, token) == 0) continue;
+        if (number == 0)
+            fprintf(stderr, "Error: Bad memory map entry \"%s\".\n", token);
+        else
+            fprintf(stderr, "Error: %s:%zu: bad memory map entry \"%s\".\n", spec, number, token);
+        return -1;
+    }
+    return 0;
+}
+
+/* Point every mirror page at the page it ends up at. Mirrors of ROM become copies of it, since ROM never changes, and mirrors of RAM
+   become RAM holding the same bytes, kept so by writing every copy; mirrors of devices and of the stack page forward their accesses */
+static int resolve_mirrors(MemoryMap *map, const uint8_t *target)
+{
+    uint8_t kind[0x100];
+    int     page, to, steps;
+
+    memcpy(kind, map->kind, sizeof(kind));
+    for (page = 0; page < 0x100; page++) map->source[page] = map->alias[page] = page;
+    for (page = 0; page < 0x100; page++) {
+        if (kind[page] != PAGE_MIRROR) continue;
+        for (to = target[page], steps = 0; kind[to] == PAGE_MIRROR && steps < 0x100; steps++) to = target[to];
+        if (kind[to] == PAGE_MIRROR) {
+            fprintf(stderr, "Error: Memory map page $%02X mirrors itself.\n", page);
+            return -1;
+        }
+        if (kind[to] == PAGE_ROM) {
+            map->kind[page]   = PAGE_ROM;
+            map->source[page] = to;
+        } else if (kind[to] == PAGE_RAM && to != 1) {
+            map->kind[page]   = PAGE_RAM;
+            map->source[page] = to;
+            map->alias[page]  = map->alias[to];
+            map->alias[to]    = page;
+        } else {
+            map->offset[page] = (to - page) << 8;
+        }
+    }
+
+    /* The cores read the zero page pointers and push onto the stack without going through the page handlers, so a push could not
+       reach another copy of the stack page */
+    if (map->kind[0] != PAGE_RAM || map->kind[1] != PAGE_RAM || map->alias[1] != 1) {
+        fprintf(stderr, "Error: The zero page and the stack page must be RAM, and the stack page no mirror.\n");
+        return -1;
+    }
+    /* Forwarding mirrors are only coherent through the page handlers, which the vector fetches do not go through */
+    if (map->kind[0xFF] == PAGE_MIRROR) {
+        fprintf(stderr, "Error: The vector page cannot mirror a device or the stack page.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Compile a machine description read from a file, or given inline when it contains '=' */
+MemoryMap *load_memory_map(const char *spec)
+{
+    MemoryMap *map = calloc(1, sizeof(MemoryMap));
+    uint8_t    target[0x100];
+    char       line[256], *text;
+    FILE      *fp;
+    size_t     number = 0;
+    int        status = 0, page;
+
+    if (map == NULL) {
+        fprintf(stderr, "Error: Unable to allocate the memory map.\n");
+        return NULL;
+    }
+    if (strchr(spec, '=') != NULL) {
+        text   = strdup(spec);
+        status = text ? add_regions(map, target, text, spec, 0) : -1;
+        free(text);
+    } else if ((fp = fopen(spec, "r")) == NULL) {
+        fprintf(stderr, "Error: Unable to open memory map \"%s\".\n", spec);
+        status = -1;
+    } else {
+        while (status == 0 && fgets(line, sizeof(line), fp) != NULL) {
+            if ((text = strchr(line, '#')) != NULL) *text = '\0';
+            status = add_regions(map, target, line, spec, ++number);
+        }
+        fclose(fp);
+    }
+    if (status != 0 || resolve_mirrors(map, target) != 0) {
+        free(map);
+        return NULL;
+    }
+
+    /* The UART is the console; a map leaving it out would leave the program without one */
+    for (page = 0; page < 0x100 && map->kind[page] != PAGE_UART; page++);
+    if (page == 0x100) {
+        fprintf(stderr, "Error: The memory map places no UART.\n");
+        free(map);
+        return NULL;
+    }
+    return map;
+}
+
+/* Drop a write to ROM */
+static void rom_write(void *device, uint16_t addr, uint8_t val)
+{
+}
+
+/* Write a byte to a RAM page and to every page holding the same bytes */
+static void alias_write(void *device, uint16_t addr, uint8_t val)
+{
+    MemoryMap *map = device;
+    CPUMAP    *cpu = map->cpu;
+    int        page;
+
+    cpu->memory[addr] = val;
+    for (page = map->alias[addr >> 8]; page != addr >> 8; page = map->alias[page]) {
+        cpu->memory[(page << 8) | (addr & 0xFF)] = val;
+        cpu->dirty_pages[page]                  = 1;
+        if (cpu->code_pages[page]) invalidate_code(cpu, page);
+    }
+}
+
+/* Read a forwarding mirror page through the page it stands for */
+static uint8_t mirror_read(void *device, uint16_t addr)
+{
+    MemoryMap *map = device;
+
+    return read_byte(map->cpu, addr + map->offset[addr >> 8]);
+}
+
+/* Write a forwarding mirror page through the page it stands for */
+static void mirror_write(void *device, uint16_t addr, uint8_t val)
+{
+    MemoryMap *map = device;
+
+    write_byte(map->cpu, addr + map->offset[addr >> 8], val);
+}
+
+/* Install a memory map on a machine, placing its UART and VIA where the map says; ROM and RAM mirrors are copied from the loaded image */
+void apply_memory_map(CPUMAP *cpu, MemoryMap *map, Uart *uart, Via *via)
+{
+    int page;
+
+    map->cpu = cpu;
+    for (page = 0; page < 0x100; page++) {
+        switch (map->kind[page]) {
+            case PAGE_ROM :
+                if (map->source[page] != page) memcpy(&cpu->memory[page << 8], &cpu->memory[map->source[page] << 8], 0x100);
+                map_io(cpu, page, NULL, rom_write, map);
+                break;
+            case PAGE_MIRROR :
+                map_io(cpu, page, mirror_read, mirror_write, map);
+                break;
+            case PAGE_UART :
+                map_uart(uart, page);
+                break;
+            case PAGE_VIA :
+                map_via(via, page);
+                break;
+            default :
+                if (map->source[page] != page) memcpy(&cpu->memory[page << 8], &cpu->memory[map->source[page] << 8], 0x100);
+                if (map->alias[page] != page)
+                    map_io(cpu, page, NULL, alias_write, map);
+                else
+                    map_io(cpu, page, NULL, NULL, NULL);
+                break;
+        }
+    }
+    memset(cpu->dirty_pages, 1, sizeof(cpu->dirty_pages));
+    flush_blocks(cpu);
+}
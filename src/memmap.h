@@ -0,0 +1,39 @@
+/*
+ *
+ *      memmap.h
+ *      Memory map header file
+ *
+ *      2024/12/13 By MicroFish
+ *      Based on MIT open source agreement
+ *      Copyright © 2020 ViudiraTech, based on the MIT agreement.
+ *
+ */
+
+#ifndef INCLUDE_MEMMAP_H_
+#define INCLUDE_MEMMAP_H_
+
+/* What a page of the address space holds */
+typedef enum {
+    PAGE_RAM,    // Plain memory, whose writes go to every page holding the same bytes
+    PAGE_ROM,    // Memory that ignores writes, copied from another page when it mirrors one
+    PAGE_MIRROR, // Reads and writes go to a device page or the stack page
+    PAGE_UART,   // UART registers at the start of the page
+    PAGE_VIA,    // VIA registers at the start of the page
+} PageKind;
+
+/* Machine description compiled into one entry per page */
+typedef struct {
+        CPUMAP  *cpu;            // Machine the map was applied to
+        uint8_t  kind[0x100];    // PageKind of each page
+        uint8_t  source[0x100];  // Page a ROM or RAM page is copied from, itself unless it mirrors one
+        uint8_t  alias[0x100];   // Next RAM page in the ring of pages holding the same bytes, itself without mirrors
+        uint16_t offset[0x100];  // Distance from a forwarding mirror page to the page it stands for
+} MemoryMap;
+
+/* Compile a machine description read from a file, or given inline when it contains '=' */
+MemoryMap *load_memory_map(const char *spec);
+
+/* Install a memory map on a machine, placing its UART and VIA where the map says; ROM and RAM mirrors are copied from the loaded image */
+void apply_memory_map(CPUMAP *cpu, MemoryMap *map, Uart *uart, Via *via);
+
+#endif // INCLUDE_MEMMAP_H_
@@ -0,0 +1,274 @@
+/*
+ *
+ *      profile.c
+ *      Cycle profiler: per address, per opcode and per subroutine hot spots
+ *
+ *      2024/12/13 By MicroFish
+ *      Based on MIT open source agreement
+ *      Copyright © 2020 ViudiraTech, based on the MIT agreement.
+ *
+ */
+
+#include <inttypes.h>
+
+#define INCLUDE
+#include "6502.h"
+#include "profile.h"
+
+/* One call path: a subroutine entered from its parent's path */
+typedef struct {
+        uint16_t target;
+        uint32_t parent;
+        uint32_t child;   // First callee, 0 if none
+        uint32_t sibling; // Next callee of the same parent, 0 if none
+        uint64_t calls;
+        uint64_t self;    // Cycles spent in this path outside its callees
+        uint64_t total;   // Cycles including the callees, filled in for the reports
+} CallNode;
+
+/* A call in progress: the path it runs in and the stack pointer to return to */
+typedef struct {
+        uint32_t node;
+        uint8_t  sp;
+} CallFrame;
+
+/* Profiler state */
+struct Profile {
+        uint64_t  pc_count[0x10000];
+        uint64_t  pc_cycles[0x10000];
+        uint8_t   pc_opcode[0x10000]; // Opcode last executed at each address
+        uint64_t  op_count[0x100];
+        uint64_t  op_cycles[0x100];
+        uint64_t  instructions;
+        uint64_t  cycles;
+        CallNode *nodes;
+        uint32_t  num_nodes;
+        uint32_t  max_nodes;
+        CallFrame stack[PROFILE_DEPTH];
+        int       depth;
+        uint32_t  current;
+};
+
+/* Report line: a key and what was spent on it */
+typedef struct {
+        uint32_t key;
+        uint64_t count;
+        uint64_t cycles;
+        uint64_t total;
+} ProfileRow;
+
+/* Start profiling a machine, rooting the call tree at its current PC */
+Profile *create_profile(CPUMAP *cpu)
+{
+    Profile *prof = calloc(1, sizeof(Profile));
+
+    if (prof == NULL) return NULL;
+    prof->max_nodes = 1024;
+    prof->nodes     = calloc(prof->max_nodes, sizeof(CallNode));
+    if (prof->nodes == NULL) {
+        free(prof);
+        return NULL;
+    }
+    prof->nodes[0].target = cpu->PC;
+    prof->nodes[0].calls  = 1;
+    prof->num_nodes       = 1;
+    return prof;
+}
+
+/* Release a profile */
+void free_profile(Profile *prof)
+{
+    if (prof == NULL) return;
+    free(prof->nodes);
+    free(prof);
+}
+
+/* Find or add the path for a call to target from the current path */
+static uint32_t call_node(Profile *prof, uint16_t target)
+{
+    CallNode *nodes;
+    uint32_t  node;
+
+    for (node = prof->nodes[prof->current].child; node != 0; node = prof->nodes[node].sibling)
+        if (prof->nodes[node].target == target) return node;
+    if (prof->num_nodes == prof->max_nodes) {
+        if ((nodes = realloc(prof->nodes, prof->max_nodes * 2 * sizeof(CallNode))) == NULL) return prof->current;
+        prof->nodes = nodes;
+        prof->max_nodes *= 2;
+    }
+    node = prof->num_nodes++;
+    memset(&prof->nodes[node], 0, sizeof(CallNode));
+    prof->nodes[node].target         = target;
+    prof->nodes[node].parent         = prof->current;
+    prof->nodes[node].sibling        = prof->nodes[prof->current].child;
+    prof->nodes[prof->current].child = node;
+    return node;
+}
+
+/* Account one executed instruction, following calls and returns */
+void profile_step(Profile *prof, CPUMAP *cpu, uint16_t pc, uint8_t opcode, int cycles)
+{
+    prof->pc_count[pc]++;
+    prof->pc_cycles[pc] += cycles;
+    prof->pc_opcode[pc] = opcode;
+    prof->op_count[opcode]++;
+    prof->op_cycles[opcode] += cycles;
+    prof->instructions++;
+    prof->cycles += cycles;
+    prof->nodes[prof->current].self += cycles;
+
+    switch (opcode) {
+        case 0x20 : // JSR pushed two bytes
+        case 0x00 : // BRK pushed three
+            if (prof->depth == PROFILE_DEPTH) break;
+            prof->stack[prof->depth].node = prof->current;
+            prof->stack[prof->depth].sp   = cpu->SP + (opcode == 0x20 ? 2 : 3);
+            prof->depth++;
+            prof->current = call_node(prof, cpu->PC);
+            prof->nodes[prof->current].calls++;
+            break;
+        case 0x60 : // RTS
+        case 0x40 : // RTI
+            /* Unwind every frame the stack pointer has moved back past, so code that drops return addresses stays in step */
+            while (prof->depth > 0 && prof->stack[prof->depth - 1].sp <= cpu->SP) prof->current = prof->stack[--prof->depth].node;
+            break;
+    }
+}
+
+/* Account a taken IRQ or NMI, entering its handler */
+void profile_interrupt(Profile *prof, CPUMAP *cpu, int cycles)
+{
+    prof->cycles += cycles;
+
+    /* The handler returns with RTI past the three bytes pushed; without room for its frame, it is charged to the interrupted path */
+    if (prof->depth < PROFILE_DEPTH) {
+        prof->stack[prof->depth].node = prof->current;
+        prof->stack[prof->depth].sp   = cpu->SP + 3;
+        prof->depth++;
+        prof->current = call_node(prof, cpu->PC);
+        prof->nodes[prof->current].calls++;
+    }
+    prof->nodes[prof->current].self += cycles;
+}
+
+/* Sort report lines by cycles spent, most first */
+static int compare_rows(const void *a, const void *b)
+{
+    const ProfileRow *ra = a, *rb = b;
+    uint64_t          ka = ra->total ? ra->total : ra->cycles;
+    uint64_t          kb = rb->total ? rb->total : rb->cycles;
+
+    if (ka != kb) return ka < kb ? 1 : -1;
+    return ra->key < rb->key ? -1 : (ra->key > rb->key);
+}
+
+/* Share of the profiled cycles in percent */
+static double percent(Profile *prof, uint64_t cycles)
+{
+    return prof->cycles ? cycles * 100.0 / prof->cycles : 0;
+}
+
+/* Fill in the cycles of every path including its callees */
+static void total_nodes(Profile *prof)
+{
+    uint32_t node;
+
+    for (node = 0; node < prof->num_nodes; node++) prof->nodes[node].total = prof->nodes[node].self;
+    /* Callees are always added after their caller, so one backward pass sums the whole tree */
+    for (node = prof->num_nodes - 1; node > 0; node--) prof->nodes[prof->nodes[node].parent].total += prof->nodes[node].total;
+}
+
+/* Whether a path is a recursive call of a subroutine already on its chain */
+static int recursive_node(Profile *prof, uint32_t node)
+{
+    uint32_t up;
+
+    for (up = node; up != 0;) {
+        up = prof->nodes[up].parent;
+        if (prof->nodes[up].target == prof->nodes[node].target && up != 0) return 1;
+    }
+    return 0;
+}
+
+/* Write the sorted hot spot report: per address, per opcode and per subroutine */
+int write_profile(Profile *prof, const char *filename)
+{
+    ProfileRow *rows;
+    size_t      num, i;
+    uint32_t    node, key;
+
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL) {
+        printf("Error: Unable to create profile file.\n");
+        return -1;
+    }
+    if ((rows = calloc(0x10000, sizeof(ProfileRow))) == NULL) {
+        printf("Error: Unable to allocate the profile report.\n");
+        fclose(fp);
+        return -1;
+    }
+    fprintf(fp, "%" PRIu64 " instructions, %" PRIu64 " cycles\n", prof->instructions, prof->cycles);
+
+    for (num = 0, key = 0; key < 0x10000; key++)
+        if (prof->pc_count[key]) rows[num++] = (ProfileRow){key, prof->pc_count[key], prof->pc_cycles[key], 0};
+    qsort(rows, num, sizeof(ProfileRow), compare_rows);
+    fprintf(fp, "\nHot spots by address\n  PC    Instruction          Count          Cycles       %%\n");
+    for (i = 0; i < num && i < PROFILE_TOP; i++)
+        fprintf(fp, "  %04X  %-10s %14" PRIu64 " %15" PRIu64 " %6.2f%%\n", rows[i].key, opcode_name(prof->pc_opcode[rows[i].key]), rows[i].count,
+                rows[i].cycles, percent(prof, rows[i].cycles));
+
+    for (num = 0, key = 0; key < 0x100; key++)
+        if (prof->op_count[key]) rows[num++] = (ProfileRow){key, prof->op_count[key], prof->op_cycles[key], 0};
+    qsort(rows, num, sizeof(ProfileRow), compare_rows);
+    fprintf(fp, "\nOpcodes\n  Op  Instruction            Count          Cycles       %%\n");
+    for (i = 0; i < num; i++)
+        fprintf(fp, "  %02X  %-10s %16" PRIu64 " %15" PRIu64 " %6.2f%%\n", rows[i].key, opcode_name(rows[i].key), rows[i].count, rows[i].cycles,
+                percent(prof, rows[i].cycles));
+
+    /* Subroutines: every path into the same target is merged, recursive paths only count their own cycles */
+    memset(rows, 0, 0x10000 * sizeof(ProfileRow));
+    total_nodes(prof);
+    for (node = 1; node < prof->num_nodes; node++) {
+        key = prof->nodes[node].target;
+        rows[key].key = key;
+        rows[key].count += prof->nodes[node].calls;
+        rows[key].cycles += prof->nodes[node].self;
+        if (!recursive_node(prof, node)) rows[key].total += prof->nodes[node].total;
+    }
+    for (num = 0, key = 0; key < 0x10000; key++)
+        if (rows[key].count) rows[num++] = rows[key];
+    qsort(rows, num, sizeof(ProfileRow), compare_rows);
+    fprintf(fp, "\nSubroutines\n  Entry          Calls            Self       Inclusive       %%\n");
+    for (i = 0; i < num; i++)
+        fprintf(fp, "  %04X  %14" PRIu64 " %15" PRIu64 " %15" PRIu64 " %6.2f%%\n", rows[i].key, rows[i].count, rows[i].cycles, rows[i].total,
+                percent(prof, rows[i].total));
+
+    free(rows);
+    fclose(fp);
+    return 0;
+}
+
+/* Write the call tree as folded stacks for flame graph tools */
+int write_folded(Profile *prof, const char *filename)
+{
+    uint32_t chain[PROFILE_DEPTH + 1];
+    uint32_t node, up;
+    int      depth;
+
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL) {
+        printf("Error: Unable to create folded stack file.\n");
+        return -1;
+    }
+    for (node = 0; node < prof->num_nodes; node++) {
+        if (prof->nodes[node].self == 0) continue;
+        for (depth = 0, up = node; depth <= PROFILE_DEPTH; up = prof->nodes[up].parent) {
+            chain[depth++] = up;
+            if (up == 0) break;
+        }
+        while (depth--) fprintf(fp, "%04X%s", prof->nodes[chain[depth]].target, depth ? ";" : "");
+        fprintf(fp, " %" PRIu64 "\n", prof->nodes[node].self);
+    }
+    fclose(fp);
+    return 0;
+}
@@ -0,0 +1,36 @@
+/*
+ *
+ *      profile.h
+ *      Cycle profiler header file
+ *
+ *      2024/12/13 By MicroFish
+ *      Based on MIT open source agreement
+ *      Copyright © 2020 ViudiraTech, based on the MIT agreement.
+ *
+ */
+
+#ifndef INCLUDE_PROFILE_H_
+#define INCLUDE_PROFILE_H_
+
+#define PROFILE_DEPTH 256 // Deepest call chain tracked; deeper calls are charged to their caller
+#define PROFILE_TOP   64  // Addresses listed in the hot spot report
+
+/* Start profiling a machine, rooting the call tree at its current PC */
+Profile *create_profile(CPUMAP *cpu);
+
+/* Release a profile */
+void free_profile(Profile *prof);
+
+/* Account one executed instruction, following calls and returns */
+void profile_step(Profile *prof, CPUMAP *cpu, uint16_t pc, uint8_t opcode, int cycles);
+
+/* Account a taken IRQ or NMI, entering its handler */
+void profile_interrupt(Profile *prof, CPUMAP *cpu, int cycles);
+
+/* Write the sorted hot spot report: per address, per opcode and per subroutine */
+int write_profile(Profile *prof, const char *filename);
+
+/* Write the call tree as folded stacks for flame graph tools */
+int write_folded(Profile *prof, const char *filename);
+
+#endif // INCLUDE_PROFILE_H_
@@ -0,0 +1,121 @@
+/*
+ *
+ *      snapshot.c
+ *      Machine snapshot save and restore
+ *
+ *      2024/12/13 By MicroFish
+ *      Based on MIT open source agreement
+ *      Copyright © 2020 ViudiraTech, based on the MIT agreement.
+ *
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define INCLUDE
+#include "6502.h"
+#include "6522.h"
+#include "6850.h"
+#include "snapshot.h"
+
+/* Write the machine and its devices to a snapshot file */
+int save_snapshot(CPUMAP *cpu, Uart *uart, Via *via, const char *filename)
+{
+    Snapshot *snap = calloc(1, sizeof(Snapshot));
+    FILE     *fp;
+    size_t    written;
+
+    if (snap == NULL) {
+        printf("Error: Unable to allocate the snapshot.\n");
+        return -1;
+    }
+    memcpy(snap->magic, SNAPSHOT_MAGIC, sizeof(snap->magic));
+    snap->version      = SNAPSHOT_VERSION;
+    snap->total_cycles = cpu->total_cycles;
+    snap->PC           = cpu->PC;
+    snap->A            = cpu->A;
+    snap->X            = cpu->X;
+    snap->Y            = cpu->Y;
+    snap->SP           = cpu->SP;
+    snap->SR           = cpu->SR.byte;
+    snap->interrupts   = cpu->interrupts & NMI_PENDING;
+    if (uart) get_uart_state(uart, &snap->uart);
+    if (via) get_via_state(via, &snap->via);
+    memcpy(snap->memory, cpu->memory, sizeof(snap->memory));
+
+    fp = fopen(filename, "w");
+    if (fp == NULL) {
+        printf("Error: Unable to create snapshot file.\n");
+        free(snap);
+        return -1;
+    }
+    written = fwrite(snap, sizeof(Snapshot), 1, fp);
+    if (fclose(fp) != 0 || written != 1) {
+        printf("Error: Unable to write snapshot file.\n");
+        free(snap);
+        return -1;
+    }
+    free(snap);
+    return 0;
+}
+
+/* Map a snapshot file; returns 1 when mapped, 0 when the file is not a snapshot, -1 on error */
+int map_snapshot(const char *filename, const Snapshot **snap)
+{
+    char        magic[sizeof(SNAPSHOT_MAGIC)];
+    uint32_t    version = 0;
+    struct stat st;
+    void       *map;
+    int         fd;
+
+    *snap = NULL;
+    if ((fd = open(filename, O_RDONLY)) < 0) return 0;
+    if (read(fd, magic, sizeof(magic)) != sizeof(magic) || memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0) {
+        close(fd);
+        return 0;
+    }
+    if (read(fd, &version, sizeof(version)) != sizeof(version) || version != SNAPSHOT_VERSION) {
+        printf("Error: Snapshot version %u is not supported.\n", version);
+        close(fd);
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size != sizeof(Snapshot)) {
+        printf("Error: Snapshot has the wrong size.\n");
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, sizeof(Snapshot), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("Error: Unable to map snapshot file.\n");
+        return -1;
+    }
+    *snap = map;
+    return 1;
+}
+
+/* Release a mapped snapshot */
+void unmap_snapshot(const Snapshot *snap)
+{
+    munmap((void *)snap, sizeof(Snapshot));
+}
+
+/* Load a mapped snapshot into the machine and its devices */
+void restore_snapshot(CPUMAP *cpu, Uart *uart, Via *via, const Snapshot *snap)
+{
+    memcpy(cpu->memory, snap->memory, sizeof(cpu->memory));
+    memset(cpu->dirty_pages, 1, sizeof(cpu->dirty_pages));
+    flush_blocks(cpu);
+    cpu->total_cycles = snap->total_cycles;
+    cpu->PC           = snap->PC;
+    cpu->A            = snap->A;
+    cpu->X            = snap->X;
+    cpu->Y            = snap->Y;
+    cpu->SP           = snap->SP;
+    set_status(cpu, snap->SR);
+    cpu->interrupts   = snap->interrupts;
+    if (uart) set_uart_state(uart, &snap->uart);
+    if (via) set_via_state(via, &snap->via);
+}
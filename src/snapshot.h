@@ -0,0 +1,47 @@
+/*
+ *
+ *      snapshot.h
+ *      Machine snapshot header file
+ *
+ *      2024/12/13 By MicroFish
+ *      Based on MIT open source agreement
+ *      Copyright © 2020 ViudiraTech, based on the MIT agreement.
+ *
+ */
+
+#ifndef INCLUDE_SNAPSHOT_H_
+#define INCLUDE_SNAPSHOT_H_
+
+#define SNAPSHOT_MAGIC   "S65SNP1" // Snapshot file signature
+#define SNAPSHOT_VERSION 3         // Layout version of the snapshot file
+
+/* Snapshot file: the whole file is this structure, so it can be mapped and used in place */
+typedef struct {
+        char      magic[8];
+        uint32_t  version;
+        uint32_t  interrupts; // Latched NMI; IRQ lines are driven again by the restored devices
+        uint64_t  total_cycles;
+        uint16_t  PC;
+        uint8_t   A;
+        uint8_t   X;
+        uint8_t   Y;
+        uint8_t   SP;
+        uint8_t   SR;
+        UartState uart;
+        ViaState  via;
+        uint8_t   memory[1 << 16];
+} Snapshot;
+
+/* Write the machine and its devices to a snapshot file */
+int save_snapshot(CPUMAP *cpu, Uart *uart, Via *via, const char *filename);
+
+/* Map a snapshot file; returns 1 when mapped, 0 when the file is not a snapshot, -1 on error */
+int map_snapshot(const char *filename, const Snapshot **snap);
+
+/* Release a mapped snapshot */
+void unmap_snapshot(const Snapshot *snap);
+
+/* Load a mapped snapshot into the machine and its devices */
+void restore_snapshot(CPUMAP *cpu, Uart *uart, Via *via, const Snapshot *snap);
+
+#endif // INCLUDE_SNAPSHOT_H_
@@ -0,0 +1,374 @@
+/*
+ *
+ *      threaded.c
+ *      Threaded 6502 interpreter core
+ *
+ *      2024/12/13 By MicroFish
+ *      Based on MIT open source agreement
+ *      Copyright © 2020 ViudiraTech, based on the MIT agreement.
+ *
+ */
+
+#define INCLUDE
+#include "6502.h"
+
+/* Operand bytes of the current instruction */
+#define IMM8  mem[(uint16_t)(pc + 1)]
+#define IMM16 (mem[(uint16_t)(pc + 1)] | mem[(uint16_t)(pc + 2)] << 8)
+
+/* Make the next budget check leave the handlers when an interrupt line is active or an event came due, so it is looked at between
+   instructions */
+#define POLL() (void)(cpu->interrupts && (end = 0))
+
+/* Memory access through the I/O map; only device handlers and flag changes can make an interrupt or event due. Devices see the
+   cycle count at the start of the instruction */
+#define RD(addr)                                                                                                        \
+    (cpu->io_read[(addr) >> 8]                                                                                          \
+         ? (cpu->total_cycles = total, io = cpu->io_read[(addr) >> 8](cpu->io_device[(addr) >> 8], addr), POLL(), io) \
+         : mem[addr])
+#define WR(addr, val)                                                                                                                  \
+    (cpu->dirty_pages[(addr) >> 8] = 1,                                                                                                \
+     cpu->io_write[(addr) >> 8] ? (cpu->total_cycles = total, cpu->io_write[(addr) >> 8](cpu->io_device[(addr) >> 8], addr, val), POLL()) \
+                                : (void)(mem[addr] = (val)))
+
+/* Stack operations */
+#define PUSH(val) (cpu->dirty_pages[1] = 1, mem[0x100 + (sp--)] = (val))
+#define PULL()    (mem[0x100 + (++sp)])
+
+/* Record a result; the sign and zero flags are only derived from it when tested or packed */
+#define NZ(val) (nres = zres = (val))
+
+/* Pack the flag locals into a status register byte */
+#define SR_BYTE()                                                                                                                  \
+    (sr.bits.carry = c, sr.bits.zero = zres == 0, sr.bits.interrupt = i, sr.bits.decimal = d, sr.bits.brk = b, sr.bits.unused = u, \
+     sr.bits.overflow = v, sr.bits.sign = nres >> 7, sr.byte)
+
+/* Unpack a status register byte into the flag locals */
+#define SET_SR(val)                                                                                                         \
+    (sr.byte = (val), c = sr.bits.carry, zres = !sr.bits.zero, i = sr.bits.interrupt, d = sr.bits.decimal, b = sr.bits.brk, \
+     u = sr.bits.unused, v = sr.bits.overflow, nres = sr.bits.sign << 7)
+
+/* ↓Addressing modes, computing the effective address from the opcode address↓ */
+
+#define EA_ACC
+#define EA_IMPL ea = 0;
+#define EA_IMM  ea = (uint16_t)(pc + 1);
+#define EA_ZP   ea = IMM8;
+#define EA_ZPX  ea = (IMM8 + x) & 0xFF;
+#define EA_ZPY  ea = (IMM8 + y) & 0xFF;
+#define EA_ABS  ea = IMM16;
+#define EA_REL  ea = (uint16_t)(pc + (int8_t)IMM8);
+#define EA_ABSX                   \
+    ea = (uint16_t)(IMM16 + x);   \
+    if ((uint8_t)ea < x) extra++;
+#define EA_ABSY                   \
+    ea = (uint16_t)(IMM16 + y);   \
+    if ((uint8_t)ea < y) extra++;
+#define EA_IND                                   \
+    ea = IMM16;                                  \
+    ea = mem[ea] | mem[(uint16_t)(ea + 1)] << 8;
+#define EA_XIND                               \
+    ea = (IMM8 + x) & 0xFF;                   \
+    ea = mem[ea] | mem[(ea + 1) & 0xFF] << 8;
+#define EA_INDY                               \
+    ea = IMM8;                                \
+    ea = mem[ea] | mem[(ea + 1) & 0xFF] << 8; \
+    ea += y;                                  \
+    if ((uint8_t)ea < y) extra++;
+#define EA_JMP_IND_BUG                                          \
+    ea = IMM16;                                                 \
+    ea = mem[ea] | mem[(ea & 0xFF00) | ((ea + 1) & 0xFF)] << 8;
+
+/* Operand access for the read-modify-write instructions, which also work on A */
+#define LOAD_ACC        a
+#define LOAD_ZP         RD(ea)
+#define LOAD_ZPX        RD(ea)
+#define LOAD_ABS        RD(ea)
+#define LOAD_ABSX       RD(ea)
+#define STORE_ACC(val)  a = (val)
+#define STORE_ZP(val)   WR(ea, val)
+#define STORE_ZPX(val)  WR(ea, val)
+#define STORE_ABS(val)  WR(ea, val)
+#define STORE_ABSX(val) WR(ea, val)
+
+/* Taken conditional branch; pc already points past the branch */
+#define BRANCH                              \
+    {                                       \
+        if ((ea ^ pc) & 0xff00) extra += 1; \
+        extra += 1;                         \
+        pc = ea + 2;                        \
+    }
+
+/* Shared by CMP, CPX and CPY */
+#define COMPARE(reg)                     \
+    {                                    \
+        uint8_t operand = RD(ea);        \
+        uint8_t tmpDiff = reg - operand; \
+        NZ(tmpDiff);                     \
+        c = reg >= operand;              \
+    }
+
+/* Load a decimal mode ADC or SBC result from its table */
+#define DECIMAL(entry)                         \
+    {                                          \
+        uint16_t result = (entry);             \
+        uint8_t  flags  = result >> 8;         \
+        a               = result & 0xFF;       \
+        c               = flags & SR_CARRY;    \
+        v               = flags & SR_OVERFLOW; \
+        nres            = flags;               \
+        zres            = !(flags & SR_ZERO);  \
+        extra += cpu->decimal == DECIMAL_CMOS; \
+    }
+
+/* ↓Instruction set implementation, pc already points to the next instruction↓ */
+
+#define OP_ADC(m)                                          \
+    {                                                      \
+        uint8_t      operand = RD(ea);                     \
+        unsigned int tmp     = a + operand + c;            \
+        if (d) {                                           \
+            DECIMAL(bcd_adc[cpu->decimal][c][a][operand]); \
+        } else {                                           \
+            c = tmp > 0xFF;                                \
+            v = ((a ^ tmp) & (operand ^ tmp) & 0x80) != 0; \
+            a = tmp & 0xFF;                                \
+            NZ(a);                                         \
+        }                                                  \
+    }
+#define OP_AND(m) a &= RD(ea), NZ(a);
+#define OP_ASL(m)                        \
+    {                                    \
+        uint8_t tmp = LOAD_##m;          \
+        c           = (tmp & 0x80) != 0; \
+        tmp <<= 1;                       \
+        NZ(tmp);                         \
+        STORE_##m(tmp);                  \
+    }
+#define OP_BCC(m) if (!c) BRANCH
+#define OP_BCS(m) if (c) BRANCH
+#define OP_BEQ(m) if (!zres) BRANCH
+#define OP_BIT(m)                        \
+    {                                    \
+        uint8_t tmp = RD(ea);            \
+        nres        = tmp;               \
+        zres        = tmp & a;           \
+        v           = (tmp & 0x40) != 0; \
+    }
+#define OP_BMI(m) if (nres & 0x80) BRANCH
+#define OP_BNE(m) if (zres) BRANCH
+#define OP_BPL(m) if (!(nres & 0x80)) BRANCH
+#define OP_BRK(m)                                  \
+    {                                              \
+        pc += 1;                                   \
+        PUSH(pc >> 8);                             \
+        PUSH(pc & 0xFF);                           \
+        b = 1;                                     \
+        PUSH(SR_BYTE());                           \
+        i  = 1;                                    \
+        pc = mem[IRQ_VEC] | mem[IRQ_VEC + 1] << 8; \
+    }
+#define OP_BVC(m) if (!v) BRANCH
+#define OP_BVS(m) if (v) BRANCH
+#define OP_CLC(m) c = 0;
+#define OP_CLD(m) d = 0;
+#define OP_CLI(m) i = 0, POLL();
+#define OP_CLV(m) v = 0;
+#define OP_CMP(m) COMPARE(a)
+#define OP_CPX(m) COMPARE(x)
+#define OP_CPY(m) COMPARE(y)
+#define OP_DEC(m)                 \
+    {                             \
+        uint8_t tmp = RD(ea) - 1; \
+        NZ(tmp);                  \
+        WR(ea, tmp);              \
+    }
+#define OP_DEX(m) x--, NZ(x);
+#define OP_DEY(m) y--, NZ(y);
+#define OP_EOR(m) a ^= RD(ea), NZ(a);
+#define OP_INC(m)                 \
+    {                             \
+        uint8_t tmp = RD(ea) + 1; \
+        NZ(tmp);                  \
+        WR(ea, tmp);              \
+    }
+#define OP_INX(m) x++, NZ(x);
+#define OP_INY(m) y++, NZ(y);
+#define OP_JMP(m) pc = ea;
+#define OP_JSR(m)        \
+    {                    \
+        pc -= 1;         \
+        PUSH(pc >> 8);   \
+        PUSH(pc & 0xFF); \
+        pc = ea;         \
+    }
+#define OP_LDA(m) a = RD(ea), NZ(a);
+#define OP_LDX(m) x = RD(ea), NZ(x);
+#define OP_LDY(m) y = RD(ea), NZ(y);
+#define OP_LSR(m)               \
+    {                           \
+        uint8_t tmp = LOAD_##m; \
+        c           = tmp & 1;  \
+        tmp >>= 1;              \
+        NZ(tmp);                \
+        STORE_##m(tmp);         \
+    }
+#define OP_NOP(m) (void)RD(ea);
+#define OP_ORA(m) a |= RD(ea), NZ(a);
+#define OP_PHA(m) PUSH(a);
+#define OP_PHP(m)        \
+    {                    \
+        bool brk = b;    \
+        b        = 1;    \
+        PUSH(SR_BYTE()); \
+        b = brk;         \
+    }
+#define OP_PLA(m) a = PULL(), NZ(a);
+#define OP_PLP(m) SET_SR(PULL()), u = 1, b = 0, POLL();
+#define OP_ROL(m)                \
+    {                            \
+        int tmp = LOAD_##m << 1; \
+        tmp |= c;                \
+        c = tmp > 0xFF;          \
+        tmp &= 0xFF;             \
+        NZ(tmp);                 \
+        STORE_##m(tmp);          \
+    }
+#define OP_ROR(m)           \
+    {                       \
+        int tmp = LOAD_##m; \
+        tmp |= c << 8;      \
+        c = tmp & 1;        \
+        tmp >>= 1;          \
+        NZ(tmp);            \
+        STORE_##m(tmp);     \
+    }
+#define OP_RTI(m)          \
+    {                      \
+        SET_SR(PULL());    \
+        u  = 1;            \
+        pc = PULL();       \
+        pc |= PULL() << 8; \
+        POLL();            \
+    }
+#define OP_RTS(m)          \
+    {                      \
+        pc = PULL();       \
+        pc |= PULL() << 8; \
+        pc += 1;           \
+    }
+#define OP_SBC(m)                                          \
+    {                                                      \
+        uint8_t      operand = RD(ea);                     \
+        unsigned int tmp     = a - operand - 1 + c;        \
+        if (d) {                                           \
+            DECIMAL(bcd_sbc[cpu->decimal][c][a][operand]); \
+        } else {                                           \
+            v = ((a ^ tmp) & (a ^ operand) & 0x80) != 0;   \
+            c = tmp < 0x100;                               \
+            a = tmp & 0xFF;                                \
+            NZ(a);                                         \
+        }                                                  \
+    }
+#define OP_SEC(m) c = 1;
+#define OP_SED(m) d = 1;
+#define OP_SEI(m) i = 1;
+#define OP_STA(m) WR(ea, a), extra = 0;
+#define OP_STX(m) WR(ea, x);
+#define OP_STY(m) WR(ea, y);
+#define OP_TAX(m) x = a, NZ(x);
+#define OP_TAY(m) y = a, NZ(y);
+#define OP_TSX(m) x = sp, NZ(x);
+#define OP_TXA(m) a = x, NZ(a);
+#define OP_TXS(m) sp = x;
+#define OP_TYA(m) a = y, NZ(a);
+
+/* ↓Dispatch↓ */
+
+/* Direct threading via computed goto where available, a switch otherwise */
+#if defined(__GNUC__)
+#define LABEL(opcode) op_##opcode:
+#define DISPATCH()    goto *dispatch[mem[pc]]
+
+#define DISPATCH_ENTRY(opcode, mnemonic, name, mode, cycles) [opcode] = &&op_##opcode,
+#else
+#define LABEL(opcode) case opcode:
+#define DISPATCH()    goto dispatch
+#endif
+
+/* One handler per opcode, with the addressing mode fused into the operation */
+#define HANDLER(opcode, mnemonic, name, mode, cycles) \
+    LABEL(opcode)                                     \
+    {                                                 \
+        unsigned int extra = 0;                       \
+        EA_##mode;                                    \
+        pc += lengths[mode];                          \
+        OP_##name(mode);                              \
+        total += cycles + (cycles == 7 ? 0 : extra);  \
+        count++;                                      \
+    }                                                 \
+    if (pc == break_pc) {                             \
+        reason = STOP_BREAK;                          \
+        goto out;                                     \
+    }                                                 \
+    if (total >= end) {                               \
+        reason = STOP_BUDGET;                         \
+        goto out;                                     \
+    }                                                 \
+    DISPATCH();
+
+/* Execute instructions with the threaded core */
+StopReason run_threaded(CPUMAP *cpu, uint64_t budget, int break_pc)
+{
+#if defined(__GNUC__)
+    static void *const dispatch[0x100] = {INSTRUCTION_LIST(DISPATCH_ENTRY)};
+#endif
+    uint8_t        *mem = cpu->memory;
+    uint8_t         a, x, y, sp;
+    uint16_t        pc, ea;
+    bool            c, i, d, b, u, v;
+    uint8_t         nres, zres;
+    union StatusReg sr;
+    uint64_t        total, end, limit, count;
+    uint8_t         io;
+    StopReason      reason;
+
+    limit = cpu->total_cycles + budget;
+enter:
+    /* Interrupts are taken with the registers stored in the machine; an event scheduled inside the run sends it back to run_cycles */
+    if (interrupt_pending(cpu)) {
+        take_interrupt(cpu);
+        if (cpu->PC == break_pc) return STOP_BREAK;
+        if (cpu->total_cycles >= limit || (cpu->interrupts & EVENT_DUE)) return STOP_BUDGET;
+    }
+    a     = cpu->A;
+    x     = cpu->X;
+    y     = cpu->Y;
+    sp    = cpu->SP;
+    pc    = cpu->PC;
+    total = cpu->total_cycles;
+    count = cpu->total_instructions;
+    end   = limit;
+    SET_SR(cpu->SR.byte);
+
+#if defined(__GNUC__)
+    DISPATCH();
+    INSTRUCTION_LIST(HANDLER)
+#else
+dispatch:
+    switch (mem[pc]) { INSTRUCTION_LIST(HANDLER) }
+#endif
+
+out:
+    cpu->A                  = a;
+    cpu->X                  = x;
+    cpu->Y                  = y;
+    cpu->SP                 = sp;
+    cpu->PC                 = pc;
+    cpu->total_cycles       = total;
+    cpu->total_instructions = count;
+    set_status(cpu, SR_BYTE());
+    /* Stopped early by POLL: go on after taking the interrupt or leaving for the event, or at once if the IRQ is masked */
+    if (reason == STOP_BUDGET && total < limit) goto enter;
+    return reason;
+}
@@ -0,0 +1,237 @@
+/*
+ *
+ *      validate.c
+ *      Reference trace validation
+ *
+ *      2024/12/13 By MicroFish
+ *      Based on MIT open source agreement
+ *      Copyright © 2020 ViudiraTech, based on the MIT agreement.
+ *
+ */
+
+#include <ctype.h>
+#include <inttypes.h>
+
+#define INCLUDE
+#include "6502.h"
+#include "validate.h"
+
+/* Where a reference stands */
+typedef enum { REFERENCE_RUNNING, REFERENCE_END, REFERENCE_DIVERGED } ReferenceStatus;
+
+/* Field mismatches of one instruction */
+#define DIFF_PC     0x01
+#define DIFF_OPCODE 0x02
+#define DIFF_A      0x04
+#define DIFF_X      0x08
+#define DIFF_Y      0x10
+#define DIFF_SR     0x20
+#define DIFF_SP     0x40
+#define DIFF_CYCLES 0x80
+
+/* Reference trace state */
+struct Reference {
+        FILE           *fp;
+        int             text;        // Text log rather than a binary trace
+        ReferenceStatus status;
+        uint64_t        index;       // Instructions matched so far
+        TraceRecord     expected;    // State the reference expects before the next instruction
+        int             length;      // Opcode bytes given by the reference
+        uint64_t        ref_cycles;  // Cycle count of the reference before the expected instruction
+
+        /* Binary traces are read a chunk at a time */
+        TraceRecord buf[REFERENCE_CHUNK];
+        size_t      len;
+        size_t      pos;
+
+        /* Text logs carry the PPU dot (CYC:%3d) or, with a PPU: column, the total cycles, from an arbitrary start */
+        char     line[REFERENCE_LINE];
+        size_t   line_number;
+        int      has_cycles;
+        int      total_cycles;
+        uint64_t cycle_base;
+};
+
+/* Whether a field starts with count hex digits */
+static inline int hex_digits(const char *field, int count)
+{
+    while (count-- > 0)
+        if (!isxdigit((unsigned char)*field++)) return 0;
+    return 1;
+}
+
+/* Parse a text log line; returns 0 if it does not describe an instruction, -1 if it is a damaged record */
+static int parse_line(Reference *ref)
+{
+    unsigned int pc, byte, a, x, y, sr, sp, cycles;
+    const char  *field;
+    char        *line = ref->line;
+    long         start;
+
+    if ((field = strstr(line, " A:")) == NULL || sscanf(field, " A:%2x X:%2x Y:%2x P:%2x SP:%2x", &a, &x, &y, &sr, &sp) != 5) return 0;
+
+    /* Program output without a newline can run into the record: look back from the registers for the PC and the first opcode byte */
+    for (start = field - line - 8; start >= 0; start--)
+        if (hex_digits(line + start, 4) && line[start + 4] == ' ' && line[start + 5] == ' ' && hex_digits(line + start + 6, 2)) break;
+    if (start < 0) {
+        fprintf(stderr, "Error: reference line %zu has registers but no PC and opcode bytes before them.\n", ref->line_number);
+        return -1;
+    }
+    memmove(line, line + start, strlen(line + start) + 1);
+    sscanf(line, "%4x", &pc);
+
+    memset(&ref->expected, 0, sizeof(ref->expected));
+    for (ref->length = 0; ref->length < 3; ref->length++) {
+        field = line + 6 + 3 * ref->length;
+        if (!isxdigit((unsigned char)field[0]) || !isxdigit((unsigned char)field[1]) || sscanf(field, "%2x", &byte) != 1) break;
+        ref->expected.opcode[ref->length] = byte;
+    }
+    ref->expected.PC = pc;
+    ref->expected.A  = a;
+    ref->expected.X  = x;
+    ref->expected.Y  = y;
+    ref->expected.SR = sr;
+    ref->expected.SP = sp;
+
+    ref->has_cycles = (field = strstr(line, "CYC:")) != NULL && sscanf(field, "CYC:%u", &cycles) == 1;
+    if (ref->has_cycles) {
+        ref->total_cycles = strstr(line, "PPU:") != NULL;
+        ref->ref_cycles   = cycles;
+    }
+    line[strcspn(line, "\r\n")] = '\0';
+    return 1;
+}
+
+/* Load the next expected instruction; returns 0 at the end of the reference, -1 at a damaged record */
+static int next_expected(Reference *ref)
+{
+    int parsed;
+
+    if (ref->text) {
+        while (fgets(ref->line, sizeof(ref->line), ref->fp)) {
+            ref->line_number++;
+            if ((parsed = parse_line(ref)) != 0) return parsed;
+        }
+        return 0;
+    }
+    if (ref->pos == ref->len) {
+        ref->len = fread(ref->buf, sizeof(TraceRecord), REFERENCE_CHUNK, ref->fp);
+        ref->pos = 0;
+        if (ref->len == 0) return 0;
+    }
+    if (ref->index > 0) ref->ref_cycles += ref->expected.cycles;
+    ref->expected = ref->buf[ref->pos++];
+    ref->length   = 3;
+    return 1;
+}
+
+/* Move on to the next expected instruction, ending the reference after its last one */
+static void advance_reference(Reference *ref)
+{
+    int loaded = next_expected(ref);
+
+    if (loaded < 0)
+        ref->status = REFERENCE_DIVERGED;
+    else if (loaded == 0)
+        ref->status = REFERENCE_END;
+}
+
+/* Open a reference trace: a binary trace written by -T, or a text log in the -v or nestest layout */
+Reference *open_reference(const char *filename)
+{
+    Reference  *ref = calloc(1, sizeof(Reference));
+    TraceHeader header;
+
+    if (ref == NULL) {
+        printf("Error: Unable to allocate the reference.\n");
+        return NULL;
+    }
+    if ((ref->fp = fopen(filename, "r")) == NULL) {
+        printf("Error: Unable to open file.\n");
+        free(ref);
+        return NULL;
+    }
+    if (fread(&header, sizeof(header), 1, ref->fp) == 1 && memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) == 0) {
+        ref->ref_cycles = header.start_cycles;
+    } else {
+        ref->text = 1;
+        rewind(ref->fp);
+    }
+    advance_reference(ref);
+    return ref;
+}
+
+/* Compare the cycle count before an instruction with the text log, whose count starts from its own origin */
+static int cycles_differ(Reference *ref, uint64_t total_cycles)
+{
+    if (!ref->has_cycles) return 0;
+    if (ref->total_cycles) {
+        if (ref->index == 0) ref->cycle_base = ref->ref_cycles - total_cycles;
+        return ref->ref_cycles != total_cycles + ref->cycle_base;
+    }
+    if (ref->index == 0) ref->cycle_base = (ref->ref_cycles + 341 - total_cycles * 3 % 341) % 341;
+    return ref->ref_cycles != (total_cycles * 3 + ref->cycle_base) % 341;
+}
+
+/* Print a divergence between the reference and the run */
+static void report_divergence(Reference *ref, const TraceRecord *rec, uint64_t total_cycles, int diff)
+{
+    static const char *const names[] = {"PC", "opcode", "A", "X", "Y", "P", "SP", "cycles"};
+    int                      i;
+
+    fprintf(stderr, "Reference diverged at instruction %" PRIu64 ":\n  expected: ", ref->index);
+    if (ref->text)
+        fprintf(stderr, "%s\n", ref->line);
+    else
+        print_trace(stderr, &ref->expected, ref->ref_cycles);
+    fprintf(stderr, "  actual:   ");
+    print_trace(stderr, rec, total_cycles);
+    fprintf(stderr, "  differs in:");
+    for (i = 0; i < 8; i++)
+        if (diff & (1 << i)) fprintf(stderr, " %s", names[i]);
+    if (!ref->text && (diff & DIFF_CYCLES)) fprintf(stderr, " (took %d, expected %d)", rec->cycles, ref->expected.cycles);
+    fprintf(stderr, "\n");
+}
+
+/* Check an executed instruction against the reference; returns nonzero when the run has to stop */
+int check_reference(Reference *ref, const TraceRecord *rec, uint64_t total_cycles)
+{
+    const TraceRecord *exp = &ref->expected;
+    int                diff;
+
+    if (ref->status != REFERENCE_RUNNING) return 1;
+    diff = (rec->PC != exp->PC ? DIFF_PC : 0) | (memcmp(rec->opcode, exp->opcode, ref->length) ? DIFF_OPCODE : 0) |
+           (rec->A != exp->A ? DIFF_A : 0) | (rec->X != exp->X ? DIFF_X : 0) | (rec->Y != exp->Y ? DIFF_Y : 0) |
+           (rec->SR != exp->SR ? DIFF_SR : 0) | (rec->SP != exp->SP ? DIFF_SP : 0);
+    if (ref->text ? cycles_differ(ref, total_cycles) : rec->cycles != exp->cycles) diff |= DIFF_CYCLES;
+    if (diff) {
+        report_divergence(ref, rec, total_cycles, diff);
+        ref->status = REFERENCE_DIVERGED;
+        return 1;
+    }
+    ref->index++;
+    advance_reference(ref);
+    return ref->status != REFERENCE_RUNNING;
+}
+
+/* Whether the reference ended or diverged */
+int reference_done(Reference *ref)
+{
+    return ref->status != REFERENCE_RUNNING;
+}
+
+/* Print the outcome and release the reference; returns -1 if the run diverged */
+int close_reference(Reference *ref)
+{
+    int status = ref->status == REFERENCE_DIVERGED ? -1 : 0;
+
+    if (ref->status == REFERENCE_DIVERGED)
+        fprintf(stderr, "Validation failed after %" PRIu64 " matching instructions\n", ref->index);
+    else if (ref->status == REFERENCE_END)
+        fprintf(stderr, "Validated %" PRIu64 " instructions: the run matches the whole reference\n", ref->index);
+    else
+        fprintf(stderr, "Validated %" PRIu64 " instructions: the run stopped before the end of the reference\n", ref->index);
+    fclose(ref->fp);
+    free(ref);
+    return status;
+}
@@ -0,0 +1,30 @@
+/*
+ *
+ *      validate.h
+ *      Reference trace validation header file
+ *
+ *      2024/12/13 By MicroFish
+ *      Based on MIT open source agreement
+ *      Copyright © 2020 ViudiraTech, based on the MIT agreement.
+ *
+ */
+
+#ifndef INCLUDE_VALIDATE_H_
+#define INCLUDE_VALIDATE_H_
+
+#define REFERENCE_CHUNK 4096 // Binary reference records read at a time
+#define REFERENCE_LINE  256  // Longest text reference line
+
+/* Open a reference trace: a binary trace written by -T, or a text log in the -v or nestest layout */
+Reference *open_reference(const char *filename);
+
+/* Check an executed instruction against the reference; returns nonzero when the run has to stop */
+int check_reference(Reference *ref, const TraceRecord *rec, uint64_t total_cycles);
+
+/* Whether the reference ended or diverged */
+int reference_done(Reference *ref);
+
+/* Print the outcome and release the reference; returns -1 if the run diverged */
+int close_reference(Reference *ref);
+
+#endif // INCLUDE_VALIDATE_H_